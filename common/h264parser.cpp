@@ -0,0 +1,596 @@
+// Lightweight H.264 header parser
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#include "h264parser.h"
+#include "startcode.h"
+
+#include <string.h>
+
+#define DEBUG 0
+#define LOG_PREFIX "[h264parser]"
+#include <common/log.h>
+
+// Everything we need from a slice header is in the first few bytes
+const int SLICE_HEADER_MAX = 64;
+
+// SEI payloadType
+const int SEI_RECOVERY_POINT = 6;
+
+/**
+ * Reads Exp-Golomb coded RBSP data. Reading past the end returns zeros
+ * and sets the overrun flag.
+ * */
+class H264Parser::BitReader
+{
+	public:
+		BitReader(const uint8_t* buf, int size)
+		 : m_buf(buf)
+		 , m_bits(size * 8)
+		 , m_pos(0)
+		{}
+		
+		inline unsigned int bit()
+		{
+			if(m_pos >= m_bits)
+			{
+				m_pos = m_bits + 1;
+				return 0;
+			}
+			
+			unsigned int b = (m_buf[m_pos >> 3] >> (7 - (m_pos & 7))) & 1;
+			m_pos++;
+			return b;
+		}
+		
+		unsigned int bits(int n)
+		{
+			unsigned int v = 0;
+			while(n--)
+				v = (v << 1) | bit();
+			return v;
+		}
+		
+		unsigned int ue()
+		{
+			int zeros = 0;
+			while(!bit())
+			{
+				if(++zeros > 31 || overrun())
+				{
+					m_pos = m_bits + 1;
+					return 0;
+				}
+			}
+			
+			return ((1u << zeros) - 1) + bits(zeros);
+		}
+		
+		int se()
+		{
+			unsigned int v = ue();
+			return (v & 1) ? (int)((v + 1) / 2) : -(int)(v / 2);
+		}
+		
+		inline void seek(int pos)
+		{ m_pos = (pos > m_bits) ? m_bits + 1 : pos; }
+		inline int pos() const
+		{ return m_pos; }
+		inline int bitsLeft() const
+		{ return m_bits - m_pos; }
+		inline bool overrun() const
+		{ return m_pos > m_bits; }
+	private:
+		const uint8_t* m_buf;
+		int m_bits;
+		int m_pos;
+};
+
+H264Parser::H264Parser()
+ : m_recovery(-1)
+ , m_lastId(-1)
+{
+	memset(m_sps, 0, sizeof(m_sps));
+	memset(m_pps, 0, sizeof(m_pps));
+	memset(&m_pic, 0, sizeof(m_pic));
+	m_pic.recovery_frame_cnt = -1;
+	
+	reset();
+}
+
+void H264Parser::reset()
+{
+	m_prevPocMsb = 0;
+	m_prevPocLsb = 0;
+	m_prevFrameNum = 0;
+	m_prevFrameNumOffset = 0;
+}
+
+const H264SPS* H264Parser::sps(int id) const
+{
+	if(id < 0 || id >= H264_MAX_SPS_COUNT || !m_sps[id].valid)
+		return 0;
+	
+	return &m_sps[id];
+}
+
+const H264PPS* H264Parser::pps(int id) const
+{
+	if(id < 0 || id >= H264_MAX_PPS_COUNT || !m_pps[id].valid)
+		return 0;
+	
+	return &m_pps[id];
+}
+
+bool H264Parser::randomAccess() const
+{
+	if(!m_pic.valid)
+		return false;
+	
+	if(m_pic.idr)
+		return true;
+	
+	return m_pic.recovery_frame_cnt >= 0
+		&& (m_pic.slice_type == H264_SLICE_I || m_pic.slice_type == H264_SLICE_SI);
+}
+
+bool H264Parser::cleanRandomAccess() const
+{
+	if(!randomAccess())
+		return false;
+	
+	return m_pic.idr || m_pic.recovery_frame_cnt == 0;
+}
+
+int H264Parser::parsePacket(const uint8_t* buf, int size)
+{
+	m_pic.valid = false;
+	m_recovery = -1;
+	m_nals.clear();
+	
+	int next_start = startcode_find(buf, size);
+	
+	while(next_start >= 0)
+	{
+		int start = startcode_begin(buf, next_start);
+		int off = next_start + 3;
+		if(off >= size)
+			break;
+		
+		next_start = startcode_find(buf + off, size - off);
+		if(next_start >= 0)
+			next_start += off;
+		
+		int end = (next_start < 0) ? size : startcode_begin(buf, next_start);
+		int type = buf[off] & 0x1F;
+		
+		if(parseNAL(buf + off, end - off) < 0)
+			log_debug("Could not parse NAL unit of type %d", type);
+		
+		H264NALRef ref;
+		ref.type = type;
+		ref.id = m_lastId;
+		ref.start = start;
+		ref.end = end;
+		m_nals.push_back(ref);
+		
+		// Parameter sets and SEI come in front of the slices
+		if(type == H264_NAL_SLICE || type == H264_NAL_IDR)
+			break;
+	}
+	
+	return m_pic.valid ? 0 : -1;
+}
+
+/**
+ * Copy the NAL unit payload to m_rbsp, removing emulation prevention
+ * bytes.
+ *
+ * @param max Stop after this many input bytes
+ * @return RBSP size
+ * */
+int H264Parser::unescape(const uint8_t* nal, int size, int max)
+{
+	if(size > max)
+		size = max;
+	
+	if((int)m_rbsp.size() < size + 1)
+		m_rbsp.resize(size + 1);
+	
+	int zeros = 0;
+	int out = 0;
+	
+	for(int i = 0; i < size; ++i)
+	{
+		uint8_t b = nal[i];
+		
+		if(zeros >= 2 && b == 3)
+		{
+			zeros = 0;
+			continue;
+		}
+		
+		m_rbsp[out++] = b;
+		zeros = b ? 0 : zeros + 1;
+	}
+	
+	return out;
+}
+
+int H264Parser::parseNAL(const uint8_t* nal, int size)
+{
+	if(size < 1)
+		return -1;
+	
+	int nal_ref_idc = (nal[0] >> 5) & 0x03;
+	int type = nal[0] & 0x1F;
+	int ret = 0;
+	
+	m_lastId = -1;
+	
+	int max = (type == H264_NAL_SLICE || type == H264_NAL_IDR) ? SLICE_HEADER_MAX : size;
+	int len = unescape(nal + 1, size - 1, max);
+	
+	BitReader r(&m_rbsp[0], len);
+	
+	switch(type)
+	{
+		case H264_NAL_SPS:
+			ret = parseSPS(&r);
+			break;
+		case H264_NAL_PPS:
+			ret = parsePPS(&r);
+			break;
+		case H264_NAL_SEI:
+			ret = parseSEI(&r);
+			break;
+		case H264_NAL_SLICE:
+		case H264_NAL_IDR:
+			ret = parseSlice(&r, type, nal_ref_idc);
+			break;
+	}
+	
+	return (ret < 0) ? ret : type;
+}
+
+void H264Parser::skipScalingList(BitReader* r, int size)
+{
+	int last = 8;
+	int next = 8;
+	
+	for(int i = 0; i < size; ++i)
+	{
+		if(next != 0)
+			next = (last + r->se() + 256) % 256;
+		if(next != 0)
+			last = next;
+	}
+}
+
+int H264Parser::parseSPS(BitReader* r)
+{
+	H264SPS sps;
+	memset(&sps, 0, sizeof(sps));
+	
+	sps.profile_idc = r->bits(8);
+	r->bits(8); // constraint_set flags, reserved_zero_2bits
+	sps.level_idc = r->bits(8);
+	
+	unsigned int id = r->ue();
+	if(id >= (unsigned int)H264_MAX_SPS_COUNT)
+		return error("Invalid SPS id %u", id);
+	
+	sps.chroma_format_idc = 1;
+	
+	switch(sps.profile_idc)
+	{
+		case 100: case 110: case 122: case 244: case 44:
+		case 83: case 86: case 118: case 128: case 138:
+		case 139: case 134: case 135:
+			sps.chroma_format_idc = r->ue();
+			if(sps.chroma_format_idc == 3)
+				sps.separate_colour_plane = r->bit();
+			
+			r->ue(); // bit_depth_luma_minus8
+			r->ue(); // bit_depth_chroma_minus8
+			r->bit(); // qpprime_y_zero_transform_bypass_flag
+			
+			if(r->bit()) // seq_scaling_matrix_present_flag
+			{
+				int count = (sps.chroma_format_idc != 3) ? 8 : 12;
+				for(int i = 0; i < count; ++i)
+				{
+					if(r->bit())
+						skipScalingList(r, (i < 6) ? 16 : 64);
+				}
+			}
+			break;
+	}
+	
+	sps.log2_max_frame_num = r->ue() + 4;
+	sps.poc_type = r->ue();
+	
+	if(sps.poc_type == 0)
+		sps.log2_max_poc_lsb = r->ue() + 4;
+	else if(sps.poc_type == 1)
+	{
+		sps.delta_pic_order_always_zero = r->bit();
+		sps.offset_for_non_ref_pic = r->se();
+		sps.offset_for_top_to_bottom_field = r->se();
+		sps.num_ref_frames_in_poc_cycle = r->ue();
+		
+		if(sps.num_ref_frames_in_poc_cycle > 255)
+			return error("Invalid num_ref_frames_in_pic_order_cnt_cycle");
+		
+		for(int i = 0; i < sps.num_ref_frames_in_poc_cycle; ++i)
+			sps.offset_for_ref_frame[i] = r->se();
+	}
+	else if(sps.poc_type != 2)
+		return error("Invalid pic_order_cnt_type %d", sps.poc_type);
+	
+	if(sps.log2_max_frame_num > 16 || sps.log2_max_poc_lsb > 16)
+		return error("Invalid SPS");
+	
+	sps.max_num_ref_frames = r->ue();
+	r->bit(); // gaps_in_frame_num_value_allowed_flag
+	sps.width_mbs = r->ue() + 1;
+	sps.height_mbs = r->ue() + 1;
+	sps.frame_mbs_only = r->bit();
+	
+	if(!sps.frame_mbs_only)
+		sps.height_mbs *= 2;
+	
+	if(r->overrun())
+		return error("SPS too short");
+	
+	sps.valid = true;
+	m_sps[id] = sps;
+	m_lastId = id;
+	
+	return 0;
+}
+
+int H264Parser::parsePPS(BitReader* r)
+{
+	H264PPS pps;
+	memset(&pps, 0, sizeof(pps));
+	
+	unsigned int id = r->ue();
+	if(id >= (unsigned int)H264_MAX_PPS_COUNT)
+		return error("Invalid PPS id %u", id);
+	
+	pps.sps_id = r->ue();
+	if(pps.sps_id >= H264_MAX_SPS_COUNT)
+		return error("Invalid SPS id %d in PPS", pps.sps_id);
+	
+	pps.entropy_coding_mode = r->bit();
+	pps.bottom_field_pic_order_in_frame_present = r->bit();
+	
+	if(r->overrun())
+		return error("PPS too short");
+	
+	pps.valid = true;
+	m_pps[id] = pps;
+	m_lastId = id;
+	
+	return 0;
+}
+
+int H264Parser::parseSEI(BitReader* r)
+{
+	// Anything left apart from rbsp_trailing_bits?
+	while(r->bitsLeft() > 8)
+	{
+		int type = 0;
+		int size = 0;
+		unsigned int b;
+		
+		do
+			type += (b = r->bits(8));
+		while(b == 0xFF && !r->overrun());
+		
+		do
+			size += (b = r->bits(8));
+		while(b == 0xFF && !r->overrun());
+		
+		if(r->overrun())
+			return -1;
+		
+		int end = r->pos() + 8 * size;
+		
+		if(type == SEI_RECOVERY_POINT)
+		{
+			m_recovery = r->ue();
+			log_debug("Recovery point, recovery_frame_cnt = %d", m_recovery);
+		}
+		
+		r->seek(end);
+	}
+	
+	return 0;
+}
+
+int H264Parser::parseSlice(BitReader* r, int type, int nal_ref_idc)
+{
+	r->ue(); // first_mb_in_slice
+	unsigned int slice_type = r->ue();
+	unsigned int pps_id = r->ue();
+	
+	if(slice_type > 9)
+		return error("Invalid slice type %u", slice_type);
+	
+	const H264PPS* p = pps(pps_id);
+	if(!p)
+	{
+		// Normal at the start of the stream
+		log_debug("Slice references unknown PPS %u", pps_id);
+		return -1;
+	}
+	
+	const H264SPS* s = sps(p->sps_id);
+	if(!s)
+	{
+		log_debug("PPS %u references unknown SPS %d", pps_id, p->sps_id);
+		return -1;
+	}
+	
+	if(s->separate_colour_plane)
+		r->bits(2); // colour_plane_id
+	
+	int frame_num = r->bits(s->log2_max_frame_num);
+	bool field = false;
+	bool bottom_field = false;
+	
+	if(!s->frame_mbs_only)
+	{
+		field = r->bit();
+		if(field)
+			bottom_field = r->bit();
+	}
+	
+	if(type == H264_NAL_IDR)
+		r->ue(); // idr_pic_id
+	
+	int poc_lsb = 0;
+	int delta_bottom = 0;
+	int delta[2] = {0, 0};
+	
+	if(s->poc_type == 0)
+	{
+		poc_lsb = r->bits(s->log2_max_poc_lsb);
+		if(p->bottom_field_pic_order_in_frame_present && !field)
+			delta_bottom = r->se();
+	}
+	else if(s->poc_type == 1 && !s->delta_pic_order_always_zero)
+	{
+		delta[0] = r->se();
+		if(p->bottom_field_pic_order_in_frame_present && !field)
+			delta[1] = r->se();
+	}
+	
+	if(r->overrun())
+		return error("Slice header too short");
+	
+	m_pic.valid = true;
+	m_pic.nal_ref_idc = nal_ref_idc;
+	m_pic.idr = (type == H264_NAL_IDR);
+	m_pic.slice_type = slice_type % 5;
+	m_pic.pps_id = pps_id;
+	m_pic.sps_id = p->sps_id;
+	m_pic.frame_num = frame_num;
+	m_pic.field = field;
+	m_pic.bottom_field = bottom_field;
+	m_pic.recovery_frame_cnt = m_recovery;
+	
+	computePOC(s, poc_lsb, delta_bottom, delta);
+	
+	return 0;
+}
+
+/**
+ * Picture order count, see H.264 8.2.1
+ * */
+void H264Parser::computePOC(const H264SPS* sps, int poc_lsb, int delta_bottom, const int* delta)
+{
+	int max_frame_num = 1 << sps->log2_max_frame_num;
+	int frame_num = m_pic.frame_num;
+	int frame_num_offset;
+	int top = 0;
+	int bottom = 0;
+	
+	if(m_pic.idr)
+	{
+		m_prevPocMsb = 0;
+		m_prevPocLsb = 0;
+		frame_num_offset = 0;
+	}
+	else if(m_prevFrameNum > frame_num)
+		frame_num_offset = m_prevFrameNumOffset + max_frame_num;
+	else
+		frame_num_offset = m_prevFrameNumOffset;
+	
+	switch(sps->poc_type)
+	{
+		case 0:
+		{
+			int max_lsb = 1 << sps->log2_max_poc_lsb;
+			int msb;
+			
+			if(poc_lsb < m_prevPocLsb && m_prevPocLsb - poc_lsb >= max_lsb / 2)
+				msb = m_prevPocMsb + max_lsb;
+			else if(poc_lsb > m_prevPocLsb && poc_lsb - m_prevPocLsb > max_lsb / 2)
+				msb = m_prevPocMsb - max_lsb;
+			else
+				msb = m_prevPocMsb;
+			
+			top = msb + poc_lsb;
+			bottom = m_pic.field ? top : top + delta_bottom;
+			
+			if(m_pic.nal_ref_idc)
+			{
+				m_prevPocMsb = msb;
+				m_prevPocLsb = poc_lsb;
+			}
+			break;
+		}
+		case 1:
+		{
+			int n = sps->num_ref_frames_in_poc_cycle;
+			int abs_frame_num = (n != 0) ? frame_num_offset + frame_num : 0;
+			
+			if(m_pic.nal_ref_idc == 0 && abs_frame_num > 0)
+				abs_frame_num--;
+			
+			int expected = 0;
+			if(abs_frame_num > 0)
+			{
+				int cycle = (abs_frame_num - 1) / n;
+				int in_cycle = (abs_frame_num - 1) % n;
+				int delta_cycle = 0;
+				
+				for(int i = 0; i < n; ++i)
+					delta_cycle += sps->offset_for_ref_frame[i];
+				
+				expected = cycle * delta_cycle;
+				for(int i = 0; i <= in_cycle; ++i)
+					expected += sps->offset_for_ref_frame[i];
+			}
+			
+			if(m_pic.nal_ref_idc == 0)
+				expected += sps->offset_for_non_ref_pic;
+			
+			if(!m_pic.field)
+			{
+				top = expected + delta[0];
+				bottom = top + sps->offset_for_top_to_bottom_field + delta[1];
+			}
+			else
+			{
+				top = expected + delta[0];
+				bottom = expected + sps->offset_for_top_to_bottom_field + delta[0];
+			}
+			break;
+		}
+		case 2:
+		{
+			int poc;
+			
+			if(m_pic.idr)
+				poc = 0;
+			else if(m_pic.nal_ref_idc == 0)
+				poc = 2 * (frame_num_offset + frame_num) - 1;
+			else
+				poc = 2 * (frame_num_offset + frame_num);
+			
+			top = bottom = poc;
+			break;
+		}
+	}
+	
+	if(!m_pic.field)
+		m_pic.poc = (top < bottom) ? top : bottom;
+	else
+		m_pic.poc = m_pic.bottom_field ? bottom : top;
+	
+	m_prevFrameNum = frame_num;
+	m_prevFrameNumOffset = frame_num_offset;
+}
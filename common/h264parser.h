@@ -0,0 +1,179 @@
+// Lightweight H.264 header parser
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#ifndef H264PARSER_H
+#define H264PARSER_H
+
+#include <stdint.h>
+#include <vector>
+
+enum H264NALType
+{
+	H264_NAL_SLICE = 1,
+	H264_NAL_IDR = 5,
+	H264_NAL_SEI = 6,
+	H264_NAL_SPS = 7,
+	H264_NAL_PPS = 8,
+	H264_NAL_AUD = 9
+};
+
+//! slice_type modulo 5
+enum H264SliceType
+{
+	H264_SLICE_P = 0,
+	H264_SLICE_B = 1,
+	H264_SLICE_I = 2,
+	H264_SLICE_SP = 3,
+	H264_SLICE_SI = 4
+};
+
+const int H264_MAX_SPS_COUNT = 32;
+const int H264_MAX_PPS_COUNT = 256;
+
+//! Sequence parameter set (only what is needed for slice headers and POC)
+struct H264SPS
+{
+	bool valid;
+	int profile_idc;
+	int level_idc;
+	int chroma_format_idc;
+	bool separate_colour_plane;
+	int log2_max_frame_num;
+	int poc_type;
+	int log2_max_poc_lsb;
+	bool delta_pic_order_always_zero;
+	int offset_for_non_ref_pic;
+	int offset_for_top_to_bottom_field;
+	int num_ref_frames_in_poc_cycle;
+	int offset_for_ref_frame[256];
+	int max_num_ref_frames;
+	bool frame_mbs_only;
+	int width_mbs;
+	int height_mbs;
+};
+
+//! Picture parameter set (only what is needed for slice headers)
+struct H264PPS
+{
+	bool valid;
+	int sps_id;
+	bool entropy_coding_mode;
+	bool bottom_field_pic_order_in_frame_present;
+};
+
+//! Information about the picture in the last parsed packet
+struct H264Picture
+{
+	bool valid;              //!< A slice header was parsed
+	int nal_ref_idc;         //!< 0 for pictures that are never referenced
+	bool idr;
+	int slice_type;          //!< see H264SliceType
+	int pps_id;
+	int sps_id;
+	int frame_num;
+	bool field;
+	bool bottom_field;
+	int poc;                 //!< Picture order count
+	int recovery_frame_cnt;  //!< From a recovery point SEI, -1 if none
+};
+
+//! Position of a NAL unit in the last parsed packet
+struct H264NALRef
+{
+	int type;
+	int id;     //!< Parameter set id for SPS/PPS, -1 otherwise
+	int start;  //!< Offset of the start code
+	int end;    //!< End offset of the NAL unit
+};
+
+/**
+ * @brief Parses H.264 parameter sets, SEI and slice headers
+ *
+ * Works on the Annex B byte stream, one access unit (packet) at a time.
+ * Only the first slice of each packet is looked at, which is enough to
+ * tell the picture type, its reference status and its POC without
+ * running the decoder.
+ *
+ * Not supported: memory management control operation 5 (POC reset for
+ * non-IDR pictures), which is very rare in broadcast streams.
+ * */
+class H264Parser
+{
+	public:
+		H264Parser();
+		
+		/**
+		 * Parse all NAL units in front of and including the first slice
+		 * in @c buf.
+		 *
+		 * @return non-zero if there was no decodable slice
+		 * */
+		int parsePacket(const uint8_t* buf, int size);
+		
+		/**
+		 * Parse one NAL unit (without start code)
+		 *
+		 * @return NAL unit type, negative on error
+		 * */
+		int parseNAL(const uint8_t* nal, int size);
+		
+		//! Forget the POC history, e.g. after a seek
+		void reset();
+		
+		//! The picture in the last packet
+		inline const H264Picture& picture() const
+		{ return m_pic; }
+		
+		//! Parameter sets (and other NAL units) seen in the last packet
+		inline const std::vector<H264NALRef>& nalUnits() const
+		{ return m_nals; }
+		
+		/**
+		 * Can decoding start at the picture in the last packet, i.e. is
+		 * it an IDR picture or an I picture with a recovery point?
+		 * */
+		bool randomAccess() const;
+		
+		/**
+		 * Is the picture in the last packet and everything following it
+		 * in output order correct without any earlier picture, i.e. is it
+		 * an IDR picture or an I picture with a recovery point right at it?
+		 * Leading pictures (earlier in output order) may still reference
+		 * pictures in front of it.
+		 * */
+		bool cleanRandomAccess() const;
+		
+		//! @return NULL if there is no such parameter set
+		const H264SPS* sps(int id) const;
+		const H264PPS* pps(int id) const;
+	private:
+		class BitReader;
+		
+		static void skipScalingList(BitReader* r, int size);
+		
+		int parseSPS(BitReader* r);
+		int parsePPS(BitReader* r);
+		int parseSEI(BitReader* r);
+		int parseSlice(BitReader* r, int type, int nal_ref_idc);
+		void computePOC(const H264SPS* sps, int poc_lsb, int delta_bottom, const int* delta);
+		
+		int unescape(const uint8_t* nal, int size, int max);
+		
+		H264SPS m_sps[H264_MAX_SPS_COUNT];
+		H264PPS m_pps[H264_MAX_PPS_COUNT];
+		
+		H264Picture m_pic;
+		std::vector<H264NALRef> m_nals;
+		int m_recovery;
+		int m_lastId;
+		
+		std::vector<uint8_t> m_rbsp;
+		
+		// POC state of the previous picture
+		int m_prevPocMsb;
+		int m_prevPocLsb;
+		int m_prevFrameNum;
+		int m_prevFrameNumOffset;
+};
+
+#endif // H264PARSER_H
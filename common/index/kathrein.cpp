@@ -35,7 +35,7 @@ char* KathreinIndexFile::fabricateFilename(const char* stream_filename)
 	const char* tsfile = strrchr(stream_filename, '/');
 	
 	if(!tsfile)
-		return false;
+		return 0;
 	
 	int slash = tsfile - stream_filename;
 	
@@ -44,7 +44,7 @@ char* KathreinIndexFile::fabricateFilename(const char* stream_filename)
 	);
 	
 	if(!filename)
-		return false;
+		return 0;
 	
 	strncpy(filename, stream_filename, slash+1);
 	strcpy(filename+slash+1, FILE_NAME);
@@ -57,6 +57,9 @@ bool KathreinIndexFile::detect(AVFormatContext*,
 {
 	char* filename = fabricateFilename(stream_filename);
 	
+	if(!filename)
+		return false;
+	
 	log_debug("fabricated file name: '%s'", filename);
 	
 	// Try if file is present
@@ -81,6 +84,9 @@ bool KathreinIndexFile::open(const char* filename, const char* stream_filename)
 	if(!filename)
 		filename = my_filename = fabricateFilename(stream_filename);
 	
+	if(!filename)
+		return false;
+	
 	FILE* f = fopen(filename, "rb");
 	
 	free(my_filename);
@@ -0,0 +1,440 @@
+// Fast local file input module for FFmpeg
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#include "io_file.h"
+
+extern "C"
+{
+#include <libavutil/mem.h>
+}
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#else
+// io_file_create() never succeeds on Windows, this is just for linking
+static int pread(int fd, void* buf, int count, int64_t offset)
+{
+	errno = ENOSYS;
+	return -1;
+}
+#endif
+
+#define DEBUG 0
+#define LOG_PREFIX "[io_file]"
+#include <common/log.h>
+
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// Size of the buffer handed to libavformat, i.e. the size of one read.
+// Random access (editor) does not profit from huge reads.
+const int BUFSIZE_SEQUENTIAL = 1024 * 1024;
+const int BUFSIZE_RANDOM = 256 * 1024;
+
+// Ask the kernel to read this much ahead of the current position
+const int64_t READAHEAD_SEQUENTIAL = 16 * 1024 * 1024;
+const int64_t READAHEAD_RANDOM = 4 * 1024 * 1024;
+
+// Follow mode: Check for new data this often (ms) and give up after no
+// new data arrived for this long (s)
+const int FOLLOW_POLL_INTERVAL = 200;
+const int FOLLOW_TIMEOUT = 60;
+
+struct IOFileContext
+{
+	int fd;
+	int flags;
+	int64_t size;
+	int64_t pos;
+	
+	uint8_t* map; //!< Whole file, NULL if using read()
+	
+	int64_t readahead;     //!< Readahead window size
+	int64_t readahead_end; //!< Readahead was requested up to here
+	
+	// Follow mode
+	int inotify;        //!< inotify fd, -1 if polling
+	bool writer_closed;
+	
+	IOFileStats stats;
+};
+
+static double io_file_time()
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void io_file_readahead(IOFileContext* d)
+{
+	if(d->readahead_end > d->pos + d->readahead / 2)
+		return;
+	
+	if(d->readahead_end < d->pos)
+		d->readahead_end = d->pos;
+	
+	int64_t len = d->pos + d->readahead - d->readahead_end;
+	if(len <= 0 || d->readahead_end >= d->size)
+		return;
+
+#ifndef _WIN32
+	if(d->map)
+	{
+		// madvise() needs a page aligned address
+		int64_t page = sysconf(_SC_PAGESIZE);
+		int64_t start = d->readahead_end & ~(page - 1);
+		
+		madvise(d->map + start, d->readahead_end + len - start, MADV_WILLNEED);
+	}
+#endif
+#ifdef __linux__
+	if(!d->map)
+		posix_fadvise(d->fd, d->readahead_end, len, POSIX_FADV_WILLNEED);
+#endif
+	
+	d->readahead_end += len;
+}
+
+#ifdef __linux__
+static void io_file_wait_inotify(IOFileContext* d)
+{
+	struct pollfd pfd;
+	pfd.fd = d->inotify;
+	pfd.events = POLLIN;
+	
+	if(poll(&pfd, 1, FOLLOW_POLL_INTERVAL) <= 0)
+		return;
+	
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int len = read(d->inotify, buf, sizeof(buf));
+	
+	for(int off = 0; off < len; )
+	{
+		struct inotify_event* ev = (struct inotify_event*)(buf + off);
+		
+		if(ev->mask & IN_CLOSE_WRITE)
+			d->writer_closed = true;
+		
+		off += sizeof(struct inotify_event) + ev->len;
+	}
+}
+#endif
+
+/**
+ * Wait for the file to grow beyond the current position.
+ *
+ * @return false if no more data is going to come
+ * */
+static bool io_file_follow(IOFileContext* d)
+{
+	double idle_start = io_file_time();
+	
+	while(1)
+	{
+		struct stat st;
+		if(fstat(d->fd, &st) == 0 && st.st_size > d->size)
+		{
+			d->size = st.st_size;
+			if(d->pos < d->size)
+				return true;
+		}
+		
+		if(d->writer_closed)
+		{
+			log_debug("Writer closed the file, end of input");
+			return false;
+		}
+		
+		if(io_file_time() - idle_start > FOLLOW_TIMEOUT)
+		{
+			log_warning("No new data for %ds, assuming end of input", FOLLOW_TIMEOUT);
+			return false;
+		}
+		
+#ifdef __linux__
+		if(d->inotify >= 0)
+		{
+			io_file_wait_inotify(d);
+			continue;
+		}
+#endif
+		usleep(FOLLOW_POLL_INTERVAL * 1000);
+	}
+}
+
+static int io_file_read_packet(void* opaque, uint8_t* buf, int buf_size)
+{
+	IOFileContext* d = (IOFileContext*)opaque;
+	
+	if(d->pos >= d->size)
+	{
+		if(!(d->flags & IO_FILE_FOLLOW) || !io_file_follow(d))
+			return 0;
+	}
+	
+	double start = io_file_time();
+	int ret;
+	
+	if(d->map)
+	{
+		ret = buf_size;
+		if(ret > d->size - d->pos)
+			ret = d->size - d->pos;
+		
+		memcpy(buf, d->map + d->pos, ret);
+	}
+	else
+	{
+		do
+			ret = pread(d->fd, buf, buf_size, d->pos);
+		while(ret < 0 && errno == EINTR);
+		
+		if(ret < 0)
+		{
+			perror("[io_file] Could not read()");
+			return -1;
+		}
+	}
+	
+	d->pos += ret;
+	io_file_readahead(d);
+	
+	d->stats.bytes += ret;
+	d->stats.reads++;
+	d->stats.seconds += io_file_time() - start;
+	
+	return ret;
+}
+
+static int64_t io_file_seek(void* opaque, int64_t offset, int whence)
+{
+	IOFileContext* d = (IOFileContext*)opaque;
+	int64_t pos;
+	
+	switch(whence & ~AVSEEK_FORCE)
+	{
+		case AVSEEK_SIZE:
+			return d->size;
+		case SEEK_SET:
+			pos = offset;
+			break;
+		case SEEK_CUR:
+			pos = d->pos + offset;
+			break;
+		case SEEK_END:
+			pos = d->size + offset;
+			break;
+		default:
+			return -1;
+	}
+	
+	if(pos < 0)
+		return -1;
+	
+	d->stats.seeks++;
+	d->pos = pos;
+	io_file_readahead(d);
+	
+	return pos;
+}
+
+AVIOContext* io_file_create(const char* path, int flags)
+{
+#ifdef _WIN32
+	return 0;
+#else
+	IOFileContext* d;
+	struct stat st;
+	bool sequential = flags & IO_FILE_SEQUENTIAL;
+	int bufsize;
+	unsigned char* buf;
+	AVIOContext* ctx;
+	
+	int fd = open(path, O_RDONLY | O_LARGEFILE | O_BINARY);
+	if(fd < 0)
+		return 0;
+	
+	// Pipes, devices and the like are left to libavformat
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		close(fd);
+		return 0;
+	}
+	
+	d = new IOFileContext;
+	memset(d, 0, sizeof(*d));
+	d->fd = fd;
+	d->flags = flags;
+	d->size = st.st_size;
+	d->inotify = -1;
+	
+	// The mapping could not grow with the file
+	if(flags & IO_FILE_FOLLOW)
+	{
+		flags |= IO_FILE_NO_MMAP;
+		
+#ifdef __linux__
+		d->inotify = inotify_init();
+		if(d->inotify >= 0 && inotify_add_watch(d->inotify, path, IN_MODIFY | IN_CLOSE_WRITE) < 0)
+		{
+			close(d->inotify);
+			d->inotify = -1;
+		}
+		
+		if(d->inotify < 0)
+			log_debug_perror("Could not use inotify, polling instead");
+#endif
+	}
+	
+	d->readahead = sequential ? READAHEAD_SEQUENTIAL : READAHEAD_RANDOM;
+	bufsize = sequential ? BUFSIZE_SEQUENTIAL : BUFSIZE_RANDOM;
+	
+	// The whole file has to fit into the address space comfortably,
+	// which rules out large recordings on 32 bit systems.
+	if(!(flags & IO_FILE_NO_MMAP) && d->size > 0
+		&& (uint64_t)d->size < ((size_t)-1) / 4)
+	{
+		void* map = mmap(0, d->size, PROT_READ, MAP_SHARED, fd, 0);
+		if(map != MAP_FAILED)
+		{
+			d->map = (uint8_t*)map;
+			madvise(map, d->size, sequential ? MADV_SEQUENTIAL : MADV_NORMAL);
+		}
+		else
+			log_debug_perror("Could not mmap() '%s', using read()", path);
+	}
+
+#ifdef __linux__
+	if(!d->map)
+		posix_fadvise(fd, 0, 0, sequential ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_NORMAL);
+#endif
+	
+	io_file_readahead(d);
+	
+	buf = (unsigned char*)av_malloc(bufsize);
+	if(!buf)
+		goto error;
+	
+	ctx = avio_alloc_context(
+		buf, bufsize,
+		0, /* write_flag */
+		(void*)d,
+		&io_file_read_packet,
+		NULL, /* write_packet */
+		&io_file_seek
+	);
+	
+	if(ctx)
+		return ctx;
+	
+	av_free(buf);
+error:
+	if(d->map)
+		munmap(d->map, d->size);
+	if(d->inotify >= 0)
+		close(d->inotify);
+	close(fd);
+	delete d;
+	return 0;
+#endif
+}
+
+void io_file_close(AVIOContext* ctx)
+{
+	IOFileContext* d = (IOFileContext*)ctx->opaque;
+
+#ifndef _WIN32
+	if(d->map)
+		munmap(d->map, d->size);
+#endif
+	if(d->inotify >= 0)
+		close(d->inotify);
+	close(d->fd);
+	delete d;
+	
+	av_free(ctx->buffer);
+	av_free(ctx);
+}
+
+bool io_file_is(AVIOContext* ctx)
+{
+	return ctx && ctx->read_packet == &io_file_read_packet;
+}
+
+void io_file_stats(AVIOContext* ctx, IOFileStats* stats)
+{
+	IOFileContext* d = (IOFileContext*)ctx->opaque;
+	
+	*stats = d->stats;
+}
+
+int io_file_open_input(AVFormatContext** ctx, const char* path, int flags)
+{
+	AVIOContext* pb = io_file_create(path, flags);
+	
+	if(pb)
+	{
+		*ctx = avformat_alloc_context();
+		if(!*ctx)
+		{
+			io_file_close(pb);
+			return AVERROR(ENOMEM);
+		}
+		
+		(*ctx)->pb = pb;
+	}
+	
+	// On failure, the context is freed but a custom pb is left alone
+	int ret = avformat_open_input(ctx, path, NULL, NULL);
+	if(ret != 0 && pb)
+		io_file_close(pb);
+	
+	return ret;
+}
+
+void io_file_close_input(AVFormatContext** ctx)
+{
+	AVIOContext* pb = (*ctx)->pb;
+	
+	avformat_close_input(ctx);
+	
+	if(io_file_is(pb))
+		io_file_close(pb);
+}
+
+void io_file_print_stats(AVFormatContext* ctx, FILE* dest)
+{
+	IOFileStats stats;
+	
+	if(!io_file_is(ctx->pb))
+		return;
+	
+	io_file_stats(ctx->pb, &stats);
+	
+	double mib = stats.bytes / 1024.0 / 1024.0;
+	fprintf(dest, "Read %.1f MiB in %.2fs (%.1f MiB/s, %llu reads, %llu seeks)\n",
+		mib, stats.seconds,
+		stats.seconds > 0 ? mib / stats.seconds : 0.0,
+		(unsigned long long)stats.reads, (unsigned long long)stats.seeks
+	);
+}
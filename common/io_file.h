@@ -0,0 +1,70 @@
+// Fast local file input module for FFmpeg
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#ifndef IO_FILE_H
+#define IO_FILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+enum IOFileFlags
+{
+	IO_FILE_SEQUENTIAL = (1 << 0), //!< Optimize for one pass from start to end
+	IO_FILE_NO_MMAP = (1 << 1),    //!< Use read() even if mmap() is possible
+	IO_FILE_FOLLOW = (1 << 2)      //!< The file is still being written (see below)
+};
+
+struct IOFileStats
+{
+	uint64_t bytes;   //!< Bytes handed to libavformat
+	uint64_t reads;   //!< Number of read requests
+	uint64_t seeks;   //!< Number of seeks (size queries excluded)
+	double seconds;   //!< Time spent waiting for data
+};
+
+/**
+ * @brief Create an input context for a local file
+ *
+ * The file is mapped into memory if possible, otherwise it is read with
+ * large reads while the kernel is asked to read ahead.
+ *
+ * With IO_FILE_FOLLOW, reaching the end of the file waits for more data
+ * instead. The end is reached once the writer closes the file (detected
+ * with inotify on Linux) or there was no new data for a minute.
+ *
+ * @return IO context, NULL if the file cannot be opened this way (use
+ *   the default file protocol of libavformat then)
+ * */
+AVIOContext* io_file_create(const char* path, int flags = IO_FILE_SEQUENTIAL);
+
+void io_file_close(AVIOContext* ctx);
+
+//! Is @c ctx an io_file context?
+bool io_file_is(AVIOContext* ctx);
+
+//! Read statistics since creation
+void io_file_stats(AVIOContext* ctx, IOFileStats* stats);
+
+/**
+ * Replacement for avformat_open_input() which uses io_file_create() for
+ * the file if possible.
+ *
+ * @return see avformat_open_input()
+ * */
+int io_file_open_input(AVFormatContext** ctx, const char* path, int flags = IO_FILE_SEQUENTIAL);
+
+//! Close a context opened with io_file_open_input()
+void io_file_close_input(AVFormatContext** ctx);
+
+/**
+ * Print the read statistics of an input opened with io_file_open_input()
+ * to @c dest. Does nothing if the default file protocol was used.
+ * */
+void io_file_print_stats(AVFormatContext* ctx, FILE* dest);
+
+#endif // IO_FILE_H
@@ -0,0 +1,153 @@
+// Start code scanner for MPEG elementary streams
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#include "startcode.h"
+
+// Runtime dispatch needs target attributes and __builtin_cpu_supports()
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) \
+	&& (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define STARTCODE_X86 1
+#include <immintrin.h>
+#else
+#define STARTCODE_X86 0
+#endif
+
+typedef int (*FindFunc)(const uint8_t* buf, int size);
+
+static FindFunc g_find = 0;
+static const char* g_name = "none";
+
+static int startcode_find_scalar(const uint8_t* buf, int size)
+{
+	// Look at the third byte first: if it is neither 0 nor 1, no start
+	// code can begin at any of the three positions.
+	for(int i = 0; i + 2 < size; )
+	{
+		if(buf[i+2] > 1)
+			i += 3;
+		else if(buf[i+1])
+			i += 2;
+		else if(buf[i] || buf[i+2] != 1)
+			i++;
+		else
+			return i;
+	}
+	
+	return -1;
+}
+
+#if STARTCODE_X86
+// The vector loops only look for two consecutive zero bytes and leave
+// the verification to scalar code. Start codes are rare in coded data.
+
+__attribute__((target("sse2")))
+static int startcode_find_sse2(const uint8_t* buf, int size)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int i = 0;
+	
+	for(; i + 16 + 2 <= size; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+		
+		// Pairs of zero bytes, including one crossing into the next block
+		mask &= (mask >> 1) | (buf[i+16] == 0 ? 0x8000 : 0);
+		
+		while(mask)
+		{
+			int j = i + __builtin_ctz(mask);
+			if(buf[j+2] == 1)
+				return j;
+			mask &= mask - 1;
+		}
+	}
+	
+	int ret = startcode_find_scalar(buf + i, size - i);
+	return (ret < 0) ? -1 : i + ret;
+}
+
+__attribute__((target("avx2")))
+static int startcode_find_avx2(const uint8_t* buf, int size)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	int i = 0;
+	
+	for(; i + 32 + 2 <= size; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*)(buf + i));
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+		
+		mask &= (mask >> 1) | (buf[i+32] == 0 ? 0x80000000u : 0);
+		
+		while(mask)
+		{
+			int j = i + __builtin_ctz(mask);
+			if(buf[j+2] == 1)
+				return j;
+			mask &= mask - 1;
+		}
+	}
+	
+	int ret = startcode_find_scalar(buf + i, size - i);
+	return (ret < 0) ? -1 : i + ret;
+}
+#endif
+
+bool startcode_select(StartCodeImpl impl)
+{
+#if STARTCODE_X86
+	__builtin_cpu_init();
+#endif
+	
+	switch(impl)
+	{
+		case STARTCODE_SCALAR:
+			g_find = &startcode_find_scalar;
+			g_name = "scalar";
+			return true;
+#if STARTCODE_X86
+		case STARTCODE_SSE2:
+			if(!__builtin_cpu_supports("sse2"))
+				return false;
+			g_find = &startcode_find_sse2;
+			g_name = "SSE2";
+			return true;
+		case STARTCODE_AVX2:
+			if(!__builtin_cpu_supports("avx2"))
+				return false;
+			g_find = &startcode_find_avx2;
+			g_name = "AVX2";
+			return true;
+#endif
+		default:
+			return false;
+	}
+}
+
+static void startcode_autoselect()
+{
+	if(startcode_select(STARTCODE_AVX2))
+		return;
+	if(startcode_select(STARTCODE_SSE2))
+		return;
+	
+	startcode_select(STARTCODE_SCALAR);
+}
+
+int startcode_find(const uint8_t* buf, int size)
+{
+	// Every thread arrives at the same choice, so the race is harmless
+	if(!g_find)
+		startcode_autoselect();
+	
+	return g_find(buf, size);
+}
+
+const char* startcode_impl_name()
+{
+	if(!g_find)
+		startcode_autoselect();
+	
+	return g_name;
+}
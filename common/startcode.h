@@ -0,0 +1,46 @@
+// Start code scanner for MPEG elementary streams
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#ifndef STARTCODE_H
+#define STARTCODE_H
+
+#include <stdint.h>
+
+enum StartCodeImpl
+{
+	STARTCODE_SCALAR,
+	STARTCODE_SSE2,
+	STARTCODE_AVX2
+};
+
+/**
+ * @brief Find the next start code prefix (00 00 01)
+ *
+ * Uses SIMD instructions if the CPU supports them (selected at runtime).
+ * H.264 start codes with a leading zero byte (00 00 00 01) are found as
+ * well, see startcode_begin().
+ *
+ * @return offset of the prefix in @c buf, -1 if there is none
+ * */
+int startcode_find(const uint8_t* buf, int size);
+
+/**
+ * Offset of the complete start code found at @c pos by startcode_find(),
+ * i.e. including the zero byte in front of a 4 byte start code.
+ * */
+inline int startcode_begin(const uint8_t* buf, int pos)
+{
+	return (pos > 0 && buf[pos-1] == 0) ? pos-1 : pos;
+}
+
+/**
+ * Force an implementation (for benchmarking).
+ *
+ * @return false if the CPU does not support it
+ * */
+bool startcode_select(StartCodeImpl impl);
+
+//! Name of the implementation in use
+const char* startcode_impl_name();
+
+#endif // STARTCODE_H
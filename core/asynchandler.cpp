@@ -0,0 +1,638 @@
+// Runs the kept segments of a stream concurrently
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#include "asynchandler.h"
+#include "splicequeue.h"
+#include "spscqueue.h"
+#include "packetbuffer.h"
+#include "cutter.h"
+#include "memstats.h"
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+#include <pthread.h>
+#include <algorithm>
+
+#define DEBUG 0
+#define LOG_PREFIX "[async]"
+#include <common/log.h>
+
+//! Key frame intervals in front of a cut point at which its job starts
+static const int JOB_PREROLL_INTERVALS = 3;
+
+/**
+ * Input packets queued per job. A job only covers the window around one
+ * cut point, this is more than such a window has packets, so demuxing
+ * does not wait for the encoder.
+ * */
+static const int JOB_QUEUE_SIZE = 4096;
+
+struct AsyncHandler::Segment
+{
+	StreamHandler* handler;
+	AVStream stream; //!< Input stream copy with a decoder context of its own
+	AVStream ostream; //!< Output stream copy for the encoder settings
+	Muxer* slot;
+	
+	//! Cut points in stream time base
+	std::vector<int64_t> cuts;
+	
+	//! First cut point the input has not passed yet
+	int nextCut;
+	
+	//! Last cut point, INT64_MAX if the segment is open
+	int64_t end;
+	
+	//! No more input, the handler is finished (or the job finishes it)
+	bool finished;
+	
+	// Job, the handler runs on a worker thread while this is set
+	bool running;
+	pthread_t thread;
+	SPSCQueue<AVPacket>* queue;
+	int64_t boundary; //!< Cut point handled by the job
+	int64_t queued; //!< Number of packets queued for the job
+	
+	//! Index of the first queued packet behind @c boundary
+	volatile int64_t boundaryIndex;
+	
+	volatile bool last; //!< Finish the handler at the end of the queue
+	volatile bool failed;
+	volatile bool active; //!< handler->active() after the last packet
+	volatile bool synced; //!< Behind @c boundary and copying again
+	volatile bool done; //!< Worker thread finished
+};
+
+static void splitSegments(const CutPointList& list, std::vector<CutPointList>* segments)
+{
+	CutPointList current;
+	
+	for(int i = 0; i < (int)list.size(); ++i)
+	{
+		current.push_back(list[i]);
+		
+		if(list[i].direction != CutPoint::OUT && i != (int)list.size()-1)
+			continue;
+		
+		segments->push_back(current);
+		current.clear();
+	}
+}
+
+static void freeCodecContext(AVCodecContext* ctx)
+{
+	if(!ctx)
+		return;
+	
+	avcodec_close(ctx);
+	av_freep(&ctx->extradata);
+	av_free(ctx);
+}
+
+AsyncHandler::AsyncHandler(AVStream* stream, StreamHandler* primary)
+ : StreamHandler(stream)
+ , m_primary(primary)
+ , m_inputCodec(0)
+ , m_startAV(0)
+ , m_nextSegment(0)
+ , m_keyFrames(stream->time_base,
+	av_rescale_q(primary->prerollTime(), AV_TIME_BASE_Q, stream->time_base))
+ , m_runningJobs(0)
+ , m_splice(0)
+{
+}
+
+AsyncHandler::~AsyncHandler()
+{
+	// Only non-empty if finish() was not called (error exit)
+	while(!m_open.empty())
+	{
+		freeSegment(m_open.front());
+		m_open.pop_front();
+	}
+	
+	delete m_splice;
+	delete m_primary;
+	
+	if(m_inputCodec)
+	{
+		av_freep(&m_inputCodec->extradata);
+		av_free(m_inputCodec);
+	}
+}
+
+int AsyncHandler::segmentCount(const CutPointList& list)
+{
+	std::vector<CutPointList> segments;
+	splitSegments(list, &segments);
+	
+	return segments.size();
+}
+
+void AsyncHandler::setCutList(const CutPointList& list)
+{
+	m_cutlistAV = list;
+	StreamHandler::setCutList(list);
+}
+
+void AsyncHandler::setStartPTS_AV(int64_t start_av)
+{
+	m_startAV = start_av;
+	StreamHandler::setStartPTS_AV(start_av);
+}
+
+void AsyncHandler::setPrecedingCutout(const CutPointList& list)
+{
+	m_precedingAV = list;
+	StreamHandler::setPrecedingCutout(list);
+}
+
+int AsyncHandler::init()
+{
+	// The jobs open their codecs concurrently
+	if(!registerLockManager())
+		return error("Could not register lock manager");
+	
+	// Unopened copy of the decoder settings. The primary handler opens
+	// the original.
+	m_inputCodec = avcodec_alloc_context3(0);
+	if(!m_inputCodec || avcodec_copy_context(m_inputCodec, stream()->codec) != 0)
+		return error("Could not copy decoder settings");
+	
+	// The primary handler never sees a packet
+	HandlerOptions primaryOptions = options();
+	primaryOptions.preopenEncoders = false;
+	
+	m_primary->setCutList(m_cutlistAV);
+	m_primary->setOutputContext(outputContext());
+	m_primary->setMuxer(muxer());
+	m_primary->setOptions(primaryOptions);
+	m_primary->setOutputStream(outputStream());
+	m_primary->setStartPTS_AV(m_startAV);
+	m_primary->setMemStats(memStats());
+	m_primary->setDecoder(decoder());
+	
+	if(m_primary->init() != 0)
+		return -1;
+	
+	splitSegments(m_cutlistAV, &m_segments);
+	if(m_segments.empty())
+		return error("Empty cut list");
+	
+	m_splice = new SpliceQueue(muxer());
+	
+	setCutout(m_segments[0][0].direction == CutPoint::IN);
+	
+	return 0;
+}
+
+int AsyncHandler::handlePacket(AVPacket* packet)
+{
+	int64_t pts = pts_rel(packet->pts);
+	
+	if(packet->flags & AV_PKT_FLAG_KEY)
+		m_keyFrames.addKeyFrame(pts);
+	
+	// Open the segments whose cut in is coming up. A segment starting
+	// with a cut out begins at the start of the input.
+	while(m_nextSegment < (int)m_segments.size())
+	{
+		const CutPoint& first = m_segments[m_nextSegment][0];
+		int64_t cut = av_rescale_q(first.time, AV_TIME_BASE_Q, stream()->time_base);
+		
+		if(first.direction != CutPoint::OUT
+			&& cut - pts >= JOB_PREROLL_INTERVALS * m_keyFrames.interval())
+			break;
+		
+		if(openSegment() != 0)
+			return -1;
+	}
+	
+	if(freeFinishedSegments() != 0)
+		return -1;
+	
+	std::vector<Segment*> receivers;
+	for(std::deque<Segment*>::iterator it = m_open.begin(); it != m_open.end(); ++it)
+	{
+		Segment* seg = *it;
+		
+		if(seg->finished)
+			continue;
+		
+		if(updateSegment(seg, pts) != 0)
+			return -1;
+		
+		if(!seg->finished)
+			receivers.push_back(seg);
+	}
+	
+	// Every receiver gets its own copy, the last one gets the original
+	for(int i = 0; i < (int)receivers.size(); ++i)
+	{
+		Segment* seg = receivers[i];
+		AVPacket copy;
+		AVPacket* input = packet;
+		
+		if(i != (int)receivers.size()-1)
+		{
+			copy = *packet;
+			copy.destruct = NULL;
+			
+			if(av_dup_packet(&copy) < 0)
+				return error("Could not duplicate packet");
+			
+			input = &copy;
+		}
+		else if(seg->running)
+		{
+			if(movePacket(&copy, packet) != 0)
+				return -1;
+			
+			input = &copy;
+		}
+		
+		if(seg->running)
+		{
+			if(seg->boundaryIndex == INT64_MAX && pts > seg->boundary)
+				seg->boundaryIndex = seg->queued;
+			seg->queued++;
+			
+			accountAlloc(input->size);
+			seg->queue->push(*input);
+			continue;
+		}
+		
+		int ret = seg->handler->handlePacket(input);
+		
+		if(input != packet)
+			av_free_packet(input);
+		
+		if(ret != 0)
+			return error("Handler for stream %d failed", stream()->index);
+	}
+	
+	setCutout(receivers.empty());
+	
+	if(receivers.empty() && m_nextSegment == (int)m_segments.size())
+		setActive(false);
+	
+	return m_splice->forward();
+}
+
+int AsyncHandler::finish()
+{
+	int ret = 0;
+	
+	while(!m_open.empty())
+	{
+		if(freeSegment(m_open.front()) != 0)
+			ret = -1;
+		m_open.pop_front();
+		
+		if(m_splice->forward() != 0)
+			ret = -1;
+	}
+	
+	return ret;
+}
+
+int64_t AsyncHandler::prerollTime() const
+{
+	return av_rescale_q(
+		JOB_PREROLL_INTERVALS * m_keyFrames.interval(),
+		stream()->time_base, AV_TIME_BASE_Q
+	);
+}
+
+void AsyncHandler::seeked()
+{
+	// Only called while we are in cutout, i.e. no segment gets input
+	m_keyFrames.seeked();
+	StreamHandler::seeked();
+}
+
+bool AsyncHandler::copying() const
+{
+	// Raw TS copying would bypass the SpliceQueue
+	return false;
+}
+
+/**
+ * Create the handler for the next segment. It starts on our thread.
+ * */
+int AsyncHandler::openSegment()
+{
+	const CutPointList& list = m_segments[m_nextSegment];
+	StreamHandlerFactory factory;
+	
+	// Everything in front of the segment is cut out for its handler
+	CutPointList preceding = m_precedingAV;
+	for(int i = 0; i < m_nextSegment; ++i)
+		preceding.insert(preceding.end(), m_segments[i].begin(), m_segments[i].end());
+	
+	Segment* seg = new Segment;
+	
+	seg->stream = *stream();
+	seg->stream.codec = avcodec_alloc_context3(0);
+	seg->ostream = *outputStream();
+	seg->ostream.codec = 0;
+	seg->handler = 0;
+	seg->slot = m_splice->addSlot();
+	seg->nextCut = 0;
+	seg->finished = false;
+	seg->running = false;
+	seg->queue = 0;
+	seg->failed = false;
+	seg->active = true;
+	seg->done = false;
+	
+	for(int i = 0; i < (int)list.size(); ++i)
+		seg->cuts.push_back(av_rescale_q(list[i].time, AV_TIME_BASE_Q, stream()->time_base));
+	
+	if(list.back().direction == CutPoint::OUT)
+		seg->end = seg->cuts.back();
+	else
+		seg->end = INT64_MAX;
+	
+	m_open.push_back(seg);
+	m_nextSegment++;
+	
+	if(!seg->stream.codec || avcodec_copy_context(seg->stream.codec, m_inputCodec) != 0)
+		return error("Could not copy decoder settings");
+	
+	seg->handler = factory.createHandlerForStream(&seg->stream);
+	if(!seg->handler)
+		return error("Could not create handler for stream %d", stream()->index);
+	
+	seg->handler->setCutList(list);
+	seg->handler->setOutputContext(outputContext());
+	seg->handler->setMuxer(seg->slot);
+	seg->handler->setOptions(options());
+	seg->handler->setOutputStream(&seg->ostream);
+	seg->handler->setStartPTS_AV(m_startAV);
+	seg->handler->setPrecedingCutout(preceding);
+	seg->handler->setMemStats(memStats());
+	
+	if(seg->handler->init() != 0)
+		return error("Could not initialize handler for stream %d", stream()->index);
+	
+	// The muxer needs the decoder delay of the output stream, which only
+	// the handlers know about. They set it up in init().
+	AVCodecContext* ocodec = seg->ostream.codec;
+	if(ocodec && ocodec->has_b_frames > outputStream()->codec->has_b_frames)
+	{
+		lockOutputCodec();
+		outputStream()->codec->has_b_frames = ocodec->has_b_frames;
+		unlockOutputCodec();
+	}
+	
+	log_debug("Opened segment with cut at %'10lld", list[0].time);
+	
+	return 0;
+}
+
+/**
+ * Decide where the handler of @c seg gets the packet at @c pts: a job is
+ * started when a cut point comes up and stopped once the handler copies
+ * again behind it. Sets seg->finished if no more input is needed.
+ *
+ * @return non-zero if the job failed
+ * */
+int AsyncHandler::updateSegment(Segment* seg, int64_t pts)
+{
+	// Just in case the handler never notices the end of the segment, it
+	// is cut off a key frame interval after the cut out.
+	bool over = seg->end != INT64_MAX && pts >= seg->end + m_keyFrames.interval();
+	
+	if(seg->running)
+	{
+		if(seg->failed)
+			return -1;
+		
+		// The job finishes the handler
+		if(over || !seg->active)
+		{
+			log_debug("Segment ending at %'10lld done", seg->end);
+			closeJob(seg, true);
+			seg->finished = true;
+			return 0;
+		}
+		
+		if(!seg->synced)
+			return 0;
+		
+		// Copying again, continue on our thread
+		if(stopJob(seg) != 0)
+			return -1;
+	}
+	
+	while(seg->nextCut < (int)seg->cuts.size() && seg->cuts[seg->nextCut] < pts)
+		seg->nextCut++;
+	
+	if(over || !seg->handler->active())
+		return finishSegment(seg);
+	
+	// Further cut points are handled here until a job is done
+	if(m_runningJobs >= options().boundaryJobs)
+		return 0;
+	
+	bool due = seg->nextCut < (int)seg->cuts.size()
+		&& seg->cuts[seg->nextCut] - pts < JOB_PREROLL_INTERVALS * m_keyFrames.interval();
+	
+	if(due || !seg->handler->copying())
+		return startJob(seg);
+	
+	return 0;
+}
+
+//! Move the handler of @c seg to a new worker thread
+int AsyncHandler::startJob(Segment* seg)
+{
+	int cut = std::min(seg->nextCut, (int)seg->cuts.size()-1);
+	
+	seg->boundary = seg->cuts[cut];
+	seg->queue = new SPSCQueue<AVPacket>(JOB_QUEUE_SIZE);
+	seg->queued = 0;
+	seg->boundaryIndex = INT64_MAX;
+	seg->last = false;
+	seg->active = true;
+	seg->synced = false;
+	seg->done = false;
+	
+	if(pthread_create(&seg->thread, 0, &AsyncHandler::jobWorker, seg) != 0)
+	{
+		delete seg->queue;
+		seg->queue = 0;
+		return error("Could not create job thread");
+	}
+	
+	seg->running = true;
+	m_runningJobs++;
+	
+	log_debug("Started job for cut at %'10lld (%d jobs)", seg->boundary, m_runningJobs);
+	
+	return 0;
+}
+
+/**
+ * No more input for the job of @c seg
+ *
+ * @param last Finish the handler, the segment is done
+ * */
+void AsyncHandler::closeJob(Segment* seg, bool last)
+{
+	seg->last = last;
+	seg->queue->close();
+}
+
+/**
+ * Wait for the job of @c seg to handle its queue and take the handler
+ * back. The queued packets are behind the sync point, so this is quick.
+ *
+ * @return non-zero if the job failed
+ * */
+int AsyncHandler::stopJob(Segment* seg)
+{
+	closeJob(seg, false);
+	pthread_join(seg->thread, 0);
+	
+	seg->running = false;
+	m_runningJobs--;
+	
+	delete seg->queue;
+	seg->queue = 0;
+	
+	log_debug("Job for cut at %'10lld done", seg->boundary);
+	
+	return seg->failed ? -1 : 0;
+}
+
+//! Finish the handler of @c seg on our thread
+int AsyncHandler::finishSegment(Segment* seg)
+{
+	seg->finished = true;
+	
+	int ret = seg->handler->finish();
+	SpliceQueue::closeSlot(seg->slot);
+	
+	if(ret != 0)
+		return error("Could not finish handler for stream %d", stream()->index);
+	
+	return 0;
+}
+
+/**
+ * Finish @c seg if necessary, wait for its job and free it
+ *
+ * @return non-zero on error
+ * */
+int AsyncHandler::freeSegment(Segment* seg)
+{
+	int ret = 0;
+	
+	if(seg->running)
+	{
+		if(!seg->finished)
+		{
+			closeJob(seg, true);
+			seg->finished = true;
+		}
+		
+		pthread_join(seg->thread, 0);
+		seg->running = false;
+		m_runningJobs--;
+		
+		if(seg->failed)
+			ret = -1;
+	}
+	else if(!seg->finished && seg->handler)
+		ret = finishSegment(seg);
+	else if(!seg->finished)
+		SpliceQueue::closeSlot(seg->slot);
+	
+	delete seg->handler;
+	delete seg->queue;
+	freeCodecContext(seg->stream.codec);
+	freeCodecContext(seg->ostream.codec);
+	delete seg;
+	
+	return ret;
+}
+
+//! Free finished segments whose job is done, so that they do not pile up
+int AsyncHandler::freeFinishedSegments()
+{
+	std::deque<Segment*>::iterator it = m_open.begin();
+	
+	while(it != m_open.end())
+	{
+		Segment* seg = *it;
+		
+		if(!seg->finished || (seg->running && !seg->done))
+		{
+			++it;
+			continue;
+		}
+		
+		it = m_open.erase(it);
+		
+		if(freeSegment(seg) != 0)
+			return -1;
+	}
+	
+	return 0;
+}
+
+void* AsyncHandler::jobWorker(void* arg)
+{
+	Segment* seg = (Segment*)arg;
+	MemStats* stats = seg->handler->memStats();
+	int64_t index = 0;
+	AVPacket packet;
+	
+	while(seg->queue->pop(&packet))
+	{
+		// The handler accounts whatever it keeps
+		if(stats)
+			stats->freed(packet.size);
+		
+		// After an error or behind the last cut point, just drain
+		if(!seg->failed && seg->active)
+		{
+			if(seg->handler->handlePacket(&packet) != 0)
+			{
+				error("Job for stream %d failed", seg->stream.index);
+				seg->failed = true;
+			}
+			else
+			{
+				bool synced = index >= seg->boundaryIndex && seg->handler->copying();
+				bool active = seg->handler->active();
+				
+				__sync_synchronize();
+				seg->active = active;
+				if(synced)
+					seg->synced = true;
+			}
+		}
+		
+		av_free_packet(&packet);
+		index++;
+	}
+	
+	if(seg->last)
+	{
+		if(!seg->failed && seg->handler->finish() != 0)
+			seg->failed = true;
+		
+		SpliceQueue::closeSlot(seg->slot);
+	}
+	
+	__sync_synchronize();
+	seg->done = true;
+	
+	return 0;
+}
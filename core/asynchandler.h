@@ -0,0 +1,94 @@
+// Runs the kept segments of a stream concurrently
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#ifndef ASYNCHANDLER_H
+#define ASYNCHANDLER_H
+
+#include "streamhandler.h"
+#include "keyframetracker.h"
+
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+class SpliceQueue;
+
+/**
+ * @brief Handles the cut points of a stream in background jobs
+ *
+ * The cut list is split into kept segments (cut in to cut out, see
+ * segments.h). Each segment gets its own instance of the real stream
+ * handler with private decoder and encoder contexts, which writes to its
+ * own slot of a SpliceQueue. The SpliceQueue passes the packets to the
+ * muxer in segment order.
+ *
+ * While a handler just copies, it runs on the demuxing thread. The window
+ * around each cut point, from a few key frame intervals in front of it
+ * until the handler copies again behind it, is a job: the handler moves
+ * to a worker thread and the demux loop only queues packets for it, so
+ * the re-encoding overlaps with demuxing, with copying and with the other
+ * cut points. At most HandlerOptions::boundaryJobs jobs run at a time,
+ * further cut points are handled on the demuxing thread.
+ * */
+class AsyncHandler : public StreamHandler
+{
+	public:
+		/**
+		 * @param stream Input stream
+		 * @param primary Handler for @c stream (taken over). It only sets up
+		 *   the output stream, the jobs get handlers of their own.
+		 * */
+		AsyncHandler(AVStream* stream, StreamHandler* primary);
+		virtual ~AsyncHandler();
+		
+		virtual int init();
+		virtual int handlePacket(AVPacket* packet);
+		virtual int finish();
+		virtual int64_t prerollTime() const;
+		virtual void seeked();
+		virtual bool copying() const;
+		
+		virtual void setCutList(const CutPointList& list);
+		virtual void setStartPTS_AV(int64_t start_av);
+		virtual void setPrecedingCutout(const CutPointList& list);
+		
+		//! Number of kept segments in @c list
+		static int segmentCount(const CutPointList& list);
+	private:
+		struct Segment;
+		
+		StreamHandler* m_primary;
+		AVCodecContext* m_inputCodec; //!< Unopened copy for the jobs
+		
+		// Settings in AV_TIME_BASE units, for the job handlers
+		CutPointList m_cutlistAV;
+		CutPointList m_precedingAV;
+		int64_t m_startAV;
+		
+		std::vector<CutPointList> m_segments;
+		int m_nextSegment;
+		
+		KeyFrameTracker m_keyFrames;
+		
+		//! Segments whose handler still exists, in order
+		std::deque<Segment*> m_open;
+		int m_runningJobs;
+		SpliceQueue* m_splice;
+		
+		int openSegment();
+		int updateSegment(Segment* seg, int64_t pts);
+		int startJob(Segment* seg);
+		void closeJob(Segment* seg, bool last);
+		int stopJob(Segment* seg);
+		int finishSegment(Segment* seg);
+		int freeSegment(Segment* seg);
+		int freeFinishedSegments();
+		static void* jobWorker(void* arg);
+};
+
+#endif // ASYNCHANDLER_H
@@ -2,6 +2,7 @@
 // Author: Max Schwarz <Max@x-quadraht.de>
 
 #include "genericaudio.h"
+#include "../decoder.h"
 
 extern "C"
 {
@@ -15,8 +16,6 @@ extern "C"
 #include <common/log.h>
 #include <string.h>
 
-const int BUFSIZE = 10 * 1024 * 1024;
-
 static AVCodec* findCodec(AVCodecID id, AVSampleFormat fmt)
 {
 	for(AVCodec* p = av_codec_next(0); p; p = av_codec_next(p))
@@ -36,25 +35,52 @@ static AVCodec* findCodec(AVCodecID id, AVSampleFormat fmt)
 
 GenericAudio::GenericAudio(AVStream* stream)
  : StreamHandler(stream)
- , m_outputErrorCount(0)
+ , m_cutout_buf(0)
+ , m_cutin_buf(0)
+ , m_bufferSize(0)
  , m_saved_samples(0)
+ , m_outputErrorCount(0)
 {
 }
 
 GenericAudio::~GenericAudio()
 {
+	if(m_cutout_buf && m_cutin_buf)
+		accountFree(2 * m_bufferSize);
+	
 	av_free(m_cutout_buf);
 	av_free(m_cutin_buf);
 }
 
 int GenericAudio::init()
+{
+	outputStream()->disposition = stream()->disposition;
+	av_dict_copy(&outputStream()->metadata, stream()->metadata, 0);
+	
+	if(options().audioFrameCuts)
+	{
+		// Whole packets are copied, no codecs needed
+		avcodec_copy_context(outputStream()->codec, stream()->codec);
+		outputStream()->codec->codec_tag = 0;
+	}
+	else if(initCodecs() != 0)
+		return -1;
+	
+	m_nc = cutList().nextCutPoint(0);
+	m_cutout = m_nc->direction == CutPoint::IN;
+	setCutout(m_cutout);
+	
+	return 0;
+}
+
+int GenericAudio::initCodecs()
 {
 	AVCodec* codec = avcodec_find_decoder(stream()->codec->codec_id);
 	
 	if(!codec)
 		return error("Could not find decoder");
 	
-	if(avcodec_open2(stream()->codec, codec, 0) != 0)
+	if(decoder()->open(codec) != 0)
 		return error("Could not open decoder");
 	
 	// avcodec_find_decoder does not take sample_fmt into account,
@@ -67,23 +93,36 @@ int GenericAudio::init()
 	if(!encoder)
 		return error("Could not find encoder");
 	
-	outputStream()->disposition = stream()->disposition;
-	av_dict_copy(&outputStream()->metadata, stream()->metadata, 0);
-	
 	outputStream()->codec = avcodec_alloc_context3(encoder);
 	avcodec_copy_context(outputStream()->codec, stream()->codec);
 	
 	if(avcodec_open2(outputStream()->codec, encoder, 0) != 0)
 		return error("Could not open encoder");
 	
-	// Allocate sample buffer
-	m_cutout_buf = (int16_t*)av_malloc(BUFSIZE);
-	m_cutin_buf = (int16_t*)av_malloc(BUFSIZE);
+	return 0;
+}
+
+/**
+ * Allocate the sample buffers for one decoded frame. They are only needed
+ * at the cut points, so this happens at the first one.
+ * */
+int GenericAudio::allocBuffers()
+{
+	// The frame size of the stream is not a reliable bound for the decoder
+	// output (HE-AAC decodes 2048 samples per 1024 sample frame), and
+	// older versions of avcodec_decode_audio3() refuse anything smaller
+	// than this. Only streams with a packet across a cut point get here.
+	m_bufferSize = AVCODEC_MAX_AUDIO_FRAME_SIZE;
+	
+	m_cutout_buf = (int16_t*)av_mallocz(m_bufferSize);
+	m_cutin_buf = (int16_t*)av_mallocz(m_bufferSize);
 	if(!m_cutout_buf || !m_cutin_buf)
 		return error("Could not allocate sample buffer");
 	
-	m_nc = cutList().nextCutPoint(0);
-	m_cutout = m_nc->direction == CutPoint::IN;
+	accountAlloc(m_bufferSize);
+	accountAlloc(m_bufferSize);
+	
+	log_debug("Allocated sample buffers of %d bytes", m_bufferSize);
 	
 	return 0;
 }
@@ -92,15 +131,24 @@ int GenericAudio::handlePacket(AVPacket* packet)
 {
 	packet->pts = pts_rel(packet->pts);
 	int64_t current_time = packet->pts;
+	bool frame_cuts = options().audioFrameCuts;
 	
-	if(m_nc && current_time + packet->duration > m_nc->time
+	// With whole frame cuts, a packet belongs to the side of the cut
+	// point its center lies on, so the offset to the video stays below
+	// half a frame.
+	int64_t center = current_time + packet->duration / 2;
+	
+	if(!frame_cuts && m_nc && current_time + packet->duration > m_nc->time
 		&& m_nc->direction == CutPoint::OUT
 		&& current_time < m_nc->time)
 	{
 		log_debug("%'10lld: Packet across the cut-out point", current_time);
 		
-		int frame_size = BUFSIZE;
-		if(avcodec_decode_audio3(stream()->codec, m_cutout_buf, &frame_size, packet) < 0)
+		if(!m_cutout_buf && allocBuffers() != 0)
+			return -1;
+		
+		int frame_size = m_bufferSize;
+		if(decoder()->decodeAudio(m_cutout_buf, &frame_size, packet) < 0)
 			return error("Could not decode audio stream");
 		
 		int64_t total_samples = frame_size / sizeof(int16_t);
@@ -114,14 +162,17 @@ int GenericAudio::handlePacket(AVPacket* packet)
 		return 0;
 	}
 	
-	if(m_nc && current_time + packet->duration > m_nc->time
+	if(!frame_cuts && m_nc && current_time + packet->duration > m_nc->time
 		&& m_nc->direction == CutPoint::IN
 		&& current_time < m_nc->time)
 	{
 		log_debug("%'10lld: Packet across cut-in point", current_time);
 		
-		int frame_size = BUFSIZE;
-		if(avcodec_decode_audio3(stream()->codec, m_cutin_buf, &frame_size, packet) < 0)
+		if(!m_cutout_buf && allocBuffers() != 0)
+			return -1;
+		
+		int frame_size = m_bufferSize;
+		if(decoder()->decodeAudio(m_cutin_buf, &frame_size, packet) < 0)
 			return error("Could not decode audio stream");
 		
 		int64_t total_samples = frame_size / sizeof(int16_t);
@@ -146,7 +197,10 @@ int GenericAudio::handlePacket(AVPacket* packet)
 				m_cutin_buf[i] = 0;
 		}
 		
+		// The encoder is the output codec context itself
+		lockOutputCodec();
 		int bytes = avcodec_encode_audio(outputStream()->codec, packet->data, packet->size, m_cutin_buf);
+		unlockOutputCodec();
 		
 		if(bytes < 0)
 			return error("Could not encode audio frame");
@@ -154,10 +208,11 @@ int GenericAudio::handlePacket(AVPacket* packet)
 		packet->size = bytes;
 	}
 	
-	if(m_nc && current_time > m_nc->time
+	if(m_nc && (frame_cuts ? center >= m_nc->time : current_time > m_nc->time)
 		&& !m_cutout && m_nc->direction == CutPoint::OUT)
 	{
 		m_cutout = true;
+		setCutout(true);
 		int64_t cutout_time = m_nc->time;
 		m_nc = cutList().nextCutPoint(current_time);
 		
@@ -172,11 +227,12 @@ int GenericAudio::handlePacket(AVPacket* packet)
 		}
 	}
 	
-	if(m_nc && current_time >= m_nc->time
+	if(m_nc && (frame_cuts ? center : current_time) >= m_nc->time
 		&& m_cutout && m_nc->direction == CutPoint::IN)
 	{
 		log_debug("CUT-IN at %'10lld", current_time);
 		m_cutout = false;
+		setCutout(false);
 		m_nc = cutList().nextCutPoint(current_time);
 	}
 	
@@ -198,6 +254,17 @@ int GenericAudio::handlePacket(AVPacket* packet)
 	return 0;
 }
 
+void GenericAudio::seeked()
+{
+	if(!options().audioFrameCuts)
+		decoder()->seeked();
+}
+
+bool GenericAudio::copying() const
+{
+	return !m_cutout;
+}
+
 REGISTER_STREAM_HANDLER(CODEC_ID_AC3, GenericAudio)
 REGISTER_STREAM_HANDLER(CODEC_ID_MP2, GenericAudio)
 
@@ -14,12 +14,18 @@ class GenericAudio : public StreamHandler
 		
 		virtual int init();
 		virtual int handlePacket(AVPacket* packet);
+		virtual void seeked();
+		virtual bool copying() const;
 	private:
+		int initCodecs();
+		int allocBuffers();
+		
 		const CutPoint* m_nc;
 		bool m_cutout;
 		
 		int16_t *m_cutout_buf;
 		int16_t *m_cutin_buf;
+		int m_bufferSize; //!< Size of each sample buffer in bytes
 		int m_saved_samples;
 
 		int m_outputErrorCount;
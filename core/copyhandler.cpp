@@ -0,0 +1,121 @@
+// Stream handler that only copies packets
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#include "copyhandler.h"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#define DEBUG 0
+#define LOG_PREFIX "[copy]"
+#include <common/log.h>
+
+//! Audio packets are muxed ahead of the video key frame they belong to
+const int64_t COPY_PREROLL = AV_TIME_BASE;
+
+CopyHandler::CopyHandler(AVStream* stream)
+ : StreamHandler(stream)
+ , m_nc(0)
+ , m_cutout(true)
+ , m_video(stream->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+ , m_cutIn(0)
+ , m_outputErrorCount(0)
+{
+}
+
+CopyHandler::~CopyHandler()
+{
+}
+
+int CopyHandler::init()
+{
+	AVStream* ostream = outputStream();
+	
+	ostream->time_base = stream()->time_base;
+	ostream->disposition = stream()->disposition;
+	av_dict_copy(&ostream->metadata, stream()->metadata, 0);
+	
+	avcodec_copy_context(ostream->codec, stream()->codec);
+	ostream->codec->codec_tag = 0;
+	ostream->sample_aspect_ratio = stream()->codec->sample_aspect_ratio;
+	
+	m_nc = cutList().nextCutPoint(0);
+	if(!m_nc)
+		return error("Empty cut list");
+	
+	m_cutout = m_nc->direction == CutPoint::IN;
+	setCutout(m_cutout);
+	
+	return 0;
+}
+
+int CopyHandler::handlePacket(AVPacket* packet)
+{
+	packet->pts = pts_rel(packet->pts);
+	int64_t current_time = packet->pts;
+	
+	// Video can only be switched at key frames. Other packets belong to
+	// the side of the cut point their center lies on (see GenericAudio).
+	bool boundary = !m_video || (packet->flags & AV_PKT_FLAG_KEY);
+	int64_t switch_time = m_video ? current_time : current_time + packet->duration / 2;
+	
+	if(m_nc && boundary && switch_time >= m_nc->time
+		&& !m_cutout && m_nc->direction == CutPoint::OUT)
+	{
+		m_cutout = true;
+		setCutout(true);
+		int64_t cutout_time = m_nc->time;
+		m_nc = cutList().nextCutPoint(current_time);
+		
+		log_debug("CUT-OUT at %'10lld", current_time);
+		
+		if(m_nc)
+			setTotalCutout(m_nc->time - (cutout_time - totalCutout()));
+		else
+		{
+			log_debug("No next cutpoint, deactivating...");
+			setActive(false);
+		}
+	}
+	
+	if(m_nc && boundary && switch_time >= m_nc->time
+		&& m_cutout && m_nc->direction == CutPoint::IN)
+	{
+		log_debug("CUT-IN at %'10lld", current_time);
+		m_cutout = false;
+		setCutout(false);
+		m_cutIn = m_nc->time;
+		m_nc = cutList().nextCutPoint(current_time);
+	}
+	
+	if(m_cutout)
+		return 0;
+	
+	// Leading frames of an open GOP reference the previous one
+	if(m_video && current_time < m_cutIn)
+		return 0;
+	
+	// Single packets might be refused by the muxer (see GenericAudio)
+	if(writeInputPacket(packet) != 0)
+	{
+		if(++m_outputErrorCount > 50)
+			return error("Could not write input packet");
+	}
+	else
+		m_outputErrorCount = 0;
+	
+	return 0;
+}
+
+int64_t CopyHandler::prerollTime() const
+{
+	return COPY_PREROLL;
+}
+
+bool CopyHandler::copying() const
+{
+	return !m_cutout;
+}
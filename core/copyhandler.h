@@ -0,0 +1,41 @@
+// Stream handler that only copies packets
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#ifndef COPYHANDLER_H
+#define COPYHANDLER_H
+
+#include "streamhandler.h"
+
+/**
+ * @brief Cuts at packet boundaries without decoding anything
+ *
+ * Used for all streams in key frame snapping mode (see snapToKeyFrames()).
+ * Video switches only at key frames: a cut in starts at the first key
+ * frame at or behind the cut point and drops the leading frames of an open
+ * GOP, a cut out stops at the first key frame at or behind the cut point,
+ * in stream order. With a snapped cut list, those are exactly the cut
+ * points. Other streams switch at whole packets, each packet belongs to
+ * the side of the cut point its center lies on.
+ * */
+class CopyHandler : public StreamHandler
+{
+	public:
+		CopyHandler(AVStream* stream);
+		virtual ~CopyHandler();
+		
+		virtual int init();
+		virtual int handlePacket(AVPacket* packet);
+		virtual int64_t prerollTime() const;
+		virtual bool copying() const;
+	private:
+		const CutPoint* m_nc;
+		bool m_cutout;
+		bool m_video;
+		
+		//! Time of the last cut in, earlier frames are not output
+		int64_t m_cutIn;
+		
+		int m_outputErrorCount;
+};
+
+#endif // COPYHANDLER_H
@@ -0,0 +1,1269 @@
+// Cutting loop
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#include "cutter.h"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+}
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "streamhandler.h"
+#include "asynchandler.h"
+#include "copyhandler.h"
+#include "muxer.h"
+#include "memstats.h"
+#include "decoder.h"
+#include "spscqueue.h"
+#include "io_split.h"
+#include "tsoutput.h"
+#include "tspassthrough.h"
+
+#include <common/indexfile.h>
+
+#define DEBUG 0
+#define LOG_PREFIX "[cutter]"
+#include <common/log.h>
+
+// Do not bother seeking if we would skip less than this (AV_TIME_BASE units)
+const int64_t SKIP_MIN_DISTANCE = 10LL * AV_TIME_BASE;
+
+// Tolerated difference between seek target and actual position
+const int64_t SKIP_TOLERANCE = AV_TIME_BASE;
+
+// Packets queued per stream handler in pipelined mode
+const unsigned int PIPELINE_QUEUE_SIZE = 256;
+
+// Only copy raw TS packets if the span is at least this long (AV_TIME_BASE units)
+const int64_t PASSTHROUGH_MIN_SPAN = 10LL * AV_TIME_BASE;
+
+// Give control back to the stream handlers this long before they need it
+const int64_t PASSTHROUGH_MARGIN = AV_TIME_BASE;
+
+// Open deferred outputs this long before the preroll of their first cut in
+const int64_t OUTPUT_OPEN_MARGIN = AV_TIME_BASE;
+
+//! Hand @c packet to @c handler, counting it for the allocation statistics
+static inline int handlePacket(StreamHandler* handler, AVPacket* packet)
+{
+	if(handler->memStats())
+		handler->memStats()->packetHandled();
+	
+	return handler->handlePacket(packet);
+}
+
+AVFormatContext* openOutput(const char* filename, uint64_t split_size,
+	bool split_keyframes, int64_t split_duration, bool deferred)
+{
+	AVFormatContext* output_ctx = 0;
+	TSOutput* ts;
+	int flags = IO_SPLIT_PREALLOCATE;
+	
+	if(split_duration)
+		split_keyframes = true;
+	
+	if(split_keyframes)
+		flags |= IO_SPLIT_MANUAL;
+	
+	int fd;
+	if(sscanf(filename, "pipe:%d", &fd) == 1 || strstr(filename, "://"))
+	{
+		if(split_size || split_keyframes)
+		{
+			fprintf(stderr, "Cannot split output written to a pipe or URL\n");
+			return 0;
+		}
+	}
+	
+	if(avformat_alloc_output_context2(&output_ctx, 0, "mpegts", filename) != 0)
+	{
+		fprintf(stderr, "Could not allocate output context\n");
+		return 0;
+	}
+	
+	ts = new TSOutput(filename, split_size, flags);
+	if(!deferred && !ts->open())
+	{
+		delete ts;
+		avformat_free_context(output_ctx);
+		return 0;
+	}
+	
+	if(split_keyframes)
+		ts->setSplit(split_size, split_duration);
+	
+	output_ctx->pb = ts->context();
+	
+	output_ctx->oformat->flags |= AVFMT_TS_NONSTRICT;
+	
+	return output_ctx;
+}
+
+int closeOutput(AVFormatContext* ctx)
+{
+	TSOutput* ts = TSOutput::fromContext(ctx->pb);
+	
+	int ret = ts->close();
+	
+	delete ts;
+	ctx->pb = 0;
+	avformat_free_context(ctx);
+	
+	return ret;
+}
+
+// libavcodec needs to serialize avcodec_open2() & co.
+static int lockManager(void** mutex, enum AVLockOp op)
+{
+	pthread_mutex_t** m = (pthread_mutex_t**)mutex;
+	
+	switch(op)
+	{
+		case AV_LOCK_CREATE:
+			*m = new pthread_mutex_t;
+			return pthread_mutex_init(*m, 0);
+		case AV_LOCK_OBTAIN:
+			return pthread_mutex_lock(*m);
+		case AV_LOCK_RELEASE:
+			return pthread_mutex_unlock(*m);
+		case AV_LOCK_DESTROY:
+			pthread_mutex_destroy(*m);
+			delete *m;
+			*m = 0;
+			return 0;
+	}
+	
+	return 1;
+}
+
+static pthread_once_t g_lockManagerOnce = PTHREAD_ONCE_INIT;
+static bool g_lockManagerRegistered = false;
+
+static void doRegisterLockManager()
+{
+	g_lockManagerRegistered = av_lockmgr_register(&lockManager) == 0;
+}
+
+bool registerLockManager()
+{
+	// Registering again would replace the mutexes while they are in use
+	pthread_once(&g_lockManagerOnce, &doRegisterLockManager);
+	return g_lockManagerRegistered;
+}
+
+Cutter::Cutter(AVFormatContext* input, const CutPointList& cutlist)
+ : m_input(input)
+ , m_cutlist(cutlist)
+ , m_skip(false)
+ , m_index(0)
+ , m_skipCheck(false)
+ , m_lastSkipCutIn(AV_NOPTS_VALUE)
+ , m_audioDecoder(0)
+ , m_progress(true)
+ , m_verbose(false)
+ , m_pipelined(false)
+ , m_passthroughEnabled(false)
+ , m_passthrough(0)
+ , m_passthroughRetry(AV_NOPTS_VALUE)
+ , m_nextOpenTime(INT64_MAX)
+{
+}
+
+Cutter::~Cutter()
+{
+	for(StreamMap::iterator it = m_handlers.begin(); it != m_handlers.end(); ++it)
+		delete it->second;
+	
+	delete m_passthrough;
+	
+	for(int i = 0; i < m_outputs.size(); ++i)
+		delete m_outputs[i].muxer;
+	
+	for(DecoderMap::iterator it = m_decoders.begin(); it != m_decoders.end(); ++it)
+		delete it->second;
+	for(int i = 0; i < m_privateDecoders.size(); ++i)
+		delete m_privateDecoders[i];
+	
+	// Freed last, the handlers report to them until they are gone
+	for(int i = 0; i < m_memStats.size(); ++i)
+		delete m_memStats[i].second;
+}
+
+void Cutter::setAudioDecoder(const char* name)
+{
+	m_audioDecoder = name;
+}
+
+void Cutter::setHandlerOptions(const HandlerOptions& options)
+{
+	m_handlerOptions = options;
+}
+
+void Cutter::setProgress(bool progress, bool verbose)
+{
+	m_progress = progress;
+	m_verbose = verbose;
+}
+
+void Cutter::setSkipCutouts(bool skip, IndexFile* index)
+{
+	m_skip = skip;
+	m_index = index;
+}
+
+void Cutter::setPipelined(bool pipelined)
+{
+	m_pipelined = pipelined;
+}
+
+void Cutter::setPassthrough(bool passthrough)
+{
+	m_passthroughEnabled = passthrough;
+}
+
+/**
+ * Decoder for the handler of @c stream in the next output. In serial mode,
+ * the handlers of all outputs share one (see Decoder). Pipelined handlers
+ * run concurrently, so all but the first get a private copy.
+ *
+ * @return NULL on error
+ * */
+Decoder* Cutter::decoderFor(AVStream* stream)
+{
+	DecoderMap::iterator it = m_decoders.find(stream->index);
+	
+	if(it == m_decoders.end())
+	{
+		Decoder* decoder = new Decoder(stream->codec);
+		m_decoders[stream->index] = decoder;
+		return decoder;
+	}
+	
+	if(!m_pipelined)
+		return it->second;
+	
+	AVCodecContext* ctx = avcodec_alloc_context3(0);
+	if(!ctx || avcodec_copy_context(ctx, stream->codec) != 0)
+	{
+		av_free(ctx);
+		return 0;
+	}
+	
+	Decoder* decoder = new Decoder(ctx, true);
+	m_privateDecoders.push_back(decoder);
+	
+	return decoder;
+}
+
+bool Cutter::setupOutput(const CutPointList& cutlist, AVFormatContext* output)
+{
+	AVFormatContext* input = m_input;
+	StreamHandlerFactory factory;
+	Muxer* muxer;
+	
+	if(m_pipelined)
+		muxer = new ThreadedMuxer(output);
+	else
+		muxer = new Muxer(output);
+	
+	Output out;
+	out.context = output;
+	out.cutlist = cutlist;
+	out.muxer = muxer;
+	out.state = Output::PENDING;
+	out.openTime = 0;
+	m_outputs.push_back(out);
+	
+	for(int i = 0; i < input->nb_programs; ++i)
+	{
+		AVProgram* program = input->programs[i];
+		
+		// Skip empty programs
+		if(program->nb_stream_indexes == 0)
+			continue;
+		
+		AVProgram* oprogram = av_new_program(output, program->id);
+		
+		for(int j = 0; j < program->nb_stream_indexes; ++j)
+		{
+			AVStream* istream = input->streams[program->stream_index[j]];
+			
+			if(istream->codec->codec_type == AVMEDIA_TYPE_AUDIO && m_audioDecoder)
+			{
+				AVCodec* codec = avcodec_find_decoder(istream->codec->codec_id);
+				if(!codec || strcmp(codec->name, m_audioDecoder) != 0)
+				{
+					istream->discard = AVDISCARD_ALL;
+					continue;
+				}
+			}
+			
+			StreamHandler* handler;
+			
+			// Snapped cut lists need no codecs at all
+			if(m_handlerOptions.snapKeyframes
+				&& (istream->codec->codec_type == AVMEDIA_TYPE_VIDEO
+				|| istream->codec->codec_type == AVMEDIA_TYPE_AUDIO))
+			{
+				handler = new CopyHandler(istream);
+			}
+			else
+				handler = factory.createHandlerForStream(istream);
+			
+			if(!handler)
+			{
+				printf("Stream %d is unhandled.\n", istream->index);
+				istream->discard = AVDISCARD_ALL;
+				continue;
+			}
+			
+			// Cut points of video streams can be handled in the background
+			if(m_handlerOptions.boundaryJobs > 0 && !m_handlerOptions.snapKeyframes
+				&& istream->codec->codec_type == AVMEDIA_TYPE_VIDEO
+				&& AsyncHandler::segmentCount(cutlist) > 1)
+			{
+				handler = new AsyncHandler(istream, handler);
+			}
+			
+			AVStream* ostream = avformat_new_stream(output, 0);
+			ostream->id = istream->id;
+			
+			// Register with program
+			oprogram->nb_stream_indexes++;
+			oprogram->stream_index = (unsigned int*)av_realloc(
+				oprogram->stream_index, oprogram->nb_stream_indexes * sizeof(*oprogram->stream_index)
+			);
+			oprogram->stream_index[oprogram->nb_stream_indexes-1] = ostream->index;
+			
+			// Setup stream handler
+			if(m_handlerOptions.memStats)
+			{
+				MemStats* stats = new MemStats;
+				m_memStats.push_back(std::make_pair(istream->index, stats));
+				handler->setMemStats(stats);
+			}
+			
+			Decoder* decoder = decoderFor(istream);
+			if(!decoder)
+			{
+				fprintf(stderr, "Error: Could not copy decoder settings of stream %d\n",
+					istream->index
+				);
+				delete handler;
+				return false;
+			}
+			
+			handler->setDecoder(decoder);
+			handler->setCutList(cutlist);
+			handler->setOutputContext(output);
+			handler->setMuxer(muxer);
+			handler->setOptions(m_handlerOptions);
+			handler->setOutputStream(ostream);
+			handler->setStartPTS_AV(input->start_time);
+			
+			m_handlers.insert(std::make_pair(istream->index, handler));
+			m_outputs.back().handlers.push_back(handler);
+			
+			if(handler->init() != 0)
+			{
+				fprintf(stderr, "Error: Could not initialize stream handler for stream %d\n",
+					istream->index
+				);
+				return false;
+			}
+			
+			if(ostream->codec->codec)
+			{
+				printf("Using encoder '%s' for output of stream %d\n",
+					   ostream->codec->codec->name, istream->index
+				);
+			}
+		}
+	}
+	
+	return true;
+}
+
+bool Cutter::setupHandlers(AVFormatContext* output)
+{
+	AVFormatContext* input = m_input;
+	
+	if(!setupOutput(m_cutlist, output))
+		return false;
+	
+	if(m_passthroughEnabled && TSOutput::fromContext(output->pb)->splitting())
+	{
+		printf("Raw TS copying is not possible with keyframe aligned splitting.\n");
+		m_passthroughEnabled = false;
+	}
+	
+	if(m_passthroughEnabled && !m_pipelined)
+	{
+		std::vector<int> streams;
+		for(StreamMap::iterator it = m_handlers.begin(); it != m_handlers.end(); ++it)
+			streams.push_back(it->first);
+		
+		m_passthrough = new TSPassthrough(input, TSOutput::fromContext(output->pb));
+		if(!m_passthrough->init(streams))
+		{
+			printf("Raw TS copying is not possible with this input.\n");
+			delete m_passthrough;
+			m_passthrough = 0;
+		}
+		else
+		{
+			// Write audio PES packets immediately instead of collecting
+			// them, so that flushing the muxer really writes everything.
+			if(av_opt_set_int(output->priv_data, "pes_payload_size", 0, 0) < 0)
+			{
+				printf("Raw TS copying is not supported by this libavformat.\n");
+				delete m_passthrough;
+				m_passthrough = 0;
+			}
+		}
+	}
+	
+	return true;
+}
+
+bool Cutter::addOutput(const CutPointList& cutlist, AVFormatContext* output)
+{
+	if(m_passthrough)
+	{
+		printf("Raw TS copying is only possible with a single output.\n");
+		delete m_passthrough;
+		m_passthrough = 0;
+	}
+	
+	m_passthroughEnabled = false;
+	
+	return setupOutput(cutlist, output);
+}
+
+void Cutter::setPrecedingCutout(const CutPointList& list)
+{
+	for(StreamMap::iterator it = m_handlers.begin(); it != m_handlers.end(); ++it)
+		it->second->setPrecedingCutout(list);
+}
+
+int64_t Cutter::preroll() const
+{
+	int64_t preroll = 0;
+	
+	for(StreamMap::const_iterator it = m_handlers.begin(); it != m_handlers.end(); ++it)
+	{
+		int64_t p = it->second->prerollTime();
+		if(p > preroll)
+			preroll = p;
+	}
+	
+	return preroll;
+}
+
+int64_t Cutter::packetTime(const AVPacket& packet) const
+{
+	AVStream* stream = m_input->streams[packet.stream_index];
+	int64_t ts = (packet.dts != AV_NOPTS_VALUE) ? packet.dts : packet.pts;
+	
+	if(ts == AV_NOPTS_VALUE)
+		return AV_NOPTS_VALUE;
+	
+	const int64_t mask = 0xFFFFFFFFFFFFFFFFLL >> (64 - stream->pts_wrap_bits);
+	int64_t start = av_rescale_q(m_input->start_time, AV_TIME_BASE_Q, stream->time_base);
+	
+	return av_rescale_q((ts - start) & mask, stream->time_base, AV_TIME_BASE_Q);
+}
+
+void Cutter::notifySeek()
+{
+	for(StreamMap::iterator it = m_handlers.begin(); it != m_handlers.end(); ++it)
+		it->second->seeked();
+}
+
+/**
+ * Earliest cut in after @c time over all outputs.
+ *
+ * @return cut in time, AV_NOPTS_VALUE if any output is going to cut out
+ *   next (or there are no cut points left at all)
+ * */
+int64_t Cutter::nextCutIn(int64_t time) const
+{
+	int64_t cut_in = AV_NOPTS_VALUE;
+	
+	for(int i = 0; i < m_outputs.size(); ++i)
+	{
+		const CutPoint* next = m_outputs[i].cutlist.nextCutPoint(time);
+		
+		// Finished outputs do not care
+		if(!next)
+			continue;
+		
+		if(next->direction != CutPoint::IN)
+			return AV_NOPTS_VALUE;
+		
+		if(cut_in == AV_NOPTS_VALUE || next->time < cut_in)
+			cut_in = next->time;
+	}
+	
+	return cut_in;
+}
+
+bool Cutter::skipCutout(int64_t time, int64_t pos)
+{
+	for(StreamMap::const_iterator it = m_handlers.begin(); it != m_handlers.end(); ++it)
+	{
+		if(it->second->active() && !it->second->inCutout())
+			return false;
+	}
+	
+	int64_t cut_in = nextCutIn(time);
+	if(cut_in == AV_NOPTS_VALUE || cut_in == m_lastSkipCutIn)
+		return false;
+	
+	int64_t target = cut_in - preroll();
+	if(target - time < SKIP_MIN_DISTANCE)
+		return false;
+	
+	bool seeked = false;
+	
+	if(m_index)
+	{
+		loff_t byte_offset = m_index->bytePositionForPTS(target);
+		
+		if(byte_offset != (loff_t)-1 && byte_offset > pos)
+		{
+			log_debug("Skipping to byte pos %'10lld", (int64_t)byte_offset);
+			if(avformat_seek_file(m_input, -1, 0, byte_offset, byte_offset, AVSEEK_FLAG_BYTE) >= 0)
+				seeked = true;
+			else
+				log_warning("Byte seeking with index file failed, falling back to timestamps");
+		}
+	}
+	
+	if(!seeked)
+	{
+		int64_t ts = m_input->start_time + target;
+		
+		log_debug("Skipping to time %'10lld", target);
+		if(avformat_seek_file(m_input, -1, m_input->start_time + time, ts, ts, 0) < 0)
+		{
+			log_warning("Could not skip cut out region, reading through");
+			m_lastSkipCutIn = cut_in;
+			return false;
+		}
+	}
+	
+	notifySeek();
+	
+	m_skipCheck = true;
+	m_skipTarget = target;
+	m_skipReturnPos = pos;
+	m_lastSkipCutIn = cut_in;
+	
+	if(m_verbose)
+	{
+		printf("Skipping cut out region %.2fs - %.2fs\n",
+			(float)time / AV_TIME_BASE, (float)target / AV_TIME_BASE);
+	}
+	
+	return true;
+}
+
+bool Cutter::checkSkip(int64_t time)
+{
+	m_skipCheck = false;
+	
+	if(time <= m_skipTarget + SKIP_TOLERANCE)
+		return true;
+	
+	// We landed behind the preroll window and would miss the start of
+	// the decoding process. Go back to where we were and read through.
+	log_warning("Skipping cut out region went too far (%.2fs instead of %.2fs), reading through",
+		(float)time / AV_TIME_BASE, (float)m_skipTarget / AV_TIME_BASE
+	);
+	
+	if(m_skipReturnPos < 0
+		|| avformat_seek_file(m_input, -1, 0, m_skipReturnPos, m_skipReturnPos, AVSEEK_FLAG_BYTE) < 0)
+	{
+		error("Could not seek back, cut in might be imprecise");
+		return true;
+	}
+	
+	notifySeek();
+	
+	return false;
+}
+
+void Cutter::printProgress(const AVPacket& packet, int* last_percent_done)
+{
+	AVStream* stream = m_input->streams[packet.stream_index];
+	int percent = av_rescale(packet.dts - stream->start_time, 100, stream->duration);
+	
+	int granularity = m_verbose ? 1 : 10;
+	
+	if(percent / granularity != *last_percent_done / 10 && percent > *last_percent_done)
+	{
+		printf("%02d%% done (approximation)\n", percent);
+		if(m_verbose)
+			fflush(stdout);
+		
+		*last_percent_done = percent;
+	}
+}
+
+bool Cutter::allFinished() const
+{
+	for(StreamMap::const_iterator it = m_handlers.begin();
+		it != m_handlers.end(); ++it)
+	{
+		if(it->second->active())
+			return false;
+	}
+	
+	return true;
+}
+
+void Cutter::printMemStats() const
+{
+	printf("Memory statistics (buffers allocated by the stream handlers):\n");
+	
+	for(int i = 0; i < m_memStats.size(); ++i)
+	{
+		const MemStats* stats = m_memStats[i].second;
+		
+		float per_packet = stats->packets()
+			? (float)stats->allocations() / stats->packets() : 0;
+		
+		printf(" [+] Stream %d: peak %.1f KiB, %lld allocations in %lld packets (%.3f per packet)\n",
+			m_memStats[i].first, (float)stats->peak() / 1024,
+			stats->allocations(), stats->packets(), per_packet
+		);
+	}
+}
+
+int Cutter::run()
+{
+	int exit_code = 0;
+	int64_t margin = preroll() + OUTPUT_OPEN_MARGIN;
+	
+	for(int i = 0; i < m_outputs.size(); ++i)
+	{
+		Output* output = &m_outputs[i];
+		
+		// Outputs starting with a cut out keep the start of the input
+		if(output->cutlist[0].direction == CutPoint::IN)
+			output->openTime = output->cutlist[0].time - margin;
+		else
+			output->openTime = INT64_MIN;
+		
+		// Files opened by openOutput() are written from the start
+		if(TSOutput::fromContext(output->context->pb)->isOpen())
+			output->openTime = INT64_MIN;
+	}
+	
+	m_nextOpenTime = INT64_MIN;
+	exit_code = openOutputs(0);
+	
+	if(exit_code == 0)
+	{
+		if(m_pipelined)
+			exit_code = runPipelined();
+		else
+			exit_code = runSerial();
+	}
+	
+	for(int i = 0; i < m_outputs.size(); ++i)
+	{
+		Output* output = &m_outputs[i];
+		
+		// Never reached the first cut in, the file should exist anyway
+		if(output->state == Output::PENDING)
+		{
+			int ret = startOutput(output);
+			if(ret != 0 && exit_code == 0)
+				exit_code = ret;
+		}
+		
+		if(output->state == Output::OPEN)
+		{
+			int ret = finishOutput(output);
+			if(ret != 0 && exit_code == 0)
+				exit_code = ret;
+		}
+	}
+	
+	if(m_handlerOptions.memStats)
+		printMemStats();
+	
+	return exit_code;
+}
+
+/**
+ * Open the file of @c output if necessary, write the header and start
+ * the muxer.
+ *
+ * @return 0 on success, exit code otherwise
+ * */
+int Cutter::startOutput(Output* output)
+{
+	TSOutput* ts = TSOutput::fromContext(output->context->pb);
+	
+	if(!ts->isOpen() && !ts->open())
+		return 1;
+	
+	output->state = Output::OPEN;
+	m_openOutputs.push_back(output);
+	
+	if(avformat_write_header(output->context, 0) < 0)
+	{
+		error("Could not write header of '%s'", output->context->filename);
+		return 2;
+	}
+	
+	if(output->muxer->start() != 0)
+		return 2;
+	
+	if(m_verbose && m_outputs.size() > 1)
+		printf("Opened output '%s'\n", output->context->filename);
+	
+	return 0;
+}
+
+/**
+ * Open all outputs whose first cut in is coming up at @c time.
+ *
+ * @return 0 on success, exit code otherwise
+ * */
+int Cutter::openOutputs(int64_t time)
+{
+	if(time < m_nextOpenTime)
+		return 0;
+	
+	m_nextOpenTime = INT64_MAX;
+	
+	for(int i = 0; i < m_outputs.size(); ++i)
+	{
+		Output* output = &m_outputs[i];
+		
+		if(output->state != Output::PENDING)
+			continue;
+		
+		if(output->openTime > time)
+		{
+			if(output->openTime < m_nextOpenTime)
+				m_nextOpenTime = output->openTime;
+			continue;
+		}
+		
+		int ret = startOutput(output);
+		if(ret != 0)
+			return ret;
+	}
+	
+	return 0;
+}
+
+//! Are all stream handlers of @c output past their last cut point?
+bool Cutter::outputFinished(const Output& output) const
+{
+	for(int i = 0; i < output.handlers.size(); ++i)
+	{
+		if(output.handlers[i]->active())
+			return false;
+	}
+	
+	return true;
+}
+
+/**
+ * Finish the stream handlers of @c output, write the trailer and close
+ * the file. The handlers are deleted, the demux loop does not need them
+ * any more.
+ *
+ * @return 0 on success, exit code otherwise
+ * */
+int Cutter::finishOutput(Output* output)
+{
+	int exit_code = 0;
+	
+	for(int i = 0; i < output->handlers.size(); ++i)
+	{
+		if(output->handlers[i]->finish() != 0)
+			exit_code = 2;
+	}
+	
+	if(output->muxer->finish() != 0 && exit_code == 0)
+		exit_code = 2;
+	
+	av_write_trailer(output->context);
+	
+	if(TSOutput::fromContext(output->context->pb)->close() != 0 && exit_code == 0)
+		exit_code = 1;
+	
+	output->state = Output::CLOSED;
+	m_openOutputs.erase(std::find(m_openOutputs.begin(), m_openOutputs.end(), output));
+	
+	for(int i = 0; i < output->handlers.size(); ++i)
+	{
+		StreamHandler* handler = output->handlers[i];
+		
+		std::pair<StreamMap::iterator, StreamMap::iterator> range
+			= m_handlers.equal_range(handler->stream()->index);
+		
+		for(StreamMap::iterator it = range.first; it != range.second; ++it)
+		{
+			if(it->second == handler)
+			{
+				m_handlers.erase(it);
+				break;
+			}
+		}
+		
+		delete handler;
+	}
+	output->handlers.clear();
+	
+	if(m_verbose && m_outputs.size() > 1)
+		printf("Closed output '%s'\n", output->context->filename);
+	
+	return exit_code;
+}
+
+/**
+ * Finish all outputs whose handlers are past their last cut point (see
+ * finishOutput()).
+ *
+ * @return 0 on success, exit code otherwise
+ * */
+int Cutter::closeFinishedOutputs()
+{
+	int exit_code = 0;
+	
+	for(int i = 0; i < m_openOutputs.size();)
+	{
+		Output* output = m_openOutputs[i];
+		
+		if(!outputFinished(*output))
+		{
+			++i;
+			continue;
+		}
+		
+		// Removes the output from m_openOutputs
+		int ret = finishOutput(output);
+		if(ret != 0 && exit_code == 0)
+			exit_code = ret;
+	}
+	
+	return exit_code;
+}
+
+int Cutter::runSerial()
+{
+	AVFormatContext* ctx = m_input;
+	int last_percent_done = 0;
+	int exit_code = 0;
+	
+	AVPacket packet;
+	while(av_read_frame(ctx, &packet) == 0)
+	{
+		if(m_handlers.find(packet.stream_index) == m_handlers.end())
+		{
+			av_free_packet(&packet);
+			continue;
+		}
+		
+		int64_t time = packetTime(packet);
+		int64_t pos = packet.pos;
+		
+		if(m_skipCheck && time != AV_NOPTS_VALUE && !checkSkip(time))
+		{
+			av_free_packet(&packet);
+			continue;
+		}
+		
+		if(m_progress)
+			printProgress(packet, &last_percent_done);
+		
+		if(m_passthrough)
+			m_passthrough->packetDelivered(packet);
+		
+		if(time != AV_NOPTS_VALUE)
+		{
+			exit_code = openOutputs(time);
+			if(exit_code != 0)
+			{
+				av_free_packet(&packet);
+				break;
+			}
+		}
+		
+		if(dispatchPacket(&packet) != 0)
+		{
+			av_free_packet(&packet);
+			exit_code = 2;
+			break;
+		}
+		
+		av_free_packet(&packet);
+		
+		exit_code = closeFinishedOutputs();
+		if(exit_code != 0)
+			break;
+		
+		if(allFinished())
+			break;
+		
+		if(m_skip && time != AV_NOPTS_VALUE)
+			skipCutout(time, pos);
+		
+		if(m_passthrough && time != AV_NOPTS_VALUE)
+		{
+			int ret = passthrough(time);
+			
+			if(ret < 0)
+			{
+				exit_code = 2;
+				break;
+			}
+			
+			// End of file reached
+			if(ret == 2)
+				break;
+		}
+	}
+	
+	if(m_passthrough && m_verbose)
+	{
+		printf("Copied %.2f MiB as raw TS packets\n",
+			(float)m_passthrough->bytesCopied() / 1024 / 1024);
+	}
+	
+	return exit_code;
+}
+
+/**
+ * Pass a packet to the stream handlers of all outputs. With more than
+ * one output, every handler but the last gets a private copy of the
+ * packet, since handlers may modify the payload in place (GenericAudio
+ * encodes the first frame after a cut into the packet). The last handler
+ * gets the packet itself, which is untouched until then. Handlers that
+ * decode the packet share the result (see Decoder).
+ *
+ * @return non-zero on error
+ * */
+int Cutter::dispatchPacket(AVPacket* packet)
+{
+	DecoderMap::iterator decoder = m_decoders.find(packet->stream_index);
+	if(decoder != m_decoders.end())
+		decoder->second->nextPacket();
+	
+	std::pair<StreamMap::iterator, StreamMap::iterator> range
+		= m_handlers.equal_range(packet->stream_index);
+	
+	StreamMap::iterator it = range.first;
+	StreamMap::iterator next = it;
+	++next;
+	
+	for(; next != range.second; it = next++)
+	{
+		AVPacket copy = *packet;
+		copy.destruct = NULL;
+		
+		if(av_dup_packet(&copy) != 0)
+			return error("Could not copy packet");
+		
+		int ret = handlePacket(it->second, &copy);
+		av_free_packet(&copy);
+		
+		if(ret != 0)
+			return -1;
+	}
+	
+	return handlePacket(it->second, packet);
+}
+
+/**
+ * @return 0 if nothing was copied, 1 after copying, 2 at end of input,
+ *   -1 on error
+ * */
+int Cutter::passthrough(int64_t time)
+{
+	if(m_passthroughRetry != AV_NOPTS_VALUE && time < m_passthroughRetry)
+		return 0;
+	
+	for(StreamMap::const_iterator it = m_handlers.begin(); it != m_handlers.end(); ++it)
+	{
+		if(!it->second->copying())
+			return 0;
+	}
+	
+	const CutPoint* next = m_outputs[0].cutlist.nextCutPoint(time);
+	int64_t end = INT64_MAX;
+	
+	if(next)
+	{
+		if(next->direction != CutPoint::OUT)
+			return 0;
+		
+		end = next->time - preroll() - PASSTHROUGH_MARGIN;
+	}
+	
+	if(end - time < PASSTHROUGH_MIN_SPAN)
+		return 0;
+	
+	if(m_outputs[0].muxer->flush() != 0)
+	{
+		log_warning("Could not flush muxer, disabling raw TS copying");
+		delete m_passthrough;
+		m_passthrough = 0;
+		return 0;
+	}
+	
+	bool eof;
+	int64_t pos = m_passthrough->copySpan(end, &eof);
+	
+	if(pos < 0)
+	{
+		// Try again later
+		m_passthroughRetry = time + AV_TIME_BASE;
+		return 0;
+	}
+	
+	if(m_verbose)
+	{
+		printf("Copied %.2fs - %.2fs as raw TS packets\n",
+			(float)time / AV_TIME_BASE,
+			(float)(eof ? m_input->duration : end) / AV_TIME_BASE);
+	}
+	
+	if(eof)
+		return 2;
+	
+	if(avformat_seek_file(m_input, -1, 0, pos, pos, AVSEEK_FLAG_BYTE) < 0)
+	{
+		error("Could not seek behind copied region");
+		return -1;
+	}
+	
+	notifySeek();
+	
+	return 1;
+}
+
+// Pipelined mode
+
+struct HandlerWorker
+{
+	int output;
+	StreamHandler* handler;
+	SPSCQueue<AVPacket>* queue;
+	pthread_t thread;
+	bool running;
+	volatile bool failed;
+};
+
+static void* handlerWorker(void* arg)
+{
+	HandlerWorker* w = (HandlerWorker*)arg;
+	
+	AVPacket packet;
+	while(w->queue->pop(&packet))
+	{
+		// After an error, keep draining so that the demuxer never blocks
+		if(!w->failed && handlePacket(w->handler, &packet) != 0)
+		{
+			error("Stream handler for stream %d failed", w->handler->stream()->index);
+			w->failed = true;
+		}
+		
+		av_free_packet(&packet);
+	}
+	
+	return 0;
+}
+
+/**
+ * Close the queue of @c w and wait for the worker thread, then free it.
+ *
+ * @return false if the stream handler failed
+ * */
+static bool stopWorker(HandlerWorker* w)
+{
+	w->queue->close();
+	
+	if(w->running)
+		pthread_join(w->thread, 0);
+	else
+	{
+		// Never started, nobody consumed the queue
+		AVPacket packet;
+		while(w->queue->tryPop(&packet))
+			av_free_packet(&packet);
+	}
+	
+	bool ok = !w->failed;
+	
+	delete w->queue;
+	delete w;
+	
+	return ok;
+}
+
+int Cutter::runPipelined()
+{
+	AVFormatContext* ctx = m_input;
+	int last_percent_done = 0;
+	int exit_code = 0;
+	
+	typedef std::multimap<int, HandlerWorker*> WorkerMap;
+	WorkerMap workers;
+	
+	if(!registerLockManager())
+	{
+		error("Could not register lock manager");
+		return 2;
+	}
+	
+	for(int i = 0; i < m_outputs.size() && exit_code == 0; ++i)
+	{
+		const std::vector<StreamHandler*>& handlers = m_outputs[i].handlers;
+		
+		for(int j = 0; j < handlers.size(); ++j)
+		{
+			int index = handlers[j]->stream()->index;
+			
+			HandlerWorker* w = new HandlerWorker;
+			w->output = i;
+			w->handler = handlers[j];
+			w->queue = new SPSCQueue<AVPacket>(PIPELINE_QUEUE_SIZE);
+			w->failed = false;
+			w->running = (pthread_create(&w->thread, 0, &handlerWorker, w) == 0);
+			
+			workers.insert(std::make_pair(index, w));
+			
+			if(!w->running)
+			{
+				error("Could not create worker thread for stream %d", index);
+				exit_code = 2;
+				break;
+			}
+		}
+	}
+	
+	AVPacket packet;
+	while(exit_code == 0 && av_read_frame(ctx, &packet) == 0)
+	{
+		std::pair<WorkerMap::iterator, WorkerMap::iterator> range
+			= workers.equal_range(packet.stream_index);
+		
+		if(range.first == range.second)
+		{
+			av_free_packet(&packet);
+			continue;
+		}
+		
+		// The packet may point into demuxer buffers, make it our own
+		// before handing it to another thread.
+		if(av_dup_packet(&packet) < 0)
+		{
+			av_free_packet(&packet);
+			exit_code = 2;
+			break;
+		}
+		
+		if(m_progress)
+			printProgress(packet, &last_percent_done);
+		
+		int64_t time = packetTime(packet);
+		if(time != AV_NOPTS_VALUE)
+		{
+			exit_code = openOutputs(time);
+			if(exit_code != 0)
+			{
+				av_free_packet(&packet);
+				break;
+			}
+		}
+		
+		// Every worker of another output gets its own copy, ownership
+		// of the original is transferred to the last one.
+		WorkerMap::iterator last = range.second;
+		--last;
+		
+		for(WorkerMap::iterator it = range.first; it != last; ++it)
+		{
+			AVPacket copy = packet;
+			copy.destruct = NULL;
+			
+			if(av_dup_packet(&copy) < 0)
+			{
+				exit_code = 2;
+				break;
+			}
+			
+			it->second->queue->push(copy);
+		}
+		
+		last->second->queue->push(packet);
+		
+		for(WorkerMap::const_iterator wit = workers.begin(); wit != workers.end(); ++wit)
+		{
+			if(wit->second->failed)
+				exit_code = 2;
+		}
+		
+		if(exit_code != 0 || allFinished())
+			break;
+		
+		// Stop the workers of finished outputs before closing them
+		for(int i = 0; i < m_openOutputs.size();)
+		{
+			Output* output = m_openOutputs[i];
+			
+			if(!outputFinished(*output))
+			{
+				++i;
+				continue;
+			}
+			
+			int index = output - &m_outputs[0];
+			
+			for(WorkerMap::iterator it = workers.begin(); it != workers.end();)
+			{
+				if(it->second->output != index)
+				{
+					++it;
+					continue;
+				}
+				
+				if(!stopWorker(it->second))
+					exit_code = 2;
+				
+				workers.erase(it++);
+			}
+			
+			// Removes the output from m_openOutputs
+			int ret = finishOutput(output);
+			if(ret != 0 && exit_code == 0)
+				exit_code = ret;
+		}
+	}
+	
+	for(WorkerMap::iterator it = workers.begin(); it != workers.end(); ++it)
+	{
+		if(!stopWorker(it->second))
+			exit_code = 2;
+	}
+	
+	return exit_code;
+}
@@ -0,0 +1,254 @@
+// Cutting loop
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#ifndef CUTTER_H
+#define CUTTER_H
+
+#include <stdint.h>
+#include <map>
+#include <vector>
+
+#include "cutlist.h"
+#include "streamhandler.h"
+
+class AVFormatContext;
+class AVPacket;
+class IndexFile;
+class MemStats;
+class Muxer;
+class Decoder;
+class AVStream;
+class TSPassthrough;
+
+/**
+ * @brief Open an MPEG-TS output context
+ *
+ * The IO context of the returned context is a TSOutput filter in front
+ * of the actual output file(s).
+ *
+ * @param filename Output file name (or template if split_size is set).
+ *   "pipe:N" writes to file descriptor N, protocol URLs ("udp://..." etc.)
+ *   are opened with avio_open(). Neither can be split.
+ * @param split_size Split output after this many bytes (0 = no splitting)
+ * @param split_keyframes Only split right before video keyframes, so
+ *   that every part can be played on its own (see Muxer)
+ * @param split_duration Split output after this time (AV_TIME_BASE
+ *   units, implies @c split_keyframes, 0 = off)
+ * @param deferred Do not open the output file yet. Cutter::run() opens
+ *   it shortly before the first cut in (see TSOutput::open()).
+ * @return output context, NULL on error
+ * */
+AVFormatContext* openOutput(const char* filename, uint64_t split_size,
+	bool split_keyframes = false, int64_t split_duration = 0,
+	bool deferred = false);
+
+/**
+ * Close an output context opened with openOutput(), if Cutter::run()
+ * did not already close its file.
+ *
+ * @return non-zero if not all data could be written
+ * */
+int closeOutput(AVFormatContext* ctx);
+
+/**
+ * Register a lock manager with libavcodec. Needed as soon as codecs
+ * are opened from more than one thread. Only the first call registers
+ * it, so any thread may call this.
+ *
+ * @return false on error
+ * */
+bool registerLockManager();
+
+/**
+ * @brief Cuts one input file
+ *
+ * Owns the stream handlers for one input and one or more outputs (each
+ * with its own cut list) and drives the demux loop. The input is read
+ * only once, no matter how many outputs there are. Outside of pipelined
+ * mode, the handlers of all outputs share one Decoder per input stream,
+ * so overlapping decoding windows around nearby cut points are decoded
+ * once.
+ * */
+class Cutter
+{
+	public:
+		//! Input stream index -> stream handlers (one per output)
+		typedef std::multimap<int, StreamHandler*> StreamMap;
+		
+		Cutter(AVFormatContext* input, const CutPointList& cutlist);
+		virtual ~Cutter();
+		
+		/**
+		 * Only use audio streams decoded by decoder @c name
+		 * (ffmpeg decoder name, NULL = all)
+		 * */
+		void setAudioDecoder(const char* name);
+		
+		//! Settings passed to all stream handlers
+		void setHandlerOptions(const HandlerOptions& options);
+		
+		/**
+		 * @brief Progress reporting
+		 *
+		 * @param progress Print progress at all
+		 * @param verbose Provide progress info more often
+		 * */
+		void setProgress(bool progress, bool verbose);
+		
+		/**
+		 * @brief Skip cut out regions
+		 * 
+		 * If enabled, the input is repositioned shortly before the next
+		 * cut in as soon as all stream handlers are inside a cut out
+		 * region instead of demuxing the whole region.
+		 * 
+		 * @param index Index file for byte-exact seeking (may be NULL,
+		 *   timestamp seeking is used then)
+		 * */
+		void setSkipCutouts(bool skip, IndexFile* index = 0);
+		
+		/**
+		 * @brief Pipelined execution
+		 * 
+		 * Run each stream handler on its own worker thread and write the
+		 * output from a separate muxer thread (see ThreadedMuxer). The
+		 * calling thread only demuxes. Stages are connected by bounded
+		 * queues.
+		 * 
+		 * Needs to be called before setupHandlers(). Cut out skipping is
+		 * not available in this mode.
+		 * */
+		void setPipelined(bool pipelined);
+		
+		/**
+		 * @brief Raw TS copying
+		 * 
+		 * Copy regions in which all stream handlers just pass their input
+		 * through directly from the input file instead of demuxing and
+		 * remuxing them (see TSPassthrough). The output needs to be opened
+		 * with openOutput().
+		 * 
+		 * Needs to be called before setupHandlers(). Has no effect in
+		 * pipelined mode.
+		 * */
+		void setPassthrough(bool passthrough);
+		
+		/**
+		 * Create stream handlers and the corresponding output streams
+		 * in @c output.
+		 *
+		 * @return false on error
+		 * */
+		bool setupHandlers(AVFormatContext* output);
+		
+		/**
+		 * @brief Additional output
+		 * 
+		 * Create another set of stream handlers writing to @c output,
+		 * cut according to @c cutlist. Call after setupHandlers().
+		 * Raw TS copying is disabled as soon as there is more than one
+		 * output.
+		 * 
+		 * @return false on error
+		 * */
+		bool addOutput(const CutPointList& cutlist, AVFormatContext* output);
+		
+		/**
+		 * Account for cut outs that happened before the first cut point
+		 * of our cutlist (see StreamHandler::setPrecedingCutout()).
+		 * */
+		void setPrecedingCutout(const CutPointList& list);
+		
+		/**
+		 * Maximum time (in AV_TIME_BASE units) any stream handler needs
+		 * to see before a cut point.
+		 * */
+		int64_t preroll() const;
+		
+		/**
+		 * Run the demux loop until the input ends or all stream
+		 * handlers are finished.
+		 *
+		 * Writes header and trailer of each output. An output whose file
+		 * is not open yet (see openOutput()) is opened shortly before its
+		 * first cut in. As soon as the handlers of an output are past
+		 * their last cut point, they are finished and deleted, and the
+		 * output file is closed, so outputs only use buffers and writer
+		 * threads while they are being written.
+		 *
+		 * @return 0 on success, exit code otherwise
+		 * */
+		int run();
+	private:
+		AVFormatContext* m_input;
+		CutPointList m_cutlist;
+		StreamMap m_handlers;
+		
+		struct Output
+		{
+			AVFormatContext* context;
+			CutPointList cutlist;
+			Muxer* muxer;
+			std::vector<StreamHandler*> handlers;
+			
+			enum State { PENDING, OPEN, CLOSED } state;
+			int64_t openTime; //!< Open the file here (AV_TIME_BASE units)
+		};
+		std::vector<Output> m_outputs;
+		std::vector<Output*> m_openOutputs;
+		int64_t m_nextOpenTime; //!< Earliest openTime of a pending output
+		
+		//! One per handler if HandlerOptions::memStats is set, with the
+		//! input stream index
+		std::vector<std::pair<int, MemStats*> > m_memStats;
+		
+		//! Input stream index -> decoder shared by all outputs
+		typedef std::map<int, Decoder*> DecoderMap;
+		DecoderMap m_decoders;
+		
+		//! Pipelined mode: decoders of the outputs after the first one
+		std::vector<Decoder*> m_privateDecoders;
+		
+		Decoder* decoderFor(AVStream* stream);
+		bool setupOutput(const CutPointList& cutlist, AVFormatContext* output);
+		int startOutput(Output* output);
+		int openOutputs(int64_t time);
+		bool outputFinished(const Output& output) const;
+		int finishOutput(Output* output);
+		int closeFinishedOutputs();
+		int dispatchPacket(AVPacket* packet);
+		int64_t nextCutIn(int64_t time) const;
+		
+		int runSerial();
+		int passthrough(int64_t time);
+		int runPipelined();
+		void printProgress(const AVPacket& packet, int* last_percent_done);
+		bool allFinished() const;
+		void printMemStats() const;
+		
+		// Cut out skipping
+		bool m_skip;
+		IndexFile* m_index;
+		bool m_skipCheck;
+		int64_t m_skipTarget;
+		int64_t m_skipReturnPos;
+		int64_t m_lastSkipCutIn;
+		
+		int64_t packetTime(const AVPacket& packet) const;
+		bool skipCutout(int64_t time, int64_t pos);
+		bool checkSkip(int64_t time);
+		void notifySeek();
+		
+		const char* m_audioDecoder;
+		HandlerOptions m_handlerOptions;
+		bool m_progress;
+		bool m_verbose;
+		bool m_pipelined;
+		
+		// Raw TS copying
+		bool m_passthroughEnabled;
+		TSPassthrough* m_passthrough;
+		int64_t m_passthroughRetry;
+};
+
+#endif // CUTTER_H
@@ -0,0 +1,146 @@
+// Input stream decoder shared between stream handlers
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#include "decoder.h"
+
+extern "C"
+{
+#include <libavutil/mem.h>
+}
+
+#include <string.h>
+#include <algorithm>
+
+#define DEBUG 0
+#define LOG_PREFIX "[decoder]"
+#include <common/log.h>
+
+Decoder::Decoder(AVCodecContext* ctx, bool owned)
+ : m_ctx(ctx)
+ , m_owned(owned)
+ , m_openCount(0)
+ , m_decoded(false)
+ , m_ret(0)
+ , m_gotFrame(0)
+ , m_samples(0)
+ , m_samplesSize(0)
+{
+	avcodec_get_frame_defaults(&m_frame);
+}
+
+Decoder::~Decoder()
+{
+	av_free(m_samples);
+	
+	if(m_owned)
+	{
+		avcodec_close(m_ctx);
+		av_freep(&m_ctx->extradata);
+		av_free(m_ctx);
+	}
+}
+
+int Decoder::open(AVCodec* codec, AVDictionary** options)
+{
+	if(!m_openCount && avcodec_open2(m_ctx, codec, options) != 0)
+		return -1;
+	
+	m_openCount++;
+	return 0;
+}
+
+void Decoder::start(const void* user)
+{
+	if(std::find(m_users.begin(), m_users.end(), user) != m_users.end())
+		return;
+	
+	if(m_users.empty())
+		avcodec_flush_buffers(m_ctx);
+	else
+		log_debug("Joining running decoder (%d users)", (int)m_users.size());
+	
+	m_users.push_back(user);
+}
+
+void Decoder::stop(const void* user)
+{
+	std::vector<const void*>::iterator it = std::find(m_users.begin(), m_users.end(), user);
+	
+	if(it != m_users.end())
+		m_users.erase(it);
+}
+
+void Decoder::seeked()
+{
+	m_users.clear();
+	m_decoded = false;
+	avcodec_flush_buffers(m_ctx);
+}
+
+void Decoder::nextPacket()
+{
+	m_decoded = false;
+}
+
+int Decoder::decodeVideo(AVFrame* frame, int* gotFrame, AVPacket* packet)
+{
+	if(sharing() && m_decoded)
+	{
+		// Handlers change the frame fields for encoding, so each one
+		// gets a copy. The picture itself stays in the decoder buffers.
+		*frame = m_frame;
+		*gotFrame = m_gotFrame;
+		return m_ret;
+	}
+	
+	int ret = avcodec_decode_video2(m_ctx, frame, gotFrame, packet);
+	
+	if(sharing())
+	{
+		m_decoded = true;
+		m_ret = ret;
+		m_gotFrame = *gotFrame;
+		m_frame = *frame;
+	}
+	
+	return ret;
+}
+
+int Decoder::decodeAudio(int16_t* samples, int* frameSize, AVPacket* packet)
+{
+	if(sharing() && m_decoded)
+	{
+		if(m_ret < 0)
+			return m_ret;
+		
+		if(m_samplesSize > *frameSize)
+			return error("Sample buffer too small for shared frame");
+		
+		memcpy(samples, m_samples, m_samplesSize);
+		*frameSize = m_samplesSize;
+		return m_ret;
+	}
+	
+	int ret = avcodec_decode_audio3(m_ctx, samples, frameSize, packet);
+	
+	if(sharing())
+	{
+		if(ret >= 0 && !m_samples)
+		{
+			m_samples = (int16_t*)av_malloc(AVCODEC_MAX_AUDIO_FRAME_SIZE);
+			if(!m_samples)
+				return error("Could not allocate sample buffer");
+		}
+		
+		m_decoded = true;
+		m_ret = ret;
+		
+		if(ret >= 0)
+		{
+			m_samplesSize = std::min(*frameSize, AVCODEC_MAX_AUDIO_FRAME_SIZE);
+			memcpy(m_samples, samples, m_samplesSize);
+		}
+	}
+	
+	return ret;
+}
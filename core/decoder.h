@@ -0,0 +1,96 @@
+// Input stream decoder shared between stream handlers
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <stdint.h>
+#include <vector>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+/**
+ * @brief Decoder of one input stream
+ *
+ * With several outputs, the stream handlers of all outputs get each
+ * packet of a stream one after the other (see Cutter::dispatchPacket()).
+ * They share one Decoder: the first handler decoding a packet runs the
+ * codec, the others get the same result. Handlers whose decoding windows
+ * overlap (see start()) thus decode the stream only once.
+ *
+ * Results are only shared if more than one handler opened the decoder.
+ * The owner then calls nextPacket() before dispatching each packet. A
+ * decoder used by a single handler simply passes everything to the codec.
+ * */
+class Decoder
+{
+	public:
+		/**
+		 * @param ctx Codec context of the input stream
+		 * @param owned @c ctx is a private copy, closed and freed by the
+		 *   destructor
+		 * */
+		Decoder(AVCodecContext* ctx, bool owned = false);
+		~Decoder();
+		
+		inline AVCodecContext* context() const
+		{ return m_ctx; }
+		
+		inline bool isOpen() const
+		{ return m_openCount != 0; }
+		
+		/**
+		 * Open the codec for one more handler. Only the first call
+		 * actually opens it.
+		 *
+		 * @return non-zero on error
+		 * */
+		int open(AVCodec* codec, AVDictionary** options = 0);
+		
+		/**
+		 * @c user starts decoding at a key frame. The codec is flushed
+		 * unless another user is decoding at the moment, @c user joins
+		 * that decoding process then.
+		 * */
+		void start(const void* user);
+		
+		//! @c user does not decode any more packets until start()
+		void stop(const void* user);
+		
+		//! Is more than one user decoding at the moment?
+		inline bool shared() const
+		{ return m_users.size() > 1; }
+		
+		//! The input was repositioned, flush and forget all users
+		void seeked();
+		
+		//! The next packet is about to be dispatched
+		void nextPacket();
+		
+		//! avcodec_decode_video2() or the result for the current packet
+		int decodeVideo(AVFrame* frame, int* gotFrame, AVPacket* packet);
+		
+		//! avcodec_decode_audio3() or the result for the current packet
+		int decodeAudio(int16_t* samples, int* frameSize, AVPacket* packet);
+	private:
+		AVCodecContext* m_ctx;
+		bool m_owned;
+		int m_openCount;
+		std::vector<const void*> m_users;
+		
+		// Result for the current packet
+		bool m_decoded;
+		int m_ret;
+		int m_gotFrame;
+		AVFrame m_frame;
+		int16_t* m_samples; //!< AVCODEC_MAX_AUDIO_FRAME_SIZE bytes
+		int m_samplesSize;
+		
+		inline bool sharing() const
+		{ return m_openCount > 1; }
+};
+
+#endif // DECODER_H
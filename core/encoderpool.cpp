@@ -0,0 +1,226 @@
+// Pool of opened encoder contexts
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#include "encoderpool.h"
+#include "cutter.h"
+
+#define DEBUG 0
+#define LOG_PREFIX "[encoderpool]"
+#include <common/log.h>
+
+EncoderPool::EncoderPool(AVCodec* codec, const AVCodecContext* tmpl,
+	AVDictionary* options, int size, bool background)
+ : m_codec(codec)
+ , m_options(0)
+ , m_size(size)
+ , m_background(background)
+ , m_opening(0)
+ , m_generation(0)
+ , m_failed(false)
+ , m_quit(false)
+{
+	m_template = avcodec_alloc_context3(codec);
+	avcodec_copy_context(m_template, tmpl);
+	
+	av_dict_copy(&m_options, options, 0);
+	
+	pthread_mutex_init(&m_mutex, 0);
+	pthread_cond_init(&m_cond, 0);
+	
+	// Codecs are opened from two threads now
+	if(m_background && !registerLockManager())
+	{
+		log_warning("Could not register lock manager, opening encoders on demand");
+		m_background = false;
+	}
+	
+	if(m_background && pthread_create(&m_thread, 0, &EncoderPool::worker, this) != 0)
+	{
+		log_warning("Could not create worker thread, opening encoders on demand");
+		m_background = false;
+	}
+}
+
+EncoderPool::~EncoderPool()
+{
+	if(m_background)
+	{
+		pthread_mutex_lock(&m_mutex);
+		m_quit = true;
+		pthread_cond_broadcast(&m_cond);
+		pthread_mutex_unlock(&m_mutex);
+		
+		pthread_join(m_thread, 0);
+	}
+	
+	for(int i = 0; i < (int)m_ready.size(); ++i)
+		close(m_ready[i]);
+	for(int i = 0; i < (int)m_closing.size(); ++i)
+		close(m_closing[i]);
+	
+	freeContext(m_template);
+	av_dict_free(&m_options);
+	
+	pthread_cond_destroy(&m_cond);
+	pthread_mutex_destroy(&m_mutex);
+}
+
+AVCodecContext* EncoderPool::acquire()
+{
+	AVCodecContext* ctx = 0;
+	
+	pthread_mutex_lock(&m_mutex);
+	
+	// The worker refills the pool until it fails
+	while(m_background && !m_failed && m_ready.empty())
+		pthread_cond_wait(&m_cond, &m_mutex);
+	
+	if(!m_ready.empty())
+	{
+		ctx = m_ready.back();
+		m_ready.pop_back();
+		pthread_cond_broadcast(&m_cond);
+	}
+	
+	pthread_mutex_unlock(&m_mutex);
+	
+	if(!ctx)
+		ctx = open(0);
+	
+	return ctx;
+}
+
+void EncoderPool::release(AVCodecContext* ctx)
+{
+	if(!m_background)
+	{
+		close(ctx);
+		return;
+	}
+	
+	pthread_mutex_lock(&m_mutex);
+	m_closing.push_back(ctx);
+	pthread_cond_broadcast(&m_cond);
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void EncoderPool::update(const AVCodecContext* tmpl)
+{
+	pthread_mutex_lock(&m_mutex);
+	
+	freeContext(m_template);
+	m_template = avcodec_alloc_context3(m_codec);
+	avcodec_copy_context(m_template, tmpl);
+	
+	m_generation++;
+	
+	m_closing.insert(m_closing.end(), m_ready.begin(), m_ready.end());
+	m_ready.clear();
+	
+	pthread_cond_broadcast(&m_cond);
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void* EncoderPool::worker(void* arg)
+{
+	((EncoderPool*)arg)->run();
+	return 0;
+}
+
+void EncoderPool::run()
+{
+	pthread_mutex_lock(&m_mutex);
+	
+	while(!m_quit)
+	{
+		if(!m_closing.empty())
+		{
+			AVCodecContext* ctx = m_closing.back();
+			m_closing.pop_back();
+			
+			pthread_mutex_unlock(&m_mutex);
+			close(ctx);
+			pthread_mutex_lock(&m_mutex);
+			continue;
+		}
+		
+		if(!m_failed && (int)m_ready.size() + m_opening < m_size)
+		{
+			int generation;
+			
+			m_opening++;
+			pthread_mutex_unlock(&m_mutex);
+			AVCodecContext* ctx = open(&generation);
+			pthread_mutex_lock(&m_mutex);
+			m_opening--;
+			
+			if(!ctx)
+			{
+				log_warning("Could not open encoder in the background");
+				m_failed = true;
+			}
+			else if(generation != m_generation)
+				m_closing.push_back(ctx); // settings changed meanwhile
+			else
+			{
+				log_debug("Encoder ready");
+				m_ready.push_back(ctx);
+			}
+			
+			pthread_cond_broadcast(&m_cond);
+			continue;
+		}
+		
+		pthread_cond_wait(&m_cond, &m_mutex);
+	}
+	
+	pthread_mutex_unlock(&m_mutex);
+}
+
+/**
+ * Open a context with the current template settings
+ *
+ * @param generation set to the template generation used (may be NULL)
+ * @return NULL on error
+ * */
+AVCodecContext* EncoderPool::open(int* generation)
+{
+	AVCodecContext* ctx = avcodec_alloc_context3(m_codec);
+	AVDictionary* opts = 0;
+	
+	if(!ctx)
+		return 0;
+	
+	pthread_mutex_lock(&m_mutex);
+	int ret = avcodec_copy_context(ctx, m_template);
+	av_dict_copy(&opts, m_options, 0);
+	if(generation)
+		*generation = m_generation;
+	pthread_mutex_unlock(&m_mutex);
+	
+	if(ret == 0)
+		ret = avcodec_open2(ctx, m_codec, &opts);
+	
+	av_dict_free(&opts);
+	
+	if(ret != 0)
+	{
+		error("Could not open encoder");
+		freeContext(ctx);
+		return 0;
+	}
+	
+	return ctx;
+}
+
+void EncoderPool::close(AVCodecContext* ctx)
+{
+	avcodec_close(ctx);
+	freeContext(ctx);
+}
+
+void EncoderPool::freeContext(AVCodecContext* ctx)
+{
+	av_freep(&ctx->extradata);
+	av_free(ctx);
+}
@@ -0,0 +1,88 @@
+// Pool of opened encoder contexts
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#ifndef ENCODERPOOL_H
+#define ENCODERPOOL_H
+
+#include <pthread.h>
+#include <vector>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+/**
+ * @brief Keeps encoder contexts opened ahead of time
+ *
+ * Opening an encoder (libx264 in particular) is expensive, and a stream
+ * handler needs a fresh one for every cut in. The pool opens contexts with
+ * the settings of a template context, so that acquire() usually does not
+ * have to wait.
+ *
+ * libavcodec cannot reset an opened encoder (libx264 does not even accept
+ * frames after it was flushed), so a used context is closed and replaced
+ * by a new one instead of being reused.
+ *
+ * In background mode, a worker thread does the closing and opening, which
+ * then happens while the stream is copied and not at the cut point.
+ * Otherwise everything happens on demand in the calling thread.
+ * */
+class EncoderPool
+{
+	public:
+		/**
+		 * @param codec Encoder
+		 * @param tmpl Settings for the contexts (copied)
+		 * @param options Passed to avcodec_open2() (copied, may be NULL)
+		 * @param size Number of contexts kept open in background mode
+		 * @param background Open and close contexts in a worker thread
+		 * */
+		EncoderPool(AVCodec* codec, const AVCodecContext* tmpl,
+			AVDictionary* options, int size, bool background);
+		~EncoderPool();
+		
+		/**
+		 * Get an opened context. Waits for the worker if it is just
+		 * opening one, opens one directly if none is coming.
+		 *
+		 * @return NULL on error
+		 * */
+		AVCodecContext* acquire();
+		
+		//! Hand back a context obtained by acquire()
+		void release(AVCodecContext* ctx);
+		
+		/**
+		 * The template settings changed (e.g. interlacing was detected),
+		 * contexts opened with the old settings are dropped.
+		 * */
+		void update(const AVCodecContext* tmpl);
+	private:
+		static void* worker(void* arg);
+		void run();
+		
+		AVCodecContext* open(int* generation);
+		static void close(AVCodecContext* ctx);
+		static void freeContext(AVCodecContext* ctx);
+		
+		AVCodec* m_codec;
+		AVCodecContext* m_template;
+		AVDictionary* m_options;
+		int m_size;
+		
+		bool m_background;
+		pthread_t m_thread;
+		pthread_mutex_t m_mutex;
+		pthread_cond_t m_cond;
+		
+		// Protected by m_mutex
+		std::vector<AVCodecContext*> m_ready;
+		std::vector<AVCodecContext*> m_closing;
+		int m_opening;
+		int m_generation; //!< Incremented by update()
+		bool m_failed;
+		bool m_quit;
+};
+
+#endif // ENCODERPOOL_H
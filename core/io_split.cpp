@@ -2,26 +2,76 @@
 // Author: Max Schwarz <Max@x-quadraht.de>
 
 #include "io_split.h"
+#include "spscqueue.h"
 
 extern "C"
 {
 #include <libavformat/avio.h>
+#include <libavutil/mem.h>
 }
 
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
 
-const int BUFSIZE = 1024;
+#include <vector>
+
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// Buffer handed to libavformat. A multiple of the TS packet size, so
+// that split points fall on packet boundaries.
+const int AVIO_BUFSIZE = 188 * 1024;
+
+// Buffers handed to the writer thread
+const int BUFSIZE = 4 * 1024 * 1024;
+const int NUM_BUFFERS = 3;
+const int BUFFER_ALIGNMENT = 4096;
+
+struct IOBuffer
+{
+	uint8_t* data;
+	int size;
+	std::vector<int> splits; //!< Start a new file at these offsets
+};
+
+typedef SPSCQueue<IOBuffer*> BufferQueue;
 
 struct IOSplitContext
 {
-	FILE* f;
-	unsigned int index;
 	char* path;
 	uint64_t split_size;
+	int flags;
+	
+	// Producer side
+	IOBuffer buffers[NUM_BUFFERS];
+	IOBuffer* current;
+	uint64_t queued_size;
+	
+	BufferQueue* filled;
+	BufferQueue* free;
+	
+	// Writer side
+	pthread_t thread;
+	int fd;
+	char* filename;
+	int next_fd;
+	char* next_filename;
+	unsigned int index;
 	uint64_t written_size;
+	
+	volatile int error;
 };
 
 static char* malloc_and_snprintf(const char* fmt, ...)
@@ -62,79 +112,288 @@ static char* malloc_and_snprintf(const char* fmt, ...)
 	return buf;
 }
 
-int io_split_write_packet(void* opaque, uint8_t* buf, int buf_size)
+static bool io_split_splitting(IOSplitContext* d)
 {
-	IOSplitContext* d = (IOSplitContext*)opaque;
-	int c = 0;
+	return d->split_size || (d->flags & IO_SPLIT_MANUAL);
+}
+
+static int io_split_open_part(IOSplitContext* d, char** filename)
+{
+	if(io_split_splitting(d))
+		*filename = malloc_and_snprintf(d->path, d->index);
+	else
+		*filename = strdup(d->path);
+	
+	if(!*filename)
+	{
+		perror("[io_split] Could not use filename template");
+		return -1;
+	}
+	
+	d->index++;
+	
+	int fd = open(*filename, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE | O_BINARY, 0666);
+	if(fd < 0)
+	{
+		perror("[io_split] Could not open output file");
+		return -1;
+	}
+
+#ifdef __linux__
+	// Reserve space for the whole part to avoid fragmentation. The file
+	// size stays at the written length.
+	if(d->split_size && (d->flags & IO_SPLIT_PREALLOCATE))
+		fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, d->split_size);
+#endif
+	
+	return fd;
+}
+
+static void io_split_close_part(IOSplitContext* d)
+{
+	fprintf(stderr, "[io_split] Closing output file, written size: %lluMiB\n",
+		(unsigned long long)(d->written_size / 1024 / 1024)
+	);
+	
+	close(d->fd);
+	free(d->filename);
 	
-	if(!d->f || d->written_size + buf_size > d->split_size)
+	d->fd = -1;
+	d->filename = 0;
+}
+
+static bool io_split_next_part(IOSplitContext* d)
+{
+	if(d->fd >= 0)
+		io_split_close_part(d);
+	
+	if(d->next_fd >= 0)
 	{
-		if(d->f)
-			fclose(d->f);
+		d->fd = d->next_fd;
+		d->filename = d->next_filename;
+		d->next_fd = -1;
+		d->next_filename = 0;
+	}
+	else
+	{
+		d->fd = io_split_open_part(d, &d->filename);
+		if(d->fd < 0)
+			return false;
+	}
+	
+	fprintf(stderr, "[io_split] Opening output file '%s'\n", d->filename);
+	d->written_size = 0;
+	
+	return true;
+}
+
+static bool io_split_write_data(IOSplitContext* d, const uint8_t* buf, int size)
+{
+	if(d->fd < 0 && !io_split_next_part(d))
+		return false;
+	
+	while(size > 0)
+	{
+		int ret = write(d->fd, buf, size);
 		
-		char* filename = malloc_and_snprintf(d->path, d->index);
-		if(!filename)
+		if(ret < 0)
 		{
-			perror("[io_split] Could not use filename template");
-			return -1;
+			if(errno == EINTR)
+				continue;
+			
+			perror("[io_split] Could not write()");
+			return false;
 		}
 		
-		fprintf(stderr, "[io_split] Opening output file '%s'\n", filename);
-		d->f = fopen64(filename, "wb");
-		free(filename);
-		
-		if(!d->f)
+		buf += ret;
+		size -= ret;
+		d->written_size += ret;
+	}
+	
+	// Open the next part before we need it. In manual mode we do not
+	// know when, so always keep one ready.
+	bool prepare = (d->flags & IO_SPLIT_MANUAL) || d->written_size > d->split_size / 4 * 3;
+	if(io_split_splitting(d) && d->next_fd < 0 && prepare)
+		d->next_fd = io_split_open_part(d, &d->next_filename);
+	
+	return true;
+}
+
+static void* io_split_writer(void* arg)
+{
+	IOSplitContext* d = (IOSplitContext*)arg;
+	IOBuffer* buf;
+	
+	while(d->filled->pop(&buf))
+	{
+		// After an error we just recycle the buffers so that the
+		// producer does not block.
+		if(!d->error)
 		{
-			perror("[io_split] Could not open output file");
-			return -1;
+			int off = 0;
+			bool ok = true;
+			
+			for(int i = 0; ok && i < buf->splits.size(); ++i)
+			{
+				ok = io_split_write_data(d, buf->data + off, buf->splits[i] - off)
+					&& io_split_next_part(d);
+				off = buf->splits[i];
+			}
+			
+			if(ok)
+				ok = io_split_write_data(d, buf->data + off, buf->size - off);
+			
+			if(!ok)
+				d->error = -1;
 		}
 		
-		d->written_size = 0;
-		d->index++;
+		buf->size = 0;
+		buf->splits.clear();
+		d->free->push(buf);
+	}
+	
+	return 0;
+}
+
+static void io_split_submit(IOSplitContext* d)
+{
+	d->filled->push(d->current);
+	d->free->pop(&d->current);
+}
+
+int io_split_write_packet(void* opaque, uint8_t* buf, int buf_size)
+{
+	IOSplitContext* d = (IOSplitContext*)opaque;
+	int c = buf_size;
+	
+	if(d->error)
+		return -1;
+	
+	if(d->split_size && !(d->flags & IO_SPLIT_MANUAL)
+		&& d->queued_size && d->queued_size + buf_size > d->split_size)
+	{
+		d->current->splits.push_back(d->current->size);
+		d->queued_size = 0;
 	}
 	
 	while(buf_size > 0)
 	{
-		int ret = fwrite(buf, 1, buf_size, d->f);
+		int n = BUFSIZE - d->current->size;
+		if(n > buf_size)
+			n = buf_size;
 		
-		if(ret <= 0)
-		{
-			perror("[io_split] Could not fwrite()");
-			return ret;
-		}
+		memcpy(d->current->data + d->current->size, buf, n);
+		d->current->size += n;
+		buf += n;
+		buf_size -= n;
 		
-		buf_size -= ret;
-		c += ret;
+		if(d->current->size == BUFSIZE)
+			io_split_submit(d);
 	}
 	
-	d->written_size += c;
+	d->queued_size += c;
 	
 	return c;
 }
 
-AVIOContext* io_split_create(const char* path, uint64_t split_size)
+int io_split_write(AVIOContext* ctx, const uint8_t* buf, int size)
 {
-	IOSplitContext* d = new IOSplitContext;
-	unsigned char* buffer = (unsigned char*)malloc(BUFSIZE);
-	AVIOContext* ctx = 0;
+	// Keep the order with anything written through the context
+	avio_flush(ctx);
 	
-	if(!buffer || !d)
-		goto error;
+	if(io_split_write_packet(ctx->opaque, (uint8_t*)buf, size) < 0)
+		return -1;
 	
-	d->f = NULL;
-	d->index = 0;
-	d->path = (char*)malloc(strlen(path) + 1);
+	return 0;
+}
+
+bool io_split_is_context(AVIOContext* ctx)
+{
+	return ctx->write_packet == &io_split_write_packet;
+}
+
+void io_split_new_part(AVIOContext* ctx)
+{
+	IOSplitContext* d = (IOSplitContext*)(ctx->opaque);
 	
-	if(!d->path)
-		goto error_path;
+	// There is only the one stream
+	if(d->flags & IO_SPLIT_STREAM)
+		return;
+	
+	avio_flush(ctx);
+	
+	d->current->splits.push_back(d->current->size);
+	d->queued_size = 0;
+}
+
+static IOSplitContext* io_split_alloc(const char* path, uint64_t split_size, int flags)
+{
+	IOSplitContext* d = new IOSplitContext;
 	
-	strcpy(d->path, path);
+	d->path = strdup(path);
+	if(!d->path)
+	{
+		delete d;
+		return 0;
+	}
 	
 	d->split_size = split_size;
+	d->flags = flags;
+	d->queued_size = 0;
+	d->fd = -1;
+	d->filename = 0;
+	d->next_fd = -1;
+	d->next_filename = 0;
+	d->index = 0;
 	d->written_size = 0;
+	d->error = 0;
+	
+	return d;
+}
+
+/**
+ * Allocate the buffers, start the writer thread and create the IO
+ * context. Opens the first part if there is no output fd yet. Frees
+ * @c d on error.
+ * */
+static AVIOContext* io_split_start(IOSplitContext* d)
+{
+	unsigned char* buffer = (unsigned char*)av_malloc(AVIO_BUFSIZE);
+	AVIOContext* ctx = 0;
+	int i = 0;
+	
+	d->filled = new BufferQueue(NUM_BUFFERS);
+	d->free = new BufferQueue(NUM_BUFFERS);
+	
+	if(!buffer)
+		goto error_buffers;
+	
+	for(i = 0; i < NUM_BUFFERS; ++i)
+	{
+		void* data;
+		if(posix_memalign(&data, BUFFER_ALIGNMENT, BUFSIZE) != 0)
+			goto error_buffers;
+		
+		d->buffers[i].data = (uint8_t*)data;
+		d->buffers[i].size = 0;
+	}
+	
+	d->current = &d->buffers[0];
+	for(i = 1; i < NUM_BUFFERS; ++i)
+		d->free->push(&d->buffers[i]);
+	
+	// Open the first part right away to catch errors early
+	if(d->fd < 0 && !io_split_next_part(d))
+		goto error_buffers;
+	
+	if(pthread_create(&d->thread, 0, &io_split_writer, d) != 0)
+	{
+		fprintf(stderr, "[io_split] Could not create writer thread\n");
+		goto error_file;
+	}
 	
 	ctx = avio_alloc_context(
-		buffer, BUFSIZE,
+		buffer, AVIO_BUFSIZE,
 		1, /* write_flag */
 		(void*)d,
 		NULL, /* read_packet */
@@ -145,25 +404,87 @@ AVIOContext* io_split_create(const char* path, uint64_t split_size)
 	if(ctx)
 		return ctx;
 	
-error_path:
+	d->filled->close();
+	pthread_join(d->thread, 0);
+	
+error_file:
+	if(d->fd >= 0)
+		close(d->fd);
+	free(d->filename);
+error_buffers:
+	while(i-- > 0)
+		free(d->buffers[i].data);
+	delete d->filled;
+	delete d->free;
 	free(d->path);
-error:
-	free(buffer);
+	av_free(buffer);
 	delete d;
 	return NULL;
 }
 
-void io_split_close(AVIOContext* ctx)
+AVIOContext* io_split_create(const char* path, uint64_t split_size, int flags)
+{
+	IOSplitContext* d = io_split_alloc(path, split_size, flags);
+	if(!d)
+		return NULL;
+	
+	return io_split_start(d);
+}
+
+AVIOContext* io_split_create_fd(int fd, const char* name)
+{
+	IOSplitContext* d = io_split_alloc(name, 0, IO_SPLIT_STREAM);
+	if(!d)
+		return NULL;
+	
+	d->fd = fd;
+	d->filename = strdup(name);
+	
+#ifndef _WIN32
+	// A reader going away should be a write error, not kill us
+	signal(SIGPIPE, SIG_IGN);
+#endif
+	
+	fprintf(stderr, "[io_split] Writing to '%s'\n", name);
+	
+	return io_split_start(d);
+}
+
+int io_split_close(AVIOContext* ctx)
 {
 	IOSplitContext* d = (IOSplitContext*)(ctx->opaque);
 	
-	if(d->f)
+	avio_flush(ctx);
+	
+	if(d->current->size)
+		d->filled->push(d->current);
+	
+	d->filled->close();
+	pthread_join(d->thread, 0);
+	
+	int ret = d->error;
+	
+	if(d->fd >= 0)
+		io_split_close_part(d);
+	
+	// Prepared, but never used
+	if(d->next_fd >= 0)
 	{
-		fprintf(stderr, "[io_split] Closing output file, written size: %lldMiB\n",
-			d->written_size / 1024 / 1024
-		);
-		fclose(d->f);
+		close(d->next_fd);
+		unlink(d->next_filename);
+		free(d->next_filename);
 	}
 	
+	for(int i = 0; i < NUM_BUFFERS; ++i)
+		free(d->buffers[i].data);
+	
+	delete d->filled;
+	delete d->free;
+	free(d->path);
 	delete d;
+	
+	av_free(ctx->buffer);
+	av_free(ctx);
+	
+	return ret;
 }
@@ -11,15 +11,64 @@ extern "C"
 #include <libavformat/avio.h>
 }
 
+enum IOSplitFlags
+{
+	IO_SPLIT_PREALLOCATE = (1 << 0), //!< Reserve split_size bytes for each part
+	IO_SPLIT_MANUAL = (1 << 1),      //!< Only split on io_split_new_part()
+	IO_SPLIT_STREAM = (1 << 2)       //!< Writing to a given fd (see io_split_create_fd())
+};
+
 /**
  * @brief Create io_split IO context
  * 
+ * Data is collected in large buffers and written by a background
+ * thread, so writing does not block the caller unless the disk
+ * cannot keep up.
+ * 
  * @param path Path template, needs to contain a %d for the file number
- *   (evaluated with snprintf)
- * @param split_size Maximum file size
+ *   (evaluated with snprintf). Used as is if split_size is 0.
+ * @param split_size Maximum file size (0 = do not split). With
+ *   IO_SPLIT_MANUAL only used for preallocation.
+ * @param flags see IOSplitFlags
+ * */
+AVIOContext* io_split_create(const char* path, uint64_t split_size,
+	int flags = IO_SPLIT_PREALLOCATE);
+
+/**
+ * @brief Create io_split IO context for an open file descriptor
+ * 
+ * For pipes and standard output. Nothing is ever split or seeked. At
+ * most a few buffers are queued, after that writing blocks until the
+ * reader catches up. The fd is closed by io_split_close().
+ * 
+ * @param name Used in messages
  * */
-AVIOContext* io_split_create(const char* path, uint64_t split_size);
+AVIOContext* io_split_create_fd(int fd, const char* name);
 
-void io_split_close(AVIOContext* ctx);
+/**
+ * Start a new output file at the current position. Only valid with
+ * IO_SPLIT_MANUAL.
+ * */
+void io_split_new_part(AVIOContext* ctx);
+
+/**
+ * Copy data straight into the write buffers, bypassing the buffer of
+ * the IO context. For writers that have complete blocks at hand anyway
+ * (see TSOutput). Automatic splitting (split_size) only happens between
+ * two calls.
+ * 
+ * @return non-zero on error
+ * */
+int io_split_write(AVIOContext* ctx, const uint8_t* buf, int size);
+
+//! Was @c ctx created by io_split_create() or io_split_create_fd()?
+bool io_split_is_context(AVIOContext* ctx);
+
+/**
+ * Write out all pending data, close the output and free the context.
+ * 
+ * @return non-zero if there was a write error
+ * */
+int io_split_close(AVIOContext* ctx);
 
 #endif // IO_SPLIT_H
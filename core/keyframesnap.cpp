@@ -0,0 +1,178 @@
+// Moves cut points to video key frames
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#include "keyframesnap.h"
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+#include <stdio.h>
+
+#define DEBUG 0
+#define LOG_PREFIX "[snap]"
+#include <common/log.h>
+
+//! Initial probe window in front of a cut point, doubled until a key frame is found
+const int64_t SNAP_WINDOW = 5LL * AV_TIME_BASE;
+
+//! Give up looking for a key frame after this much time behind the cut point
+const int64_t SNAP_MAX_SCAN = 60LL * AV_TIME_BASE;
+
+struct KeyFrames
+{
+	int64_t before; //!< Last key frame at or before the cut point
+	int64_t after; //!< First key frame at or after the cut point
+};
+
+/**
+ * Find the key frames of @c stream around @c cut, reading from @c start on
+ * (AV_TIME_BASE units relative to the input start time)
+ * */
+static bool probe(AVFormatContext* input, AVStream* stream, int64_t start,
+	int64_t cut, KeyFrames* frames)
+{
+	const int64_t mask = 0xFFFFFFFFFFFFFFFFLL >> (64 - stream->pts_wrap_bits);
+	const int64_t offset = av_rescale_q(input->start_time, AV_TIME_BASE_Q, stream->time_base);
+	
+	frames->before = AV_NOPTS_VALUE;
+	frames->after = AV_NOPTS_VALUE;
+	
+	// Timestamp seeking is not exact, but the start of the file is
+	int ret;
+	if(start == 0)
+		ret = avformat_seek_file(input, -1, 0, 0, 0, AVSEEK_FLAG_BYTE);
+	else
+	{
+		int64_t ts = input->start_time + start;
+		ret = avformat_seek_file(input, -1, INT64_MIN, ts, ts, 0);
+	}
+	
+	if(ret < 0)
+		return error("Could not seek to %.2fs", (float)start / AV_TIME_BASE);
+	
+	AVPacket packet;
+	while(av_read_frame(input, &packet) == 0)
+	{
+		bool video = packet.stream_index == stream->index && packet.pts != AV_NOPTS_VALUE;
+		bool key = packet.flags & AV_PKT_FLAG_KEY;
+		int64_t time = av_rescale_q((packet.pts - offset) & mask, stream->time_base, AV_TIME_BASE_Q);
+		
+		av_free_packet(&packet);
+		
+		if(!video)
+			continue;
+		
+		if(time > cut + SNAP_MAX_SCAN)
+			break;
+		
+		if(!key)
+			continue;
+		
+		if(time <= cut)
+			frames->before = time;
+		
+		if(time >= cut)
+		{
+			frames->after = time;
+			break;
+		}
+	}
+	
+	return true;
+}
+
+static const char* directionName(const CutPoint& point)
+{
+	return (point.direction == CutPoint::IN) ? "in" : "out";
+}
+
+bool snapToKeyFrames(AVFormatContext* input, CutPointList* list)
+{
+	AVStream* video = 0;
+	
+	for(unsigned int i = 0; i < input->nb_streams; ++i)
+	{
+		if(input->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+		{
+			video = input->streams[i];
+			break;
+		}
+	}
+	
+	if(!video)
+	{
+		printf(" [+] No video stream, cut points stay where they are\n");
+		return true;
+	}
+	
+	CutPointList snapped;
+	
+	for(int i = 0; i < list->size(); ++i)
+	{
+		const CutPoint& cut = (*list)[i];
+		KeyFrames frames;
+		
+		// Widen the window until we see a key frame in front of the cut
+		for(int64_t window = SNAP_WINDOW;; window *= 2)
+		{
+			int64_t start = cut.time - window;
+			if(start < 0)
+				start = 0;
+			
+			if(!probe(input, video, start, cut.time, &frames))
+				return false;
+			
+			if(frames.before != AV_NOPTS_VALUE || start == 0)
+				break;
+		}
+		
+		CutPoint point = cut;
+		
+		if(cut.direction == CutPoint::IN)
+		{
+			if(frames.after == AV_NOPTS_VALUE)
+			{
+				printf(" [+] No key frame behind cut in at %.2fs, dropping it and all later cut points\n",
+					(float)cut.time / AV_TIME_BASE
+				);
+				break;
+			}
+			
+			point.time = frames.after;
+		}
+		else
+		{
+			// Nothing in front of the first key frame can be copied
+			point.time = (frames.before != AV_NOPTS_VALUE) ? frames.before : 0;
+		}
+		
+		printf(" [+] Cut %s at %.2fs moved to %.2fs (%+.2fs)\n",
+			directionName(cut),
+			(float)cut.time / AV_TIME_BASE,
+			(float)point.time / AV_TIME_BASE,
+			(float)(point.time - cut.time) / AV_TIME_BASE
+		);
+		
+		// Segments shorter than a GOP vanish
+		if(point.direction == CutPoint::OUT && !snapped.empty()
+			&& snapped.back().direction == CutPoint::IN
+			&& point.time <= snapped.back().time)
+		{
+			printf("     Segment contains no complete GOP, dropping it\n");
+			snapped.pop_back();
+			continue;
+		}
+		
+		snapped.push_back(point);
+	}
+	
+	*list = snapped;
+	
+	// Hand the input back at its start
+	if(avformat_seek_file(input, -1, 0, 0, 0, AVSEEK_FLAG_BYTE) < 0)
+		return error("Could not seek back to the start of the input");
+	
+	return true;
+}
@@ -0,0 +1,28 @@
+// Moves cut points to video key frames
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#ifndef KEYFRAMESNAP_H
+#define KEYFRAMESNAP_H
+
+#include "cutlist.h"
+
+class AVFormatContext;
+
+/**
+ * @brief Snap a cut list to the key frames of the first video stream
+ *
+ * Every cut in is moved to the next key frame, every cut out back to the
+ * last key frame at or before it, so that the kept segments consist of
+ * whole GOPs and can be copied without re-encoding (see CopyHandler).
+ * Segments shorter than a GOP vanish. The moves are reported on stdout.
+ *
+ * The input is probed around each cut point and repositioned at its
+ * start afterwards, so it needs to be seekable.
+ *
+ * @param input Input context
+ * @param list Cut list (AV_TIME_BASE units), modified in place
+ * @return false on error
+ * */
+bool snapToKeyFrames(AVFormatContext* input, CutPointList* list);
+
+#endif // KEYFRAMESNAP_H
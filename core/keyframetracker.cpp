@@ -0,0 +1,63 @@
+// Learns the key frame interval of a stream
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#include "keyframetracker.h"
+
+extern "C"
+{
+#include <libavutil/avutil.h>
+#include <libavutil/mathematics.h>
+}
+
+// Differences larger than this are gaps in the recording, not GOPs (s)
+const int MAX_INTERVAL = 20;
+
+// Number of intervals to see before trusting them
+const int MIN_INTERVALS = 2;
+
+KeyFrameTracker::KeyFrameTracker(AVRational time_base, int64_t default_interval)
+ : m_defaultInterval(default_interval)
+ , m_lastPTS(AV_NOPTS_VALUE)
+ , m_maxInterval(0)
+ , m_count(0)
+{
+	m_maxGap = av_rescale_q(MAX_INTERVAL, (AVRational){1,1}, time_base);
+}
+
+void KeyFrameTracker::addKeyFrame(int64_t pts)
+{
+	if(pts == AV_NOPTS_VALUE)
+		return;
+	
+	if(m_lastPTS != AV_NOPTS_VALUE)
+	{
+		int64_t diff = pts - m_lastPTS;
+		
+		if(diff > 0 && diff < m_maxGap)
+		{
+			if(diff > m_maxInterval)
+				m_maxInterval = diff;
+			m_count++;
+		}
+	}
+	
+	m_lastPTS = pts;
+}
+
+void KeyFrameTracker::seeked()
+{
+	m_lastPTS = AV_NOPTS_VALUE;
+	m_maxInterval = 0;
+	m_count = 0;
+}
+
+int64_t KeyFrameTracker::interval() const
+{
+	if(m_count < MIN_INTERVALS)
+		return m_defaultInterval;
+	
+	// GOPs may get somewhat longer (e.g. at scene changes). Starting one
+	// GOP too early only costs decoding time, starting too late breaks
+	// the cut.
+	return m_maxInterval + m_maxInterval / 2;
+}
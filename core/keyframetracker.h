@@ -0,0 +1,65 @@
+// Learns the key frame interval of a stream
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#ifndef KEYFRAMETRACKER_H
+#define KEYFRAMETRACKER_H
+
+#include <stdint.h>
+
+extern "C"
+{
+#include <libavutil/rational.h>
+}
+
+/**
+ * @brief Decides where to start decoding in front of a cut point
+ *
+ * Decoding has to start at the last key frame (random access point) in
+ * front of the cut. Since packets are seen in stream order, we cannot
+ * know whether a key frame is the last one before the cut, but we can
+ * predict it from the key frame intervals seen so far. Until enough
+ * intervals have been seen, a fixed default is used.
+ * */
+class KeyFrameTracker
+{
+	public:
+		/**
+		 * @param time_base Time base of all timestamps
+		 * @param default_interval Interval assumed as long as nothing has
+		 *   been learned yet (in @c time_base units)
+		 * */
+		KeyFrameTracker(AVRational time_base, int64_t default_interval);
+		
+		//! Feed the PTS of a key frame
+		void addKeyFrame(int64_t pts);
+		
+		/**
+		 * The input is not contiguous anymore. Everything learned is
+		 * dropped, the default interval applies until enough intervals
+		 * have been seen again.
+		 * */
+		void seeked();
+		
+		/**
+		 * Maximum expected distance between two key frames (including a
+		 * safety margin).
+		 * */
+		int64_t interval() const;
+		
+		/**
+		 * Should decoding start at the key frame @c pts for the cut point
+		 * at @c cut, i.e. is there probably no other key frame in between?
+		 * Key frames behind the cut point never qualify, the caller has
+		 * missed the right one then.
+		 * */
+		inline bool decodeStart(int64_t pts, int64_t cut) const
+		{ return pts <= cut && cut - pts < interval(); }
+	private:
+		int64_t m_defaultInterval;
+		int64_t m_maxGap;
+		int64_t m_lastPTS;
+		int64_t m_maxInterval;
+		int m_count;
+};
+
+#endif // KEYFRAMETRACKER_H
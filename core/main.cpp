@@ -14,9 +14,13 @@ extern "C"
 #include <queue>
 #include <unistd.h>
 
-#include "streamhandler.h"
 #include "cutlist.h"
-#include "io_split.h"
+#include "cutter.h"
+#include "segments.h"
+#include "keyframesnap.h"
+
+#include <common/indexfile.h>
+#include <common/io_file.h>
 
 #if 0
 #define LOG_DEBUG printf
@@ -26,17 +30,55 @@ inline void LOG_DEBUG(const char*, ...)
 }
 #endif
 
-typedef std::map<int, StreamHandler*> StreamMap;
-
 void usage(FILE* dest)
 {
 	fprintf(dest, "Usage: justcutit [options] <file> <cutlist> <output-file>\n"
+		"                 [<cutlist> <output-file> ...]\n"
+		"\n"
+		"Any number of cutlist/output pairs can be given, the input is read\n"
+		"once. Additional outputs are only opened while they are being cut,\n"
+		"stream decoding is shared between them.\n"
+		"An output-file of \"-\" writes to standard output, \"pipe:N\" to file\n"
+		"descriptor N. Protocol URLs like \"udp://...\" are passed to libavformat.\n"
 		"\n"
 		"Options:\n"
 		"  -s, --size COUNT  Split output files after COUNT MiB. output-file\n"
 		"                    needs to be a template like \"output_%%d.ts\"\n"
+		"  --follow          The input is still being recorded, wait for new\n"
+		"                    data at its end. Implied for input \"-\" (stdin)\n"
+		"  --minimal-reencode  MPEG-2: Only re-encode the frames around a cut\n"
+		"                    that reference removed material\n"
+		"  --codec-threads N Use N threads in each MPEG-2 decoder/encoder and\n"
+		"                    in each H.264 encoder (frame threading)\n"
+		"  --h264-preset P   x264 preset for re-encoded H.264 frames, trading\n"
+		"                    speed for quality (default: ultrafast)\n"
+		"  --preopen-encoders  Open the encoder for the next cut in a background\n"
+		"                    thread while the stream is copied\n"
+		"  --boundary-jobs N Re-encode the cut points of each video stream on up\n"
+		"                    to N background threads while copying continues\n"
+		"  --repeat-headers  H.264: Repeat the parameter sets in front of each\n"
+		"                    copied keyframe (useful with --split-keyframes)\n"
+		"  --snap-keyframes  Move each cut in to the next video keyframe and each\n"
+		"                    cut out back to the previous one, then copy\n"
+		"                    without decoding anything\n"
+		"  --split-keyframes Only split right before video keyframes, so that\n"
+		"                    each part is playable on its own\n"
+		"  --split-duration SECS  Split output files after SECS seconds (at\n"
+		"                    video keyframes, see --split-keyframes)\n"
+		"  --mem-stats       Report the peak buffer usage and allocations per\n"
+		"                    packet of each stream handler\n"
 		"  -v, --verbose     Provide progress info more often\""
 		"  -a, --audio TYPE  Take audio stream of type TYPE (ffmpeg decoder name)\n"
+		"  --audio-frame-cuts  Cut audio at the frame boundary closest to each\n"
+		"                    cut point instead of re-encoding a frame\n"
+		"  -j, --jobs N      Cut the kept segments in parallel using N threads\n"
+		"  --no-skip         Demux cut out regions instead of seeking over them\n"
+		"  --index FILE      Use index file FILE for seeking\n"
+		"  --index-fmt FMT   Format of the index file (FMT=help for a list)\n"
+		"  --pipeline        Run demuxing, each stream and muxing on separate\n"
+		"                    threads (disables seeking over cut outs)\n"
+		"  --passthrough     Copy unchanged regions as raw TS packets instead\n"
+		"                    of remuxing them (not with --pipeline)\n"
 	);
 }
 
@@ -81,93 +123,25 @@ bool readCutlist(FILE* file, CutPointList* dest)
 	return true;
 }
 
-bool setupHandlers(AVFormatContext* input, AVFormatContext* output,
-	const CutPointList& cutlist, StreamMap* map, const char* audio_decoder = 0)
-{
-	StreamHandlerFactory factory;
-	
-	for(int i = 0; i < input->nb_programs; ++i)
-	{
-		AVProgram* program = input->programs[i];
-		
-		// Skip empty programs
-		if(program->nb_stream_indexes == 0)
-			continue;
-		
-		AVProgram* oprogram = av_new_program(output, program->id);
-		
-		for(int j = 0; j < program->nb_stream_indexes; ++j)
-		{
-			AVStream* istream = input->streams[program->stream_index[j]];
-			
-			if(istream->codec->codec_type == AVMEDIA_TYPE_AUDIO && audio_decoder)
-			{
-				AVCodec* codec = avcodec_find_decoder(istream->codec->codec_id);
-				if(!codec || strcmp(codec->name, audio_decoder) != 0)
-				{
-					istream->discard = AVDISCARD_ALL;
-					continue;
-				}
-			}
-			
-			StreamHandler* handler = factory.createHandlerForStream(istream);
-			
-			if(!handler)
-			{
-				printf("Stream %d is unhandled.\n", istream->index);
-				istream->discard = AVDISCARD_ALL;
-				continue;
-			}
-			
-			AVStream* ostream = avformat_new_stream(output, 0);
-			ostream->id = istream->id;
-			
-			// Register with program
-			oprogram->nb_stream_indexes++;
-			oprogram->stream_index = (unsigned int*)av_realloc(
-				oprogram->stream_index, oprogram->nb_stream_indexes * sizeof(*oprogram->stream_index)
-			);
-			oprogram->stream_index[oprogram->nb_stream_indexes-1] = ostream->index;
-			
-			// Setup stream handler
-			handler->setCutList(cutlist);
-			handler->setOutputContext(output);
-			handler->setOutputStream(ostream);
-			handler->setStartPTS_AV(input->start_time);
-			
-			if(handler->init() != 0)
-			{
-				fprintf(stderr, "Error: Could not initialize stream handler for stream %d\n",
-					istream->index
-				);
-				return false;
-			}
-			
-			if(ostream->codec->codec)
-			{
-				printf("Using encoder '%s' for output of stream %d\n",
-					   ostream->codec->codec->name, istream->index
-				);
-			}
-			
-			(*map)[istream->index] = handler;
-		}
-	}
-	
-	return true;
-}
-
 int main(int argc, char** argv)
 {
 	AVFormatContext* ctx = 0;
-	AVFormatContext* output_ctx = 0;
-	CutPointList cutlist;
-	StreamMap stream_mapping;
-	int64_t duration;
-	int last_percent_done = 0;
+	std::vector<CutPointList> cutlists;
+	std::vector<AVFormatContext*> outputs;
 	uint64_t split_size = 0;
+	bool split_keyframes = false;
+	int64_t split_duration = 0;
 	bool verbose = false;
 	const char* audio_decoder = 0;
+	int jobs = 1;
+	bool skip = true;
+	bool pipeline = false;
+	bool passthrough = false;
+	bool follow = false;
+	HandlerOptions handler_options;
+	const char* indexFile = 0;
+	const char* indexFormat = 0;
+	IndexFile* index = 0;
 	int exit_code = 0;
 	
 	av_register_all();
@@ -179,11 +153,29 @@ int main(int argc, char** argv)
 			{"split", required_argument, 0, 's'},
 			{"verbose", no_argument, 0, 'v'},
 			{"help", no_argument, 0, 'h'},
-			{"audio", no_argument, 0, 'a'},
+			{"audio", required_argument, 0, 'a'},
+			{"audio-frame-cuts", no_argument, 0, 'A'},
+			{"jobs", required_argument, 0, 'j'},
+			{"no-skip", no_argument, 0, 'S'},
+			{"index", required_argument, 0, 'i'},
+			{"index-fmt", required_argument, 0, 'f'},
+			{"pipeline", no_argument, 0, 'p'},
+			{"passthrough", no_argument, 0, 'P'},
+			{"follow", no_argument, 0, 'F'},
+			{"minimal-reencode", no_argument, 0, 'M'},
+			{"codec-threads", required_argument, 0, 'T'},
+			{"repeat-headers", no_argument, 0, 'R'},
+			{"h264-preset", required_argument, 0, 'H'},
+			{"preopen-encoders", no_argument, 0, 'O'},
+			{"boundary-jobs", required_argument, 0, 'B'},
+			{"snap-keyframes", no_argument, 0, 'G'},
+			{"split-keyframes", no_argument, 0, 'K'},
+			{"split-duration", required_argument, 0, 'D'},
+			{"mem-stats", no_argument, 0, 'X'},
 			{0, 0, 0, 0}
 		};
 		
-		int c = getopt_long(argc, argv, "hs:a:v", long_options, &option_index);
+		int c = getopt_long(argc, argv, "hs:a:vj:", long_options, &option_index);
 		
 		if(c == -1)
 			break;
@@ -202,142 +194,328 @@ int main(int argc, char** argv)
 			case 'a':
 				audio_decoder = optarg;
 				break;
+			case 'A':
+				handler_options.audioFrameCuts = true;
+				break;
+			case 'j':
+				jobs = atoi(optarg);
+				if(jobs < 1)
+				{
+					usage(stderr);
+					return 1;
+				}
+				break;
+			case 'p':
+				pipeline = true;
+				break;
+			case 'P':
+				passthrough = true;
+				break;
+			case 'S':
+				skip = false;
+				break;
+			case 'F':
+				follow = true;
+				break;
+			case 'M':
+				handler_options.minimalReencode = true;
+				break;
+			case 'T':
+				handler_options.codecThreads = atoi(optarg);
+				if(handler_options.codecThreads < 1)
+				{
+					usage(stderr);
+					return 1;
+				}
+				break;
+			case 'R':
+				handler_options.repeatParameterSets = true;
+				break;
+			case 'H':
+				handler_options.h264Preset = optarg;
+				break;
+			case 'O':
+				handler_options.preopenEncoders = true;
+				break;
+			case 'B':
+				handler_options.boundaryJobs = atoi(optarg);
+				if(handler_options.boundaryJobs < 1)
+				{
+					usage(stderr);
+					return 1;
+				}
+				break;
+			case 'G':
+				handler_options.snapKeyframes = true;
+				break;
+			case 'K':
+				split_keyframes = true;
+				break;
+			case 'D':
+				split_duration = (int64_t)(atof(optarg) * AV_TIME_BASE);
+				if(split_duration <= 0)
+				{
+					usage(stderr);
+					return 1;
+				}
+				split_keyframes = true;
+				break;
+			case 'X':
+				handler_options.memStats = true;
+				break;
+			case 'i':
+				indexFile = optarg;
+				break;
+			case 'f':
+				if(strcmp(optarg, "help") == 0)
+				{
+					printf("Supported index file formats:\n");
+					for(int i = 0; i < IndexFileFactory::formatCount(); ++i)
+						printf(" - %s\n", IndexFileFactory::formatName(i));
+					return 0;
+				}
+				
+				indexFormat = optarg;
+				break;
 			default:
 				usage(stderr);
 				return 1;
 		}
 	}
 	
-	if(argc - optind != 3)
+	if((indexFormat || indexFile) && (!indexFormat || !indexFile))
 	{
-		usage(stderr);
+		fprintf(stderr, "Error: need both --index and --index-fmt\n");
 		return 1;
 	}
 	
-	
-	
-	
-	printf("Opening file '%s'\n", argv[optind]);
-	int ret = avformat_open_input(&ctx, argv[optind], NULL, NULL);
-	if(ret != 0)
+	if(split_keyframes && !split_size && !split_duration)
 	{
-		fprintf(stderr, "Fatal: Could not open input stream (ret=%d => %s)\n", ret, strerror(-ret));
+		fprintf(stderr, "Error: --split-keyframes needs --size or --split-duration\n");
 		return 1;
 	}
 	
-	if(avformat_find_stream_info(ctx, 0) < 0)
+	// <file> followed by pairs of <cutlist> <output-file>
+	if(argc - optind < 3 || (argc - optind) % 2 != 1)
 	{
-		fprintf(stderr, "Fatal: Could not find stream information\n");
+		usage(stderr);
 		return 1;
 	}
 	
-	printf(" [+] Input file duration: %.2f\n", (float)ctx->duration / AV_TIME_BASE);
-	av_dump_format(ctx, 0, argv[optind], false);
-	
-	printf("Reading cutlist\n");
-	FILE* cutlist_file = fopen(argv[optind+1], "r");
-	if(!cutlist_file)
-	{
-		perror("Could not open cutlist");
-		return 1;
-	}
+	const char* input_file = argv[optind];
+	int output_count = (argc - optind - 1) / 2;
 	
-	if(!readCutlist(cutlist_file, &cutlist))
+	if(strcmp(input_file, "-") == 0)
 	{
-		fprintf(stderr, "Fatal: Could not read cutlist\n");
-		return 1;
+		input_file = "pipe:0";
+		follow = true;
 	}
 	
-	fclose(cutlist_file);
-	
-	if(!cutlist.size())
+	if(follow)
 	{
-		fprintf(stderr, "Cutlist contains no cutpoints. Nothing to do!\n");
-		return 2;
+		// Everything that reads ahead of the demuxer or seeks would run
+		// into data that does not exist yet.
+		if(jobs > 1 || passthrough || indexFile)
+			fprintf(stderr, "Warning: --jobs, --passthrough and --index are ignored with --follow\n");
+		
+		if(handler_options.snapKeyframes)
+			fprintf(stderr, "Warning: --snap-keyframes only moves video cuts with --follow\n");
+		
+		jobs = 1;
+		passthrough = false;
+		skip = false;
 	}
 	
-	printf("Opening output file\n");
-	if(avformat_alloc_output_context2(&output_ctx, 0, "mpegts", argv[3]) != 0)
+	if(jobs > 1 && output_count > 1)
 	{
-		fprintf(stderr, "Could not allocate output context\n");
+		fprintf(stderr, "Error: --jobs supports only a single output\n");
 		return 1;
 	}
-	if(split_size == 0)
+	
+	// The TS stream goes to the original standard output, everything we
+	// print ends up on stderr.
+	char stdout_name[32];
+	bool stdout_used = false;
+	for(int i = 0; i < output_count; ++i)
 	{
-		if(avio_open(&output_ctx->pb, argv[optind+2], AVIO_FLAG_WRITE) != 0)
+		char** name = &argv[optind + 2 + 2*i];
+		
+		if(strcmp(*name, "-") != 0 && strcmp(*name, "pipe:1") != 0)
+			continue;
+		
+		if(stdout_used)
 		{
-			fprintf(stderr, "Could not open output file\n");
+			fprintf(stderr, "Error: Only one output can be written to standard output\n");
 			return 1;
 		}
-	}
-	else
-	{
-		output_ctx->pb = io_split_create(argv[optind+2], split_size);
-		if(!output_ctx->pb)
+		
+		int fd = dup(STDOUT_FILENO);
+		if(fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
 		{
-			fprintf(stderr, "Could not open output file\n");
+			perror("Could not redirect standard output");
 			return 1;
 		}
+		
+		snprintf(stdout_name, sizeof(stdout_name), "pipe:%d", fd);
+		*name = stdout_name;
+		stdout_used = true;
 	}
 	
-	output_ctx->oformat->flags |= AVFMT_TS_NONSTRICT;
+	if(jobs > 1 && (strncmp(argv[optind+2], "pipe:", 5) == 0 || strstr(argv[optind+2], "://")))
+	{
+		fprintf(stderr, "Error: --jobs needs a real output file\n");
+		return 1;
+	}
 	
-	if(!setupHandlers(ctx, output_ctx, cutlist, &stream_mapping, audio_decoder))
+	printf("Opening file '%s'\n", input_file);
+	int ret = io_file_open_input(&ctx, input_file,
+		IO_FILE_SEQUENTIAL | (follow ? IO_FILE_FOLLOW : 0));
+	if(ret != 0)
+	{
+		fprintf(stderr, "Fatal: Could not open input stream (ret=%d => %s)\n", ret, strerror(-ret));
 		return 1;
+	}
 	
-	printf(" [+] Output streams:\n");
-	av_dump_format(output_ctx, 0, argv[optind+2], true);
+	if(avformat_find_stream_info(ctx, 0) < 0)
+	{
+		fprintf(stderr, "Fatal: Could not find stream information\n");
+		return 1;
+	}
 	
-	avformat_write_header(output_ctx, 0);
+	printf(" [+] Input file duration: %.2f\n", (float)ctx->duration / AV_TIME_BASE);
+	av_dump_format(ctx, 0, input_file, false);
 	
-	AVPacket packet;
-	while(av_read_frame(ctx, &packet) == 0)
+	for(int i = 0; i < output_count; ++i)
 	{
-		StreamMap::iterator it = stream_mapping.find(packet.stream_index);
-		if(it == stream_mapping.end())
-			continue;
+		const char* cutlist_name = argv[optind + 1 + 2*i];
+		CutPointList cutlist;
 		
-		AVStream* stream = ctx->streams[packet.stream_index];
-		int percent = av_rescale(packet.dts - stream->start_time, 100, stream->duration);
+		printf("Reading cutlist '%s'\n", cutlist_name);
+		FILE* cutlist_file = fopen(cutlist_name, "r");
+		if(!cutlist_file)
+		{
+			perror("Could not open cutlist");
+			return 1;
+		}
+		
+		if(!readCutlist(cutlist_file, &cutlist))
+		{
+			fprintf(stderr, "Fatal: Could not read cutlist\n");
+			return 1;
+		}
 		
-		int granularity = verbose ? 1 : 10;
+		fclose(cutlist_file);
 		
-		if(percent / granularity != last_percent_done / 10 && percent > last_percent_done)
+		// Probing the key frames needs to seek, when following we can only
+		// rely on the video handlers switching at key frames.
+		if(handler_options.snapKeyframes && !follow)
 		{
-			printf("%02d%% done (approximation)\n", percent);
-			if(verbose)
-				fflush(stdout);
-			
-			last_percent_done = percent;
+			if(!snapToKeyFrames(ctx, &cutlist))
+			{
+				fprintf(stderr, "Fatal: Could not snap cutlist to keyframes\n");
+				return 1;
+			}
 		}
 		
-		if(it->second->handlePacket(&packet) != 0)
+		if(!cutlist.size())
 		{
-			av_free_packet(&packet);
-			exit_code = 2;
-			break;
+			fprintf(stderr, "Cutlist '%s' contains no cutpoints. Nothing to do!\n", cutlist_name);
+			return 2;
 		}
 		
-		av_free_packet(&packet);
+		cutlists.push_back(cutlist);
+	}
+	
+	for(int i = 0; i < output_count; ++i)
+	{
+		const char* output_file = argv[optind + 2 + 2*i];
+		
+		// With several outputs, Cutter::run() opens the files when needed
+		bool deferred = (output_count > 1);
+		
+		if(!deferred)
+			printf("Opening output file '%s'\n", output_file);
+		
+		AVFormatContext* output_ctx = openOutput(output_file, split_size,
+			split_keyframes, split_duration, deferred);
+		if(!output_ctx)
+			return 1;
+		
+		outputs.push_back(output_ctx);
+	}
+	
+	if(jobs > 1)
+	{
+		if(pipeline)
+			fprintf(stderr, "Warning: --pipeline has no effect in --jobs mode\n");
+		
+		exit_code = cutSegments(input_file, cutlists[0], outputs[0],
+			argv[optind+2], jobs, audio_decoder, handler_options);
+		
+		if(closeOutput(outputs[0]) != 0 && exit_code == 0)
+			exit_code = 1;
+		
+		return exit_code;
+	}
+	
+	// Seeking needs all stream handlers in sync with the demuxer
+	if(pipeline)
+		skip = false;
+	
+	if(skip)
+	{
+		IndexFileFactory factory;
 		
-		bool allFinished = true;
-		for(StreamMap::const_iterator it = stream_mapping.begin();
-			it != stream_mapping.end(); ++it)
+		if(indexFile)
 		{
-			if(it->second->active())
-				allFinished = false;
+			index = factory.openWith(indexFormat, indexFile, ctx, input_file);
+			if(!index)
+			{
+				fprintf(stderr, "Could not open index file\n");
+				return 1;
+			}
 		}
-		if(allFinished)
-			break;
+		else
+			index = factory.detectIndexFile(ctx, input_file);
+		
+		if(index)
+			printf(" [+] Using index file for seeking\n");
 	}
 	
-	av_write_trailer(output_ctx);
+	Cutter cutter(ctx, cutlists[0]);
+	cutter.setAudioDecoder(audio_decoder);
+	cutter.setHandlerOptions(handler_options);
+	// The duration is not known yet when following
+	cutter.setProgress(!follow, verbose);
+	cutter.setSkipCutouts(skip, index);
+	cutter.setPipelined(pipeline);
+	cutter.setPassthrough(passthrough);
+	
+	if(!cutter.setupHandlers(outputs[0]))
+		return 1;
 	
-	if(split_size == 0)
-		avio_close(output_ctx->pb);
-	else
-		io_split_close(output_ctx->pb);
-	avformat_free_context(output_ctx);
+	for(int i = 1; i < output_count; ++i)
+	{
+		if(!cutter.addOutput(cutlists[i], outputs[i]))
+			return 1;
+	}
+	
+	for(int i = 0; i < output_count; ++i)
+	{
+		printf(" [+] Output streams:\n");
+		av_dump_format(outputs[i], 0, argv[optind + 2 + 2*i], true);
+	}
+	
+	exit_code = cutter.run();
+	
+	if(verbose)
+		io_file_print_stats(ctx, stdout);
+	
+	for(int i = 0; i < output_count; ++i)
+	{
+		if(closeOutput(outputs[i]) != 0 && exit_code == 0)
+			exit_code = 1;
+	}
 	
 	return exit_code;
 }
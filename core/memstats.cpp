@@ -0,0 +1,37 @@
+// Allocation accounting
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#include "memstats.h"
+
+MemStats::MemStats()
+ : m_current(0)
+ , m_peak(0)
+ , m_allocations(0)
+ , m_packets(0)
+{
+}
+
+void MemStats::allocated(int64_t bytes)
+{
+	int64_t current = __sync_add_and_fetch(&m_current, bytes);
+	__sync_add_and_fetch(&m_allocations, 1);
+	
+	int64_t peak = m_peak;
+	while(current > peak)
+	{
+		int64_t seen = __sync_val_compare_and_swap(&m_peak, peak, current);
+		if(seen == peak)
+			break;
+		peak = seen;
+	}
+}
+
+void MemStats::freed(int64_t bytes)
+{
+	__sync_sub_and_fetch(&m_current, bytes);
+}
+
+void MemStats::packetHandled()
+{
+	__sync_add_and_fetch(&m_packets, 1);
+}
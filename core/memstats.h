@@ -0,0 +1,50 @@
+// Allocation accounting
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#ifndef MEMSTATS_H
+#define MEMSTATS_H
+
+#include <stdint.h>
+
+/**
+ * @brief Counts the buffers of one stream handler
+ *
+ * Covers what the handlers allocate themselves: sample buffers, encoder
+ * output buffers (see BufferPool) and buffered packets. Buffers may be
+ * freed from other threads (muxer thread, jobs), so all counters are
+ * updated atomically.
+ * */
+class MemStats
+{
+	public:
+		MemStats();
+		
+		//! A buffer of @c bytes was allocated (or taken over)
+		void allocated(int64_t bytes);
+		
+		//! A buffer of @c bytes was freed (or handed on)
+		void freed(int64_t bytes);
+		
+		//! An input packet was handed to the handler
+		void packetHandled();
+		
+		inline int64_t current() const
+		{ return m_current; }
+		
+		//! Highest value of current() so far
+		inline int64_t peak() const
+		{ return m_peak; }
+		
+		inline int64_t allocations() const
+		{ return m_allocations; }
+		
+		inline int64_t packets() const
+		{ return m_packets; }
+	private:
+		volatile int64_t m_current;
+		volatile int64_t m_peak;
+		volatile int64_t m_allocations;
+		volatile int64_t m_packets;
+};
+
+#endif // MEMSTATS_H
@@ -0,0 +1,245 @@
+// MPEG-TS packet helpers
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#ifndef MPEGTS_H
+#define MPEGTS_H
+
+#include <stdint.h>
+#include <vector>
+
+const int TS_PACKET_SIZE = 188;
+const int TS_SYNC_BYTE = 0x47;
+const int TS_MAX_PID = 0x1FFF;
+
+//! Mask for 33 bit PTS/DTS/PCR base values
+const int64_t TS_TIMESTAMP_MASK = 0x1FFFFFFFFLL;
+
+inline int ts_pid(const uint8_t* pkt)
+{ return ((pkt[1] & 0x1F) << 8) | pkt[2]; }
+
+//! Payload unit start indicator
+inline bool ts_pusi(const uint8_t* pkt)
+{ return pkt[1] & 0x40; }
+
+inline bool ts_has_payload(const uint8_t* pkt)
+{ return pkt[3] & 0x10; }
+
+inline bool ts_has_adaptation(const uint8_t* pkt)
+{ return pkt[3] & 0x20; }
+
+//! Random access indicator in the adaptation field
+inline bool ts_random_access(const uint8_t* pkt)
+{ return ts_has_adaptation(pkt) && pkt[4] > 0 && (pkt[5] & 0x40); }
+
+/**
+ * Offset of the payload in the packet
+ *
+ * @return offset or -1 if there is no payload
+ * */
+inline int ts_payload_offset(const uint8_t* pkt)
+{
+	int off = 4;
+	
+	if(ts_has_adaptation(pkt))
+		off += 1 + pkt[4];
+	
+	if(!ts_has_payload(pkt) || off >= TS_PACKET_SIZE)
+		return -1;
+	
+	return off;
+}
+
+//! Read a 33 bit PES timestamp
+inline int64_t ts_read_timestamp(const uint8_t* p)
+{
+	return ((int64_t)((p[0] >> 1) & 0x07) << 30)
+		| (p[1] << 22)
+		| ((p[2] >> 1) << 15)
+		| (p[3] << 7)
+		| (p[4] >> 1);
+}
+
+//! Write a 33 bit PES timestamp, keeping the prefix bits
+inline void ts_write_timestamp(uint8_t* p, int64_t ts)
+{
+	p[0] = (p[0] & 0xF1) | ((ts >> 29) & 0x0E);
+	p[1] = ts >> 22;
+	p[2] = ((ts >> 14) & 0xFE) | 0x01;
+	p[3] = ts >> 7;
+	p[4] = ((ts << 1) & 0xFE) | 0x01;
+}
+
+/**
+ * Locate the PES timestamps in a packet with payload unit start
+ * indicator set.
+ *
+ * @param pts Set to the PTS field (NULL if not present)
+ * @param dts Set to the DTS field (NULL if not present)
+ * @return false if the payload does not start with a PES header
+ * */
+inline bool ts_pes_timestamps(uint8_t* pkt, uint8_t** pts, uint8_t** dts)
+{
+	int off = ts_payload_offset(pkt);
+	
+	*pts = 0;
+	*dts = 0;
+	
+	if(off < 0 || off + 19 > TS_PACKET_SIZE)
+		return false;
+	
+	uint8_t* p = pkt + off;
+	
+	if(p[0] != 0 || p[1] != 0 || p[2] != 1)
+		return false;
+	
+	// Streams without the optional PES header (padding, private_2 etc.)
+	if(p[3] == 0xBC || p[3] == 0xBE || p[3] == 0xBF)
+		return true;
+	
+	int flags = p[7] >> 6;
+	
+	if(flags & 0x02)
+		*pts = p + 9;
+	if(flags == 0x03)
+		*dts = p + 14;
+	
+	return true;
+}
+
+//! PCR field in the adaptation field (NULL if not present)
+inline uint8_t* ts_pcr(uint8_t* pkt)
+{
+	if(!ts_has_adaptation(pkt) || pkt[4] < 7 || !(pkt[5] & 0x10))
+		return 0;
+	
+	return pkt + 6;
+}
+
+//! Read the 33 bit PCR base (90kHz)
+inline int64_t ts_read_pcr_base(const uint8_t* p)
+{
+	return ((int64_t)p[0] << 25)
+		| (p[1] << 17)
+		| (p[2] << 9)
+		| (p[3] << 1)
+		| (p[4] >> 7);
+}
+
+//! Write the 33 bit PCR base, keeping the extension
+inline void ts_write_pcr_base(uint8_t* p, int64_t base)
+{
+	p[0] = base >> 25;
+	p[1] = base >> 17;
+	p[2] = base >> 9;
+	p[3] = base >> 1;
+	p[4] = ((base & 0x01) << 7) | (p[4] & 0x7F);
+}
+
+/**
+ * Start of a PSI section that begins in this packet
+ *
+ * @param length Set to the section length (including header and CRC)
+ * @return NULL if there is no complete section in this packet
+ * */
+inline const uint8_t* ts_section(const uint8_t* pkt, int* length)
+{
+	if(!ts_pusi(pkt))
+		return 0;
+	
+	int off = ts_payload_offset(pkt);
+	if(off < 0)
+		return 0;
+	
+	off += 1 + pkt[off]; // pointer_field
+	if(off + 3 > TS_PACKET_SIZE)
+		return 0;
+	
+	const uint8_t* s = pkt + off;
+	*length = 3 + (((s[1] & 0x0F) << 8) | s[2]);
+	
+	if(off + *length > TS_PACKET_SIZE || *length < 12)
+		return 0;
+	
+	return s;
+}
+
+/**
+ * Find the PMT PID of a program in a PAT packet
+ *
+ * @param program Program number, -1 for the first program
+ * @return PMT PID or -1
+ * */
+inline int ts_pat_pmt_pid(const uint8_t* pkt, int program)
+{
+	int len;
+	const uint8_t* s = ts_section(pkt, &len);
+	
+	if(!s || s[0] != 0x00)
+		return -1;
+	
+	for(int i = 8; i + 4 <= len - 4; i += 4)
+	{
+		int number = (s[i] << 8) | s[i+1];
+		int pid = ((s[i+2] & 0x1F) << 8) | s[i+3];
+		
+		// Program 0 is the network PID
+		if(number == 0)
+			continue;
+		
+		if(program < 0 || number == program)
+			return pid;
+	}
+	
+	return -1;
+}
+
+//! Is @c type a PMT stream type of a video stream?
+inline bool ts_video_stream_type(int type)
+{
+	switch(type)
+	{
+		case 0x01: // MPEG-1
+		case 0x02: // MPEG-2
+		case 0x10: // MPEG-4 part 2
+		case 0x1B: // H.264
+		case 0x24: // HEVC
+			return true;
+		default:
+			return false;
+	}
+}
+
+/**
+ * Parse a PMT packet
+ *
+ * @param pcr_pid Set to the PCR PID
+ * @param pids Elementary stream PIDs are appended here (may be NULL)
+ * @param types Stream types of the PIDs are appended here (may be NULL)
+ * @return false if this is not a PMT
+ * */
+inline bool ts_parse_pmt(const uint8_t* pkt, int* pcr_pid, std::vector<int>* pids,
+	std::vector<int>* types = 0)
+{
+	int len;
+	const uint8_t* s = ts_section(pkt, &len);
+	
+	if(!s || s[0] != 0x02)
+		return false;
+	
+	*pcr_pid = ((s[8] & 0x1F) << 8) | s[9];
+	
+	int i = 12 + (((s[10] & 0x0F) << 8) | s[11]);
+	while(i + 5 <= len - 4)
+	{
+		if(pids)
+			pids->push_back(((s[i+1] & 0x1F) << 8) | s[i+2]);
+		if(types)
+			types->push_back(s[i]);
+		
+		i += 5 + (((s[i+3] & 0x0F) << 8) | s[i+4]);
+	}
+	
+	return true;
+}
+
+#endif // MPEGTS_H
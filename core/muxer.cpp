@@ -0,0 +1,237 @@
+// Output muxing
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#include "muxer.h"
+#include "tsoutput.h"
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+#define DEBUG 0
+#define LOG_PREFIX "[muxer]"
+#include <common/log.h>
+
+Muxer::Muxer(AVFormatContext* ctx)
+ : m_ctx(ctx)
+ , m_split(0)
+ , m_splitStream(-1)
+{
+	pthread_mutex_init(&m_codecMutex, 0);
+}
+
+Muxer::~Muxer()
+{
+	pthread_mutex_destroy(&m_codecMutex);
+}
+
+void Muxer::lockCodecs()
+{
+	pthread_mutex_lock(&m_codecMutex);
+}
+
+void Muxer::unlockCodecs()
+{
+	pthread_mutex_unlock(&m_codecMutex);
+}
+
+int Muxer::start()
+{
+	TSOutput* ts = TSOutput::fromContext(m_ctx->pb);
+	
+	if(!ts->splitting())
+		return 0;
+	
+	for(int i = 0; i < m_ctx->nb_streams; ++i)
+	{
+		if(m_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+		{
+			m_splitStream = i;
+			break;
+		}
+	}
+	
+	if(m_splitStream < 0)
+		return error("Keyframe aligned splitting needs a video stream");
+	
+	m_split = ts;
+	
+	return 0;
+}
+
+int Muxer::writePacket(AVPacket* packet)
+{
+	return writeFrame(packet);
+}
+
+int Muxer::writeFrame(AVPacket* packet)
+{
+	// The PES packet of this frame is written out later, after
+	// interleaving. TSOutput splits when it gets there.
+	bool announced = m_split && packet && packet->stream_index == m_splitStream;
+	if(announced)
+	{
+		int64_t time = AV_NOPTS_VALUE;
+		
+		if((packet->flags & AV_PKT_FLAG_KEY) && packet->pts != AV_NOPTS_VALUE)
+		{
+			AVStream* stream = m_ctx->streams[m_splitStream];
+			time = av_rescale_q(packet->pts, stream->time_base, AV_TIME_BASE_Q);
+		}
+		
+		m_split->queueVideoFrame(time);
+	}
+	
+	lockCodecs();
+	int ret = av_interleaved_write_frame(m_ctx, packet);
+	unlockCodecs();
+	
+	// Refused packets (invalid timestamps) are not queued for
+	// interleaving, other errors end the output anyway
+	if(ret != 0 && announced)
+		m_split->unqueueVideoFrame();
+	
+	return ret;
+}
+
+int Muxer::flush()
+{
+	lockCodecs();
+	int ret = av_interleaved_write_frame(m_ctx, NULL);
+	unlockCodecs();
+	
+	if(ret != 0)
+		return -1;
+	
+	avio_flush(m_ctx->pb);
+	
+	return 0;
+}
+
+int Muxer::finish()
+{
+	return 0;
+}
+
+// ThreadedMuxer
+
+ThreadedMuxer::ThreadedMuxer(AVFormatContext* ctx, unsigned int queue_size)
+ : Muxer(ctx)
+ , m_queueSize(queue_size)
+ , m_running(false)
+ , m_finish(false)
+ , m_error(0)
+{
+}
+
+ThreadedMuxer::~ThreadedMuxer()
+{
+	if(m_running)
+		finish();
+	
+	for(int i = 0; i < m_queues.size(); ++i)
+		delete m_queues[i];
+}
+
+int ThreadedMuxer::start()
+{
+	for(int i = 0; i < context()->nb_streams; ++i)
+		m_queues.push_back(new PacketQueue(m_queueSize));
+	
+	if(pthread_create(&m_thread, 0, &ThreadedMuxer::writerThread, this) != 0)
+		return error("Could not create writer thread");
+	
+	m_running = true;
+	
+	return 0;
+}
+
+int ThreadedMuxer::writePacket(AVPacket* packet)
+{
+	if(!m_running)
+		return Muxer::writePacket(packet);
+	
+	if(m_error)
+		return m_error;
+	
+	// Same semantics as av_interleaved_write_frame(): take over the
+	// packet data if possible, copy it otherwise.
+	AVPacket queued = *packet;
+	packet->destruct = NULL;
+	
+	if(av_dup_packet(&queued) < 0)
+		return error("Could not duplicate packet");
+	
+	m_queues[queued.stream_index]->push(queued);
+	
+	return 0;
+}
+
+void* ThreadedMuxer::writerThread(void* arg)
+{
+	((ThreadedMuxer*)arg)->writeLoop();
+	return 0;
+}
+
+void ThreadedMuxer::writeLoop()
+{
+	int count = 0;
+	
+	while(1)
+	{
+		bool finish = m_finish;
+		bool written = false;
+		
+		for(int i = 0; i < m_queues.size(); ++i)
+		{
+			AVPacket packet;
+			
+			// Take a few packets from each queue. libavformat does the
+			// actual interleaving by DTS.
+			for(int j = 0; j < 16 && m_queues[i]->tryPop(&packet); ++j)
+			{
+				if(!m_error && writeFrame(&packet) != 0)
+				{
+					error("Could not write packet for stream %d", i);
+					m_error = -1;
+				}
+				
+				av_free_packet(&packet);
+				written = true;
+			}
+		}
+		
+		if(written)
+		{
+			count = 0;
+			continue;
+		}
+		
+		// All producers are done and the queues are drained
+		if(finish)
+			break;
+		
+		spsc_backoff(&count);
+	}
+}
+
+int ThreadedMuxer::flush()
+{
+	// Would need to synchronize with the producers
+	return -1;
+}
+
+int ThreadedMuxer::finish()
+{
+	if(!m_running)
+		return m_error;
+	
+	__sync_synchronize();
+	m_finish = true;
+	
+	pthread_join(m_thread, 0);
+	m_running = false;
+	
+	return m_error;
+}
@@ -0,0 +1,127 @@
+// Output muxing
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#ifndef MUXER_H
+#define MUXER_H
+
+#include <vector>
+#include <pthread.h>
+
+#include "spscqueue.h"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+class AVFormatContext;
+class TSOutput;
+
+/**
+ * @brief Output packet sink
+ *
+ * All output packets of the stream handlers go through a Muxer. The
+ * default implementation writes them directly with
+ * av_interleaved_write_frame().
+ *
+ * If the output was opened with keyframe aligned splitting (see
+ * TSOutput::setSplit()), the video key frames are announced to the
+ * TSOutput, which starts the new parts.
+ * */
+class Muxer
+{
+	public:
+		Muxer(AVFormatContext* ctx);
+		virtual ~Muxer();
+		
+		/**
+		 * Called after the header has been written
+		 *
+		 * @return non-zero on error
+		 * */
+		virtual int start();
+		
+		/**
+		 * Write one packet. Ownership of the packet data is transferred
+		 * just as with av_interleaved_write_frame(), the caller still
+		 * needs to call av_free_packet().
+		 *
+		 * @return non-zero on error
+		 * */
+		virtual int writePacket(AVPacket* packet);
+		
+		/**
+		 * Write out everything buffered for interleaving
+		 *
+		 * @return non-zero on error or if not supported
+		 * */
+		virtual int flush();
+		
+		/**
+		 * Called before the trailer is written. All packets are
+		 * written to the output context when this returns.
+		 *
+		 * @return non-zero if there was an error during writing
+		 * */
+		virtual int finish();
+		
+		inline AVFormatContext* context() const
+		{ return m_ctx; }
+		
+		/**
+		 * libavformat reads the codec contexts of the output streams
+		 * while writing packets, possibly in another thread (see
+		 * ThreadedMuxer). After start(), stream handlers have to hold
+		 * this lock while changing their output codec context.
+		 * */
+		void lockCodecs();
+		void unlockCodecs();
+	protected:
+		/**
+		 * Pass packet to libavformat, announcing video frames to the
+		 * TSOutput if splitting.
+		 * */
+		int writeFrame(AVPacket* packet);
+	private:
+		AVFormatContext* m_ctx;
+		pthread_mutex_t m_codecMutex;
+		
+		// Splitting
+		TSOutput* m_split;
+		int m_splitStream;
+};
+
+/**
+ * @brief Muxer with its own writer thread
+ *
+ * Each output stream gets a bounded queue, so writePacket() may be
+ * called concurrently as long as every output stream is only written
+ * by one thread. Interleaving across streams is done by libavformat
+ * in the writer thread.
+ * */
+class ThreadedMuxer : public Muxer
+{
+	public:
+		ThreadedMuxer(AVFormatContext* ctx, unsigned int queue_size = 256);
+		virtual ~ThreadedMuxer();
+		
+		virtual int start();
+		virtual int writePacket(AVPacket* packet);
+		virtual int flush();
+		virtual int finish();
+	private:
+		typedef SPSCQueue<AVPacket> PacketQueue;
+		
+		std::vector<PacketQueue*> m_queues;
+		unsigned int m_queueSize;
+		
+		pthread_t m_thread;
+		bool m_running;
+		volatile bool m_finish;
+		volatile int m_error;
+		
+		static void* writerThread(void* arg);
+		void writeLoop();
+};
+
+#endif // MUXER_H
@@ -0,0 +1,150 @@
+// Packet buffering without copies
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#include "packetbuffer.h"
+#include "memstats.h"
+
+#include <string.h>
+
+#define DEBUG 0
+#define LOG_PREFIX "[packetbuffer]"
+#include <common/log.h>
+
+int movePacket(AVPacket* dest, AVPacket* src)
+{
+	// No-op if src already owns its data
+	if(av_dup_packet(src) < 0)
+		return error("Could not duplicate packet");
+	
+	*dest = *src;
+	
+	src->destruct = NULL;
+	src->side_data = NULL;
+	src->side_data_elems = 0;
+	
+	return 0;
+}
+
+void freePacketBuffer(PacketBuffer* buffer)
+{
+	for(PacketBuffer::iterator it = buffer->begin(); it != buffer->end(); ++it)
+		av_free_packet(&*it);
+	
+	buffer->clear();
+}
+
+int64_t packetBufferBytes(const PacketBuffer& buffer)
+{
+	int64_t bytes = 0;
+	
+	for(PacketBuffer::const_iterator it = buffer.begin(); it != buffer.end(); ++it)
+		bytes += it->size;
+	
+	return bytes;
+}
+
+BufferPool::BufferPool(int size, int max_free)
+ : m_size(size)
+ , m_maxFree(max_free)
+ , m_refs(1)
+ , m_stats(0)
+{
+	pthread_mutex_init(&m_mutex, 0);
+}
+
+BufferPool::~BufferPool()
+{
+	for(std::vector<uint8_t*>::iterator it = m_free.begin(); it != m_free.end(); ++it)
+	{
+		av_free(*it);
+		if(m_stats)
+			m_stats->freed(m_size);
+	}
+	
+	pthread_mutex_destroy(&m_mutex);
+}
+
+int BufferPool::alloc(AVPacket* packet)
+{
+	uint8_t* buf = 0;
+	
+	pthread_mutex_lock(&m_mutex);
+	if(!m_free.empty())
+	{
+		buf = m_free.back();
+		m_free.pop_back();
+	}
+	m_refs++;
+	pthread_mutex_unlock(&m_mutex);
+	
+	if(!buf)
+	{
+		buf = (uint8_t*)av_malloc(m_size + FF_INPUT_BUFFER_PADDING_SIZE);
+		if(!buf)
+		{
+			put(0);
+			return error("Could not allocate packet buffer");
+		}
+		
+		memset(buf + m_size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+		
+		if(m_stats)
+			m_stats->allocated(m_size);
+	}
+	
+	packet->data = buf;
+	packet->size = m_size;
+	packet->destruct = &BufferPool::destructPacket;
+	packet->priv = this;
+	
+	return 0;
+}
+
+void BufferPool::release()
+{
+	put(0);
+}
+
+void BufferPool::setMemStats(MemStats* stats)
+{
+	m_stats = stats;
+}
+
+void BufferPool::destructPacket(AVPacket* packet)
+{
+	BufferPool* pool = (BufferPool*)packet->priv;
+	
+	pool->put(packet->data);
+	
+	packet->data = NULL;
+	packet->size = 0;
+	packet->destruct = NULL;
+}
+
+/**
+ * Return @c buf (may be NULL) and drop the reference that came with it.
+ * */
+void BufferPool::put(uint8_t* buf)
+{
+	pthread_mutex_lock(&m_mutex);
+	
+	if(buf && (int)m_free.size() < m_maxFree)
+	{
+		m_free.push_back(buf);
+		buf = 0;
+	}
+	
+	bool last = (--m_refs == 0);
+	
+	pthread_mutex_unlock(&m_mutex);
+	
+	if(buf)
+	{
+		av_free(buf);
+		if(m_stats)
+			m_stats->freed(m_size);
+	}
+	
+	if(last)
+		delete this;
+}
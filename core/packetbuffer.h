@@ -0,0 +1,95 @@
+// Packet buffering without copies
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#ifndef PACKETBUFFER_H
+#define PACKETBUFFER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <vector>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+class MemStats;
+
+typedef std::vector<AVPacket> PacketBuffer;
+
+/**
+ * @brief Take over the payload of @c src
+ *
+ * If @c src owns its data (e.g. packets read by the cutter thread in
+ * pipelined mode), the data is moved to @c dest without copying it.
+ * Packets pointing into demuxer buffers or shared with other handlers
+ * are copied once.
+ *
+ * Afterwards @c src does not own anything anymore, freeing it is a
+ * no-op. Its fields (including data) stay valid as long as @c dest is
+ * not freed.
+ *
+ * @return non-zero on error
+ * */
+int movePacket(AVPacket* dest, AVPacket* src);
+
+//! Free all packets in @c buffer and clear it
+void freePacketBuffer(PacketBuffer* buffer);
+
+//! Payload size of all packets in @c buffer
+int64_t packetBufferBytes(const PacketBuffer& buffer);
+
+/**
+ * @brief Pool of equally sized packet buffers
+ *
+ * Used for encoder output. A packet allocated with alloc() returns its
+ * buffer to the pool when it is freed, which may happen in the muxer
+ * thread long after the packet was written (av_interleaved_write_frame()
+ * takes over the packet without copying it).
+ *
+ * The pool stays alive until the owner called release() and all buffers
+ * are back, so do not delete it directly.
+ * */
+class BufferPool
+{
+	public:
+		/**
+		 * @param size Usable size of each buffer
+		 * @param max_free Maximum number of unused buffers kept around
+		 * */
+		BufferPool(int size, int max_free = 8);
+		
+		/**
+		 * Attach a buffer to @c packet. packet->size is set to the
+		 * usable buffer size.
+		 *
+		 * @return non-zero on error
+		 * */
+		int alloc(AVPacket* packet);
+		
+		//! Give up ownership of the pool
+		void release();
+		
+		/**
+		 * Account the buffers in @c stats (may be NULL). Call before the
+		 * first alloc(), @c stats needs to outlive all packets.
+		 * */
+		void setMemStats(MemStats* stats);
+		
+		inline int bufferSize() const
+		{ return m_size; }
+	private:
+		~BufferPool();
+		
+		static void destructPacket(AVPacket* packet);
+		void put(uint8_t* buf);
+		
+		pthread_mutex_t m_mutex;
+		std::vector<uint8_t*> m_free;
+		int m_size;
+		int m_maxFree;
+		int m_refs;
+		MemStats* m_stats;
+};
+
+#endif // PACKETBUFFER_H
@@ -0,0 +1,283 @@
+// Parallel segment rendering
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#include "segments.h"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <vector>
+
+#include "cutter.h"
+#include "mpegts.h"
+#include "tsoutput.h"
+
+#include <common/io_file.h>
+
+#define DEBUG 0
+#define LOG_PREFIX "[segments]"
+#include <common/log.h>
+
+// Segment files are copied in chunks of this size
+const int JOIN_BUFSIZE = 1024 * TS_PACKET_SIZE;
+
+struct Segment
+{
+	CutPointList cutlist;   //!< Cut points of this segment
+	CutPointList preceding; //!< All cut points before this segment
+	char filename[1024];    //!< Temporary output file
+	int result;
+};
+
+typedef std::vector<Segment> SegmentList;
+
+struct WorkerContext
+{
+	pthread_mutex_t mutex;
+	SegmentList* segments;
+	int next;
+	
+	const char* input_file;
+	const char* audio_decoder;
+	HandlerOptions options;
+};
+
+static void splitCutlist(const CutPointList& cutlist, SegmentList* segments)
+{
+	CutPointList current;
+	CutPointList preceding;
+	
+	for(int i = 0; i < cutlist.size(); ++i)
+	{
+		current.push_back(cutlist[i]);
+		
+		if(cutlist[i].direction != CutPoint::OUT && i != cutlist.size()-1)
+			continue;
+		
+		Segment seg;
+		seg.cutlist = current;
+		seg.preceding = preceding;
+		seg.result = -1;
+		segments->push_back(seg);
+		
+		preceding.insert(preceding.end(), current.begin(), current.end());
+		current.clear();
+	}
+}
+
+static int renderSegment(const char* input_file, const char* audio_decoder,
+	const HandlerOptions& options, Segment* seg)
+{
+	AVFormatContext* input = 0;
+	AVFormatContext* output;
+	int ret;
+	
+	if(io_file_open_input(&input, input_file) != 0)
+		return error("Could not open input file '%s'", input_file);
+	
+	if(avformat_find_stream_info(input, 0) < 0)
+	{
+		io_file_close_input(&input);
+		return error("Could not find stream information");
+	}
+	
+	output = openOutput(seg->filename, 0);
+	if(!output)
+	{
+		io_file_close_input(&input);
+		return -1;
+	}
+	
+	{
+		Cutter cutter(input, seg->cutlist);
+		cutter.setAudioDecoder(audio_decoder);
+		cutter.setHandlerOptions(options);
+		cutter.setProgress(false, false);
+		
+		if(!cutter.setupHandlers(output))
+		{
+			closeOutput(output);
+			io_file_close_input(&input);
+			return error("Could not setup stream handlers");
+		}
+		
+		cutter.setPrecedingCutout(seg->preceding);
+		
+		// Segments starting with a cut out start at the beginning of the
+		// file, everything else can seek.
+		int64_t start = seg->cutlist[0].time - cutter.preroll();
+		if(seg->cutlist[0].direction == CutPoint::IN && start > 0)
+		{
+			log_debug("Seeking to %'10lld", start);
+			if(av_seek_frame(input, -1, input->start_time + start, AVSEEK_FLAG_BACKWARD) < 0)
+				log_warning("Could not seek to segment start, reading from the beginning");
+		}
+		
+		ret = cutter.run();
+	}
+	
+	if(closeOutput(output) != 0 && ret == 0)
+		ret = -1;
+	io_file_close_input(&input);
+	
+	return ret;
+}
+
+static void* segmentWorker(void* arg)
+{
+	WorkerContext* ctx = (WorkerContext*)arg;
+	
+	while(1)
+	{
+		pthread_mutex_lock(&ctx->mutex);
+		int idx = ctx->next++;
+		pthread_mutex_unlock(&ctx->mutex);
+		
+		if(idx >= ctx->segments->size())
+			break;
+		
+		Segment* seg = &(*ctx->segments)[idx];
+		seg->result = renderSegment(ctx->input_file, ctx->audio_decoder, ctx->options, seg);
+		
+		printf("Segment %d/%d finished%s\n", idx+1, (int)ctx->segments->size(),
+			seg->result == 0 ? "" : " with errors");
+		fflush(stdout);
+	}
+	
+	return 0;
+}
+
+/**
+ * Append the segment files to @c output. Timestamps are continuous
+ * already and all parts use the same PIDs, so the TS packets are copied
+ * as they are. TSOutput fixes the continuity counters.
+ * */
+static int joinSegments(const SegmentList& segments, AVFormatContext* output)
+{
+	TSOutput* ts = TSOutput::fromContext(output->pb);
+	std::vector<uint8_t> buf(JOIN_BUFSIZE);
+	uint64_t total = 0;
+	
+	for(int i = 0; i < segments.size(); ++i)
+	{
+		FILE* part = fopen(segments[i].filename, "rb");
+		if(!part)
+			return error("Could not open segment file '%s'", segments[i].filename);
+		
+		size_t bytes;
+		while((bytes = fread(&buf[0], 1, buf.size(), part)) != 0)
+		{
+			int count = bytes / TS_PACKET_SIZE;
+			
+			if(count * TS_PACKET_SIZE != bytes)
+			{
+				fclose(part);
+				return error("Segment file '%s' contains an incomplete TS packet",
+					segments[i].filename);
+			}
+			
+			if(ts->writePackets(&buf[0], count) != 0)
+			{
+				fclose(part);
+				return error("Could not write packets of segment %d", i+1);
+			}
+			
+			total += bytes;
+		}
+		
+		bool failed = ferror(part);
+		fclose(part);
+		
+		if(failed)
+			return error("Could not read segment file '%s'", segments[i].filename);
+	}
+	
+	if(!total)
+		return error("No segment contains any data");
+	
+	return 0;
+}
+
+int cutSegments(const char* input_file, const CutPointList& cutlist,
+	AVFormatContext* output, const char* output_file, int jobs,
+	const char* audio_decoder, const HandlerOptions& options)
+{
+	SegmentList segments;
+	WorkerContext ctx;
+	std::vector<pthread_t> threads;
+	int ret = 0;
+	
+	splitCutlist(cutlist, &segments);
+	
+	for(int i = 0; i < segments.size(); ++i)
+	{
+		snprintf(segments[i].filename, sizeof(segments[i].filename),
+			"%s.seg%03d.ts", output_file, i);
+	}
+	
+	if(jobs > segments.size())
+		jobs = segments.size();
+	
+	printf("Rendering %d segments with %d worker threads\n",
+		(int)segments.size(), jobs);
+	
+	if(!registerLockManager())
+		return error("Could not register lock manager");
+	
+	pthread_mutex_init(&ctx.mutex, 0);
+	ctx.segments = &segments;
+	ctx.next = 0;
+	ctx.input_file = input_file;
+	ctx.audio_decoder = audio_decoder;
+	ctx.options = options;
+	
+	for(int i = 0; i < jobs; ++i)
+	{
+		pthread_t thread;
+		if(pthread_create(&thread, 0, &segmentWorker, &ctx) != 0)
+		{
+			log_warning("Could not create worker thread %d", i);
+			continue;
+		}
+		
+		threads.push_back(thread);
+	}
+	
+	// Make sure we are making progress even without threads
+	if(threads.empty())
+		segmentWorker(&ctx);
+	
+	for(int i = 0; i < threads.size(); ++i)
+		pthread_join(threads[i], 0);
+	
+	pthread_mutex_destroy(&ctx.mutex);
+	
+	for(int i = 0; i < segments.size(); ++i)
+	{
+		if(segments[i].result != 0)
+		{
+			error("Segment %d failed", i+1);
+			ret = 2;
+		}
+	}
+	
+	if(ret == 0)
+	{
+		printf("Joining segments\n");
+		if(joinSegments(segments, output) != 0)
+			ret = 1;
+	}
+	
+	for(int i = 0; i < segments.size(); ++i)
+		unlink(segments[i].filename);
+	
+	return ret;
+}
@@ -0,0 +1,35 @@
+// Parallel segment rendering
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#ifndef SEGMENTS_H
+#define SEGMENTS_H
+
+#include "cutlist.h"
+#include "streamhandler.h"
+
+class AVFormatContext;
+
+/**
+ * @brief Cut each kept segment on its own worker thread
+ *
+ * The cutlist is split into independent segments (cut in to cut out).
+ * Every worker opens its own input context, seeks to the start of its
+ * segment and renders it with its own set of stream handlers into a
+ * temporary file. The TS packets of the parts are then copied in order
+ * into @c output, which needs to be opened with openOutput(). No streams
+ * are created in @c output, the muxer is not used.
+ *
+ * @param input_file Input file name
+ * @param cutlist Complete cut list
+ * @param output Output context
+ * @param output_file Output file name, used as base for temporary files
+ * @param jobs Number of worker threads
+ * @param audio_decoder see Cutter::setAudioDecoder()
+ * @param options see Cutter::setHandlerOptions()
+ * @return exit code (0 on success)
+ * */
+int cutSegments(const char* input_file, const CutPointList& cutlist,
+	AVFormatContext* output, const char* output_file, int jobs,
+	const char* audio_decoder = 0, const HandlerOptions& options = HandlerOptions());
+
+#endif // SEGMENTS_H
@@ -0,0 +1,129 @@
+// Puts the output of concurrent jobs back in order
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#include "splicequeue.h"
+#include "muxer.h"
+#include "packetbuffer.h"
+
+#include <pthread.h>
+
+#define DEBUG 0
+#define LOG_PREFIX "[splice]"
+#include <common/log.h>
+
+class SpliceQueue::Slot : public Muxer
+{
+	public:
+		Slot(AVFormatContext* ctx)
+		 : Muxer(ctx)
+		 , m_closed(false)
+		{
+			pthread_mutex_init(&m_mutex, 0);
+		}
+		
+		virtual ~Slot()
+		{
+			freePacketBuffer(&m_packets);
+			pthread_mutex_destroy(&m_mutex);
+		}
+		
+		virtual int start()
+		{ return 0; }
+		
+		virtual int writePacket(AVPacket* packet)
+		{
+			// Same semantics as av_interleaved_write_frame()
+			AVPacket queued = *packet;
+			packet->destruct = NULL;
+			
+			if(av_dup_packet(&queued) < 0)
+				return error("Could not duplicate packet");
+			
+			pthread_mutex_lock(&m_mutex);
+			m_packets.push_back(queued);
+			pthread_mutex_unlock(&m_mutex);
+			
+			return 0;
+		}
+		
+		virtual int flush()
+		{ return -1; }
+		
+		void close()
+		{
+			pthread_mutex_lock(&m_mutex);
+			m_closed = true;
+			pthread_mutex_unlock(&m_mutex);
+		}
+		
+		/**
+		 * Take all packets written so far
+		 *
+		 * @return true if the slot is closed, i.e. these are the last ones
+		 * */
+		bool take(PacketBuffer* dest)
+		{
+			pthread_mutex_lock(&m_mutex);
+			dest->swap(m_packets);
+			bool closed = m_closed;
+			pthread_mutex_unlock(&m_mutex);
+			
+			return closed;
+		}
+	private:
+		pthread_mutex_t m_mutex;
+		PacketBuffer m_packets;
+		bool m_closed;
+};
+
+SpliceQueue::SpliceQueue(Muxer* muxer)
+ : m_muxer(muxer)
+{
+}
+
+SpliceQueue::~SpliceQueue()
+{
+	for(std::deque<Slot*>::iterator it = m_slots.begin(); it != m_slots.end(); ++it)
+		delete *it;
+}
+
+Muxer* SpliceQueue::addSlot()
+{
+	Slot* slot = new Slot(m_muxer->context());
+	m_slots.push_back(slot);
+	
+	return slot;
+}
+
+void SpliceQueue::closeSlot(Muxer* slot)
+{
+	((Slot*)slot)->close();
+}
+
+int SpliceQueue::forward()
+{
+	PacketBuffer packets;
+	int ret = 0;
+	
+	while(!m_slots.empty())
+	{
+		Slot* slot = m_slots.front();
+		bool closed = slot->take(&packets);
+		
+		for(PacketBuffer::iterator it = packets.begin(); it != packets.end(); ++it)
+		{
+			if(ret == 0 && m_muxer->writePacket(&*it) != 0)
+				ret = error("Could not write packet");
+		}
+		freePacketBuffer(&packets);
+		
+		if(!closed)
+			break;
+		
+		log_debug("Slot done");
+		delete slot;
+		m_slots.pop_front();
+	}
+	
+	return ret;
+}
@@ -0,0 +1,58 @@
+// Puts the output of concurrent jobs back in order
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#ifndef SPLICEQUEUE_H
+#define SPLICEQUEUE_H
+
+#include <deque>
+
+class Muxer;
+
+/**
+ * @brief Ordered output slots for one output stream
+ *
+ * Every job writing to the output stream gets its own slot, which is a
+ * Muxer that may be written from any thread. forward() passes the packets
+ * on to the real muxer in slot order: the packets of the oldest slot as
+ * soon as they arrive, those of later slots once all earlier slots have
+ * been closed.
+ *
+ * Apart from the slot muxers themselves, the queue is only used by the
+ * thread that owns the output stream.
+ * */
+class SpliceQueue
+{
+	public:
+		SpliceQueue(Muxer* muxer);
+		~SpliceQueue();
+		
+		/**
+		 * Append a new slot. Its packets are written after those of all
+		 * existing slots.
+		 * */
+		Muxer* addSlot();
+		
+		/**
+		 * Nothing more is going to be written to @c slot (may be called
+		 * from the writing thread). The slot is deleted by forward().
+		 * */
+		static void closeSlot(Muxer* slot);
+		
+		/**
+		 * Write everything that is due to the real muxer
+		 *
+		 * @return non-zero on error
+		 * */
+		int forward();
+		
+		//! All slots closed and forwarded
+		inline bool empty() const
+		{ return m_slots.empty(); }
+	private:
+		class Slot;
+		
+		Muxer* m_muxer;
+		std::deque<Slot*> m_slots;
+};
+
+#endif // SPLICEQUEUE_H
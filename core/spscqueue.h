@@ -0,0 +1,149 @@
+// Bounded single-producer/single-consumer queue
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <sched.h>
+#include <unistd.h>
+
+/**
+ * Wait strategy for the blocking queue operations: spin a little,
+ * then yield, then sleep.
+ * */
+inline void spsc_backoff(int* count)
+{
+	int c = (*count)++;
+	
+	if(c < 64)
+		return;
+	else if(c < 256)
+		sched_yield();
+	else
+		usleep(200);
+}
+
+/**
+ * @brief Lock-free bounded ring buffer
+ *
+ * Exactly one thread may push and exactly one thread may pop. Items are
+ * copied by value, so T should be cheap to copy (e.g. an AVPacket whose
+ * ownership is transferred with the copy).
+ * */
+template<class T>
+class SPSCQueue
+{
+	public:
+		/**
+		 * @param capacity Maximum number of queued items, rounded up to
+		 *   the next power of two
+		 * */
+		explicit SPSCQueue(unsigned int capacity)
+		 : m_head(0)
+		 , m_tail(0)
+		 , m_closed(false)
+		{
+			unsigned int size = 1;
+			while(size < capacity)
+				size <<= 1;
+			
+			m_buffer = new T[size];
+			m_mask = size - 1;
+		}
+		
+		~SPSCQueue()
+		{
+			delete[] m_buffer;
+		}
+		
+		//! @name Producer side
+		//@{
+		bool tryPush(const T& item)
+		{
+			unsigned int tail = m_tail;
+			
+			if(tail - m_head > m_mask)
+				return false;
+			
+			m_buffer[tail & m_mask] = item;
+			__sync_synchronize();
+			m_tail = tail + 1;
+			
+			return true;
+		}
+		
+		//! Push item, blocks while the queue is full
+		void push(const T& item)
+		{
+			int count = 0;
+			while(!tryPush(item))
+				spsc_backoff(&count);
+		}
+		
+		//! No more items will be pushed
+		void close()
+		{
+			__sync_synchronize();
+			m_closed = true;
+		}
+		//@}
+		
+		//! @name Consumer side
+		//@{
+		bool tryPop(T* item)
+		{
+			unsigned int head = m_head;
+			
+			if(head == m_tail)
+				return false;
+			
+			__sync_synchronize();
+			*item = m_buffer[head & m_mask];
+			__sync_synchronize();
+			m_head = head + 1;
+			
+			return true;
+		}
+		
+		/**
+		 * Pop item, blocks while the queue is empty.
+		 *
+		 * @return false if the queue is empty and closed
+		 * */
+		bool pop(T* item)
+		{
+			int count = 0;
+			while(!tryPop(item))
+			{
+				if(m_closed)
+				{
+					// close() might have happened after our last try
+					return tryPop(item);
+				}
+				
+				spsc_backoff(&count);
+			}
+			
+			return true;
+		}
+		
+		inline bool closed() const
+		{ return m_closed; }
+		//@}
+		
+		inline bool empty() const
+		{ return m_head == m_tail; }
+	private:
+		T* m_buffer;
+		unsigned int m_mask;
+		
+		volatile unsigned int m_head; //!< written by consumer only
+		volatile unsigned int m_tail; //!< written by producer only
+		volatile bool m_closed;
+		
+		// non-copyable
+		SPSCQueue(const SPSCQueue&);
+		SPSCQueue& operator=(const SPSCQueue&);
+};
+
+#endif // SPSCQUEUE_H
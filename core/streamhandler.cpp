@@ -2,6 +2,9 @@
 // Author: Max Schwarz <Max@x-quadraht.de>
 
 #include "streamhandler.h"
+#include "muxer.h"
+#include "memstats.h"
+#include "decoder.h"
 
 extern "C"
 {
@@ -17,17 +20,41 @@ extern "C"
 typedef std::map<int, StreamHandler::Creator> CreatorMap;
 CreatorMap* g_creatorMap;
 
+HandlerOptions::HandlerOptions()
+ : minimalReencode(false)
+ , codecThreads(1)
+ , h264Preset("ultrafast")
+ , preopenEncoders(false)
+ , repeatParameterSets(false)
+ , boundaryJobs(0)
+ , snapKeyframes(false)
+ , audioFrameCuts(false)
+ , memStats(false)
+{
+}
+
 StreamHandler::StreamHandler(AVStream* stream)
  : m_stream(stream)
+ , m_octx(0)
+ , m_muxer(0)
+ , m_memStats(0)
+ , m_decoder(0)
+ , m_ownDecoder(false)
  , m_totalCutout(0)
  , m_lastDTS(-1)
  , m_nonMonotonic(false)
  , m_active(true)
+ , m_cutout(false)
 {
 }
 
 StreamHandler::~StreamHandler()
 {
+	if(m_decoder && !m_ownDecoder)
+		m_decoder->stop(this);
+	
+	if(m_ownDecoder)
+		delete m_decoder;
 }
 
 void StreamHandler::setCutList(const CutPointList& list)
@@ -45,16 +72,127 @@ void StreamHandler::setOutputStream(AVStream* outputStream)
 	m_ostream = outputStream;
 }
 
+void StreamHandler::setMuxer(Muxer* muxer)
+{
+	m_muxer = muxer;
+}
+
+void StreamHandler::setOptions(const HandlerOptions& options)
+{
+	m_options = options;
+}
+
+void StreamHandler::setMemStats(MemStats* stats)
+{
+	m_memStats = stats;
+}
+
+void StreamHandler::setDecoder(Decoder* decoder)
+{
+	if(m_ownDecoder)
+		delete m_decoder;
+	
+	m_decoder = decoder;
+	m_ownDecoder = false;
+}
+
+Decoder* StreamHandler::decoder()
+{
+	if(!m_decoder)
+	{
+		m_decoder = new Decoder(m_stream->codec);
+		m_ownDecoder = true;
+	}
+	
+	return m_decoder;
+}
+
+void StreamHandler::accountAlloc(int64_t bytes)
+{
+	if(m_memStats)
+		m_memStats->allocated(bytes);
+}
+
+void StreamHandler::accountFree(int64_t bytes)
+{
+	if(m_memStats)
+		m_memStats->freed(bytes);
+}
+
+void StreamHandler::lockOutputCodec()
+{
+	if(m_muxer)
+		m_muxer->lockCodecs();
+}
+
+void StreamHandler::unlockOutputCodec()
+{
+	if(m_muxer)
+		m_muxer->unlockCodecs();
+}
+
+int StreamHandler::muxPacket(AVPacket* packet)
+{
+	if(m_muxer)
+		return m_muxer->writePacket(packet);
+	
+	return av_interleaved_write_frame(m_octx, packet);
+}
+
 void StreamHandler::setTotalCutout(int64_t duration)
 {
 	m_totalCutout = duration;
 }
 
+void StreamHandler::setPrecedingCutout(const CutPointList& list)
+{
+	CutPointList rescaled = list.rescale(AV_TIME_BASE_Q, m_stream->time_base);
+	
+	m_totalCutout = 0;
+	for(int i = 0; i < rescaled.size(); ++i)
+	{
+		if(rescaled[i].direction != CutPoint::OUT)
+			continue;
+		
+		// The cut in terminating this cut out is either part of the
+		// preceding list or the first cut point of our own list.
+		int64_t cutin = (i+1 < rescaled.size()) ? rescaled[i+1].time : m_cutlist[0].time;
+		m_totalCutout += cutin - rescaled[i].time;
+	}
+}
+
+int64_t StreamHandler::prerollTime() const
+{
+	return 0;
+}
+
 void StreamHandler::setActive(bool active)
 {
+	// Everything written before is visible to whoever sees the change
+	__sync_synchronize();
 	m_active = active;
 }
 
+void StreamHandler::setCutout(bool cutout)
+{
+	__sync_synchronize();
+	m_cutout = cutout;
+}
+
+void StreamHandler::seeked()
+{
+}
+
+int StreamHandler::finish()
+{
+	return 0;
+}
+
+bool StreamHandler::copying() const
+{
+	return false;
+}
+
 int StreamHandler::writeInputPacket(AVPacket* packet)
 {
 	const int64_t MASK = 0xFFFFFFFFFFFFFFFFLL >> (64 - m_stream->pts_wrap_bits);
@@ -91,7 +229,7 @@ int StreamHandler::writeInputPacket(AVPacket* packet)
 
 	packet->dts = AV_NOPTS_VALUE;
 
-	return av_interleaved_write_frame(m_octx, packet);
+	return muxPacket(packet);
 }
 
 int64_t StreamHandler::pts_rel(int64_t pts) const
@@ -9,6 +9,50 @@
 class AVStream;
 class AVPacket;
 class AVFormatContext;
+class Muxer;
+class MemStats;
+class Decoder;
+
+/**
+ * @brief User settings for the stream handlers
+ * 
+ * Passed to every stream handler before init(). Handlers ignore
+ * settings that do not apply to them.
+ * */
+struct HandlerOptions
+{
+	HandlerOptions();
+	
+	//! MPEG-2: Only re-encode frames that reference removed material
+	bool minimalReencode;
+	
+	//! Threads used by each decoder/encoder (MPEG-2: slice threading,
+	//! H.264 encoder: frame threading)
+	int codecThreads;
+	
+	//! H.264: x264 preset used for re-encoding
+	const char* h264Preset;
+	
+	//! Open the encoder for the next cut in a background thread
+	bool preopenEncoders;
+	
+	//! H.264: Repeat SPS/PPS in front of every copied random access point
+	bool repeatParameterSets;
+	
+	//! Video: Number of cut points re-encoded concurrently in the
+	//! background (0: serially, see AsyncHandler)
+	int boundaryJobs;
+	
+	//! Cut at video key frames only and never decode (see CopyHandler)
+	bool snapKeyframes;
+	
+	//! Audio: Cut at whole frames instead of decoding and re-encoding
+	//! the frames at the cut points
+	bool audioFrameCuts;
+	
+	//! Count the buffers of each handler and report them at the end
+	bool memStats;
+};
 
 class StreamHandler
 {
@@ -35,19 +79,77 @@ class StreamHandler
 		 * */
 		virtual int handlePacket(AVPacket* packet) = 0;
 		
+		/**
+		 * Called after the last packet, write out anything still
+		 * buffered.
+		 * 
+		 * @return non-zero on error
+		 * */
+		virtual int finish();
+		
 		/**
 		 * Is the stream handler still active?
 		 * This should be false when the last cut
 		 * point is a cut out and it has been reached.
 		 * */
-		inline bool active()
+		inline bool active() const
 		{ return m_active; }
 		
+		/**
+		 * Is the stream handler inside a cut out region, i.e. is it
+		 * discarding its input until the next cut in?
+		 * */
+		inline bool inCutout() const
+		{ return m_cutout; }
+		
+		/**
+		 * Called after the input has been repositioned to skip over a
+		 * cut out region. The next packet passed to handlePacket() is
+		 * not contiguous with the last one.
+		 * */
+		virtual void seeked();
+		
+		/**
+		 * Is the handler passing its input through unchanged (apart from
+		 * timestamps) and will it keep doing so until shortly before its
+		 * next cut point (see prerollTime())? Used for raw TS copying.
+		 * */
+		virtual bool copying() const;
+		
 		// Set needed objects
-		void setCutList(const CutPointList& list);
+		virtual void setCutList(const CutPointList& list);
 		void setOutputContext(AVFormatContext* ctx);
 		void setOutputStream(AVStream* outputStream);
-		void setStartPTS_AV(int64_t start_av);
+		void setMuxer(Muxer* muxer);
+		void setOptions(const HandlerOptions& options);
+		virtual void setStartPTS_AV(int64_t start_av);
+		
+		//! Account buffers in @c stats (not taken over, may be NULL)
+		void setMemStats(MemStats* stats);
+		
+		/**
+		 * Decode with @c decoder (not taken over), e.g. one shared with
+		 * the handlers of other outputs. Call before init(). Without it,
+		 * the handler gets a private Decoder for stream()->codec.
+		 * */
+		void setDecoder(Decoder* decoder);
+		
+		/**
+		 * Account for cut outs that happen before the first cut point
+		 * of our cut list, e.g. if the cut list is only a part of the
+		 * complete list that is processed elsewhere.
+		 * 
+		 * @param list Preceding cut points in AV_TIME_BASE units
+		 * */
+		virtual void setPrecedingCutout(const CutPointList& list);
+		
+		/**
+		 * Time before a cut point from which on the handler needs to
+		 * see input packets (e.g. to start decoding in time).
+		 * 
+		 * @return preroll time in AV_TIME_BASE units
+		 * */
+		virtual int64_t prerollTime() const;
 		
 		inline AVStream* stream() const
 		{ return m_stream; }
@@ -57,7 +159,38 @@ class StreamHandler
 		{ return m_octx; }
 		inline AVStream* outputStream() const
 		{ return m_ostream; }
+		inline const HandlerOptions& options() const
+		{ return m_options; }
+		
+		//! Allocation accounting, NULL if disabled
+		inline MemStats* memStats() const
+		{ return m_memStats; }
 	protected:
+		/**
+		 * Pass packet to the output muxer (see Muxer::writePacket()).
+		 * Use this instead of av_interleaved_write_frame().
+		 * */
+		int muxPacket(AVPacket* packet);
+		
+		inline Muxer* muxer() const
+		{ return m_muxer; }
+		
+		//! Decoder of the input stream (see setDecoder())
+		Decoder* decoder();
+		
+		/**
+		 * Hold while changing outputStream()->codec after init(), the
+		 * muxer may be reading it (see Muxer::lockCodecs()).
+		 * */
+		void lockOutputCodec();
+		void unlockOutputCodec();
+		
+		//! @name Allocation accounting (no-ops if disabled)
+		//@{
+		void accountAlloc(int64_t bytes);
+		void accountFree(int64_t bytes);
+		//@}
+		
 		/**
 		 * Write packet with correct parameters and
 		 * offset (see setTotalCutout())
@@ -77,6 +210,7 @@ class StreamHandler
 		{ return m_totalCutout; }
 		
 		void setActive(bool active);
+		void setCutout(bool cutout);
 		
 		/**
 		 * Calculate PTS relative to stream start time.
@@ -88,12 +222,21 @@ class StreamHandler
 		AVStream* m_stream;
 		AVStream* m_ostream;
 		AVFormatContext* m_octx;
+		Muxer* m_muxer;
+		HandlerOptions m_options;
+		MemStats* m_memStats;
+		Decoder* m_decoder;
+		bool m_ownDecoder;
 		CutPointList m_cutlist;
 		int64_t m_totalCutout;
 		int64_t m_startTime;
 		int64_t m_lastDTS;
 		bool m_nonMonotonic;
-		bool m_active;
+		
+		// Read by the demuxing thread while the handler runs in its own
+		// thread (pipelined mode, AsyncHandler)
+		volatile bool m_active;
+		volatile bool m_cutout;
 };
 
 class StreamHandlerFactory
@@ -0,0 +1,400 @@
+// MPEG-TS output filter
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#include "tsoutput.h"
+#include "io_split.h"
+
+extern "C"
+{
+#include <libavutil/avutil.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/mem.h>
+}
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#define DEBUG 0
+#define LOG_PREFIX "[tsoutput]"
+#include <common/log.h>
+
+const int BUFSIZE = 256 * TS_PACKET_SIZE;
+
+const uint8_t CC_UNKNOWN = 0xFF;
+
+TSOutput::TSOutput(const char* filename, uint64_t split_size, int flags)
+ : m_sink(0)
+ , m_direct(false)
+ , m_sinkSplitSize(split_size)
+ , m_sinkFlags(flags)
+ , m_carrySize(0)
+ , m_havePAT(false)
+ , m_havePMT(false)
+ , m_pmtPID(-1)
+ , m_pcrPID(-1)
+ , m_splitSize(0)
+ , m_splitDuration(0)
+ , m_partSize(0)
+ , m_partStart(AV_NOPTS_VALUE)
+ , m_videoPID(-1)
+{
+	snprintf(m_filename, sizeof(m_filename), "%s", filename);
+	memset(m_cc, CC_UNKNOWN, sizeof(m_cc));
+	
+	m_ctx = avio_alloc_context(
+		(unsigned char*)av_malloc(BUFSIZE), BUFSIZE,
+		1, /* write_flag */
+		(void*)this,
+		NULL, /* read_packet */
+		&TSOutput::writeCallback,
+		NULL /* seek */
+	);
+}
+
+TSOutput::~TSOutput()
+{
+	if(m_sink)
+		close();
+	
+	if(m_ctx)
+	{
+		av_free(m_ctx->buffer);
+		av_free(m_ctx);
+	}
+}
+
+bool TSOutput::open()
+{
+	int fd = -1;
+	
+	// Protocol URLs (udp://, http:// etc.) are left to libavformat
+	if(strstr(m_filename, "://"))
+	{
+		if(avio_open(&m_sink, m_filename, AVIO_FLAG_WRITE) < 0)
+			m_sink = 0;
+	}
+	else if(sscanf(m_filename, "pipe:%d", &fd) == 1)
+		m_sink = io_split_create_fd(fd, m_filename);
+	else
+		m_sink = io_split_create(m_filename, m_sinkSplitSize, m_sinkFlags);
+	
+	if(!m_sink)
+	{
+		error("Could not open output file '%s'", m_filename);
+		return false;
+	}
+	
+	m_direct = io_split_is_context(m_sink);
+	m_lastPTS.assign(TS_MAX_PID+1, AV_NOPTS_VALUE);
+	
+	return true;
+}
+
+int TSOutput::close()
+{
+	if(!m_sink)
+		return 0;
+	
+	avio_flush(m_ctx);
+	
+	if(m_carrySize)
+	{
+		log_warning("Dropping %d bytes of incomplete TS packet", m_carrySize);
+		m_carrySize = 0;
+	}
+	
+	int ret;
+	if(m_direct)
+		ret = io_split_close(m_sink);
+	else
+	{
+		avio_flush(m_sink);
+		ret = m_sink->error;
+		
+		if(avio_close(m_sink) != 0)
+			ret = -1;
+	}
+	
+	m_sink = 0;
+	std::vector<int64_t>().swap(m_lastPTS);
+	
+	if(ret != 0)
+		error("Could not write all data to '%s'", m_filename);
+	
+	return ret;
+}
+
+TSOutput* TSOutput::fromContext(AVIOContext* ctx)
+{
+	return (TSOutput*)ctx->opaque;
+}
+
+int TSOutput::writeCallback(void* opaque, uint8_t* buf, int size)
+{
+	return ((TSOutput*)opaque)->write(buf, size);
+}
+
+int TSOutput::write(uint8_t* buf, int size)
+{
+	int ret = size;
+	
+	// The muxer only writes whole packets, so this should not happen
+	// unless someone flushes in between.
+	if(m_carrySize)
+	{
+		int n = std::min(TS_PACKET_SIZE - m_carrySize, size);
+		memcpy(m_carry + m_carrySize, buf, n);
+		m_carrySize += n;
+		buf += n;
+		size -= n;
+		
+		if(m_carrySize < TS_PACKET_SIZE)
+			return ret;
+		
+		output(m_carry, 1, true);
+		m_carrySize = 0;
+	}
+	
+	int count = size / TS_PACKET_SIZE;
+	output(buf, count, true);
+	
+	m_carrySize = size - count * TS_PACKET_SIZE;
+	memcpy(m_carry, buf + count * TS_PACKET_SIZE, m_carrySize);
+	
+	return ret;
+}
+
+int TSOutput::writePackets(uint8_t* buf, int count)
+{
+	avio_flush(m_ctx);
+	
+	if(m_carrySize)
+		return error("Muxer output is not packet aligned");
+	
+	return output(buf, count, false);
+}
+
+/**
+ * Pass whole packets to the sink, starting new parts in between if
+ * necessary.
+ *
+ * @param muxed Packets were written by the muxer (see queueVideoFrame())
+ * @return non-zero on error
+ * */
+int TSOutput::output(uint8_t* buf, int count, bool muxed)
+{
+	int start = 0;
+	
+	for(int i = 0; i < count; ++i)
+	{
+		uint8_t* pkt = buf + i * TS_PACKET_SIZE;
+		
+		if(splitting() && splitPoint(pkt, muxed))
+		{
+			if(sinkWrite(buf + start * TS_PACKET_SIZE, (i - start) * TS_PACKET_SIZE) != 0)
+				return -1;
+			start = i;
+			
+			if(startPart() != 0)
+				return -1;
+		}
+		
+		processPacket(pkt);
+	}
+	
+	return sinkWrite(buf + start * TS_PACKET_SIZE, (count - start) * TS_PACKET_SIZE);
+}
+
+//! @return non-zero on error
+int TSOutput::sinkWrite(const uint8_t* buf, int size)
+{
+	if(!size)
+		return 0;
+	
+	if(!m_sink)
+		return error("Output '%s' is not open", m_filename);
+	
+	if(m_direct)
+		return io_split_write(m_sink, buf, size);
+	
+	avio_write(m_sink, buf, size);
+	return m_sink->error;
+}
+
+void TSOutput::setSplit(uint64_t size, int64_t duration)
+{
+	m_splitSize = size;
+	m_splitDuration = duration;
+}
+
+void TSOutput::queueVideoFrame(int64_t time)
+{
+	m_videoFrames.push_back(time);
+}
+
+void TSOutput::unqueueVideoFrame()
+{
+	if(!m_videoFrames.empty())
+		m_videoFrames.pop_back();
+}
+
+/**
+ * Should a new part start in front of @c pkt, i.e. does a key frame start
+ * here and is the current part long enough?
+ * */
+bool TSOutput::splitPoint(uint8_t* pkt, bool muxed)
+{
+	if(ts_pid(pkt) != m_videoPID || !ts_pusi(pkt))
+		return false;
+	
+	int64_t time = AV_NOPTS_VALUE;
+	
+	if(muxed)
+	{
+		if(m_videoFrames.empty())
+		{
+			log_warning("Video PES packet without a queued frame");
+			return false;
+		}
+		
+		time = m_videoFrames.front();
+		m_videoFrames.pop_front();
+	}
+	else if(ts_random_access(pkt))
+	{
+		uint8_t* pts;
+		uint8_t* dts;
+		
+		if(ts_pes_timestamps(pkt, &pts, &dts) && pts)
+			time = av_rescale_q(ts_read_timestamp(pts), (AVRational){1,90000}, AV_TIME_BASE_Q);
+	}
+	
+	if(time == AV_NOPTS_VALUE)
+		return false;
+	
+	if(m_partStart == AV_NOPTS_VALUE)
+	{
+		m_partStart = time;
+		return false;
+	}
+	
+	if((m_splitSize && m_partSize >= m_splitSize)
+		|| (m_splitDuration && time - m_partStart >= m_splitDuration))
+	{
+		m_partStart = time;
+		return true;
+	}
+	
+	return false;
+}
+
+/**
+ * Start a new part at the current sink position. The new part begins
+ * with the last PAT/PMT.
+ *
+ * @return non-zero on error
+ * */
+int TSOutput::startPart()
+{
+	log_debug("Starting new part");
+	
+	io_split_new_part(m_sink);
+	m_partSize = 0;
+	
+	if(!m_havePAT || !m_havePMT)
+		return 0;
+	
+	uint8_t psi[2 * TS_PACKET_SIZE];
+	memcpy(psi, m_pat, TS_PACKET_SIZE);
+	memcpy(psi + TS_PACKET_SIZE, m_pmt, TS_PACKET_SIZE);
+	
+	processPacket(psi);
+	processPacket(psi + TS_PACKET_SIZE);
+	
+	return sinkWrite(psi, 2 * TS_PACKET_SIZE);
+}
+
+void TSOutput::processPacket(uint8_t* pkt)
+{
+	int pid = ts_pid(pkt);
+	
+	m_partSize += TS_PACKET_SIZE;
+	
+	if(pid == TS_MAX_PID)
+		return;
+	
+	// Continuity counter
+	uint8_t& cc = m_cc[pid];
+	if(cc == CC_UNKNOWN)
+		cc = pkt[3] & 0x0F;
+	else if(ts_has_payload(pkt))
+		cc = (cc + 1) & 0x0F;
+	
+	pkt[3] = (pkt[3] & 0xF0) | cc;
+	
+	if(!ts_pusi(pkt))
+		return;
+	
+	if(pid == 0)
+	{
+		memcpy(m_pat, pkt, TS_PACKET_SIZE);
+		m_havePAT = true;
+		m_pmtPID = ts_pat_pmt_pid(pkt, -1);
+	}
+	else if(pid == m_pmtPID)
+	{
+		std::vector<int> pids;
+		std::vector<int> types;
+		int pcr_pid;
+		
+		if(ts_parse_pmt(pkt, &pcr_pid, &pids, &types))
+		{
+			memcpy(m_pmt, pkt, TS_PACKET_SIZE);
+			m_havePMT = true;
+			m_pcrPID = pcr_pid;
+			m_pids.swap(pids);
+			
+			m_videoPID = -1;
+			for(int i = 0; i < types.size(); ++i)
+			{
+				if(ts_video_stream_type(types[i]))
+				{
+					m_videoPID = m_pids[i];
+					break;
+				}
+			}
+		}
+	}
+	else
+	{
+		uint8_t* pts;
+		uint8_t* dts;
+		
+		if(ts_pes_timestamps(pkt, &pts, &dts) && pts && !m_lastPTS.empty())
+			m_lastPTS[pid] = ts_read_timestamp(pts);
+	}
+}
+
+const uint8_t* TSOutput::pat() const
+{
+	return m_havePAT ? m_pat : 0;
+}
+
+const uint8_t* TSOutput::pmt() const
+{
+	return m_havePMT ? m_pmt : 0;
+}
+
+bool TSOutput::hasPID(int pid) const
+{
+	return std::find(m_pids.begin(), m_pids.end(), pid) != m_pids.end();
+}
+
+int64_t TSOutput::lastPTS(int pid) const
+{
+	if(m_lastPTS.empty())
+		return AV_NOPTS_VALUE;
+	
+	return m_lastPTS[pid];
+}
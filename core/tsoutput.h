@@ -0,0 +1,171 @@
+// MPEG-TS output filter
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#ifndef TSOUTPUT_H
+#define TSOUTPUT_H
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+
+#include "mpegts.h"
+
+extern "C"
+{
+#include <libavformat/avio.h>
+}
+
+/**
+ * @brief Sits between the mpegts muxer and the actual output
+ *
+ * All packets written through context() and writePackets() get
+ * continuous continuity counters, no matter whether they were
+ * produced by the muxer or copied from the input. The latest PAT
+ * and PMT written by the muxer are kept so that they can be repeated
+ * in between raw packets.
+ *
+ * The output file (the sink) is only opened by open(), so that an output
+ * costs nothing but the muxer buffer of context() until then. If the sink
+ * is an io_split context, the packets are copied straight into its write
+ * buffers (see io_split_write()).
+ * */
+class TSOutput
+{
+	public:
+		/**
+		 * @param filename Output file, see openOutput()
+		 * @param split_size Passed to io_split_create()
+		 * @param flags Passed to io_split_create()
+		 * */
+		TSOutput(const char* filename, uint64_t split_size, int flags);
+		~TSOutput();
+		
+		/**
+		 * Open the output file.
+		 *
+		 * @return false on error
+		 * */
+		bool open();
+		
+		/**
+		 * Write out everything and close the output file. Nothing can be
+		 * written afterwards.
+		 *
+		 * @return non-zero if not all data could be written
+		 * */
+		int close();
+		
+		inline bool isOpen() const
+		{ return m_sink != 0; }
+		
+		//! IO context to be used by the muxer (AVFormatContext::pb)
+		inline AVIOContext* context() const
+		{ return m_ctx; }
+		
+		//! Get the TSOutput belonging to a context() (see openOutput())
+		static TSOutput* fromContext(AVIOContext* ctx);
+		
+		/**
+		 * Write raw TS packets. Muxer output buffered in context() is
+		 * written first. The packets are modified in place.
+		 *
+		 * @return non-zero on error
+		 * */
+		int writePackets(uint8_t* buf, int count);
+		
+		/**
+		 * @brief Keyframe aligned splitting
+		 * 
+		 * Requests that the output is split into parts at video
+		 * keyframes. The split happens right in front of the first TS
+		 * packet of the key frame's PES packet, when it is actually
+		 * written, so the muxer never needs to be flushed. Key frames of
+		 * muxed packets are announced by the Muxer (see
+		 * queueVideoFrame()), raw packets need the random access
+		 * indicator. Each new part begins with the last PAT/PMT.
+		 * 
+		 * The sink needs to be an io_split context with IO_SPLIT_MANUAL.
+		 * 
+		 * @param size Start a new part after this many bytes (0 = off)
+		 * @param duration Start a new part after this time
+		 *   (AV_TIME_BASE units, 0 = off)
+		 * */
+		void setSplit(uint64_t size, int64_t duration);
+		
+		inline uint64_t splitSize() const
+		{ return m_splitSize; }
+		inline int64_t splitDuration() const
+		{ return m_splitDuration; }
+		
+		inline bool splitting() const
+		{ return m_splitSize || m_splitDuration; }
+		
+		//! Bytes written since the start of the current part
+		inline uint64_t partSize() const
+		{ return m_partSize; }
+		
+		/**
+		 * Announce the next video packet given to the muxer. The mpegts
+		 * muxer writes one PES packet per video packet in the same
+		 * order, so this tells which PES packets start key frames.
+		 * 
+		 * @param time Key frame time (AV_TIME_BASE units), AV_NOPTS_VALUE
+		 *   for other frames
+		 * */
+		void queueVideoFrame(int64_t time);
+		
+		//! The muxer refused the last announced packet
+		void unqueueVideoFrame();
+		
+		//! Last PAT/PMT packet written by the muxer (NULL if none yet)
+		const uint8_t* pat() const;
+		const uint8_t* pmt() const;
+		
+		inline int pcrPID() const
+		{ return m_pcrPID; }
+		
+		//! Is @c pid an elementary stream listed in the PMT?
+		bool hasPID(int pid) const;
+		
+		//! Last PTS written on @c pid (AV_NOPTS_VALUE if unknown)
+		int64_t lastPTS(int pid) const;
+	private:
+		AVIOContext* m_ctx;
+		AVIOContext* m_sink;
+		bool m_direct;
+		
+		char m_filename[1024];
+		uint64_t m_sinkSplitSize;
+		int m_sinkFlags;
+		
+		uint8_t m_cc[TS_MAX_PID+1];
+		std::vector<int64_t> m_lastPTS; //!< Allocated by open()
+		
+		uint8_t m_carry[TS_PACKET_SIZE];
+		int m_carrySize;
+		
+		uint8_t m_pat[TS_PACKET_SIZE];
+		uint8_t m_pmt[TS_PACKET_SIZE];
+		bool m_havePAT;
+		bool m_havePMT;
+		int m_pmtPID;
+		int m_pcrPID;
+		std::vector<int> m_pids;
+		
+		uint64_t m_splitSize;
+		int64_t m_splitDuration;
+		uint64_t m_partSize;
+		int64_t m_partStart;
+		int m_videoPID;
+		std::deque<int64_t> m_videoFrames;
+		
+		static int writeCallback(void* opaque, uint8_t* buf, int size);
+		int write(uint8_t* buf, int size);
+		int output(uint8_t* buf, int count, bool muxed);
+		int sinkWrite(const uint8_t* buf, int size);
+		bool splitPoint(uint8_t* pkt, bool muxed);
+		int startPart();
+		void processPacket(uint8_t* pkt);
+};
+
+#endif // TSOUTPUT_H
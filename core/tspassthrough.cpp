@@ -0,0 +1,509 @@
+// Raw TS packet copying for unchanged regions
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#include "tspassthrough.h"
+#include "tsoutput.h"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define DEBUG 0
+#define LOG_PREFIX "[passthrough]"
+#include <common/log.h>
+
+// Input read size
+const int CHUNK_PACKETS = 4096;
+
+// Output write size
+const int OUT_PACKETS = 1024;
+
+// Repeat PAT/PMT every n packets (same as the mpegts muxer in VBR mode)
+const int PSI_PERIOD = 40;
+
+// How far to search for PAT/PMT at the beginning of the input
+const int64_t PSI_SEARCH_SIZE = 16LL * 1024 * 1024;
+
+// After the end of the span, PES packets still in progress are finished.
+// Give up if this takes longer than this (bytes).
+const int64_t MAX_TAIL = 16LL * 1024 * 1024;
+
+// Maximum tolerated difference of the learned offsets (90kHz ticks)
+const int64_t MAX_OFFSET_DIFF = 2;
+
+TSPassthrough::TSPassthrough(AVFormatContext* input, TSOutput* output)
+ : m_input(input)
+ , m_output(output)
+ , m_fd(-1)
+ , m_pcrPID(-1)
+ , m_program(-1)
+ , m_outputChecked(false)
+ , m_disabled(false)
+ , m_buf(0)
+ , m_out(0)
+ , m_outCount(0)
+ , m_bytesCopied(0)
+{
+}
+
+TSPassthrough::~TSPassthrough()
+{
+	if(m_fd >= 0)
+		close(m_fd);
+	
+	free(m_buf);
+	free(m_out);
+}
+
+bool TSPassthrough::init(const std::vector<int>& streams)
+{
+	if(strcmp(m_input->iformat->name, "mpegts") != 0)
+	{
+		log_warning("Input is not an MPEG-TS stream");
+		return false;
+	}
+	
+	m_fd = open(m_input->filename, O_RDONLY);
+	if(m_fd < 0)
+	{
+		log_warning("Could not open '%s' for raw reading: %s",
+			m_input->filename, strerror(errno));
+		return false;
+	}
+	
+	posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	
+	m_buf = (uint8_t*)malloc(CHUNK_PACKETS * TS_PACKET_SIZE);
+	m_out = (uint8_t*)malloc(OUT_PACKETS * TS_PACKET_SIZE);
+	if(!m_buf || !m_out)
+	{
+		log_warning("Could not allocate buffers");
+		return false;
+	}
+	
+	// We can only handle plain 188 byte packets (no M2TS)
+	int n = pread(m_fd, m_buf, 4 * TS_PACKET_SIZE, 0);
+	bool synced = false;
+	for(int i = 0; i < TS_PACKET_SIZE && i + 2 * TS_PACKET_SIZE < n; ++i)
+	{
+		if(m_buf[i] == TS_SYNC_BYTE
+			&& m_buf[i + TS_PACKET_SIZE] == TS_SYNC_BYTE
+			&& m_buf[i + 2 * TS_PACKET_SIZE] == TS_SYNC_BYTE)
+		{
+			synced = true;
+			break;
+		}
+	}
+	
+	if(!synced)
+	{
+		log_warning("Input does not consist of 188 byte TS packets");
+		return false;
+	}
+	
+	for(int i = 0; i < streams.size(); ++i)
+	{
+		int pid = m_input->streams[streams[i]]->id;
+		
+		if(pid <= 0 || pid >= TS_MAX_PID)
+		{
+			log_warning("Stream %d has no valid PID", streams[i]);
+			return false;
+		}
+		
+		PIDState st;
+		st.lastPos = -1;
+		st.lastPTS = AV_NOPTS_VALUE;
+		st.offset = 0;
+		st.started = false;
+		st.closed = false;
+		
+		m_pids[pid] = st;
+		m_streamPIDs[streams[i]] = pid;
+	}
+	
+	// All copied streams need to belong to the same program
+	for(int i = 0; i < m_input->nb_programs && m_program < 0; ++i)
+	{
+		AVProgram* program = m_input->programs[i];
+		int found = 0;
+		
+		for(int j = 0; j < program->nb_stream_indexes; ++j)
+		{
+			if(m_streamPIDs.count(program->stream_index[j]))
+				found++;
+		}
+		
+		if(found == m_streamPIDs.size())
+			m_program = program->id;
+	}
+	
+	if(m_program < 0)
+	{
+		log_warning("Copied streams do not belong to a single program");
+		return false;
+	}
+	
+	if(!findInputPCRPID())
+	{
+		log_warning("Could not find the PCR PID of program %d", m_program);
+		return false;
+	}
+	
+	if(!m_pids.count(m_pcrPID))
+	{
+		log_warning("PCR is not carried by one of the copied streams");
+		return false;
+	}
+	
+	m_startPTS = av_rescale_q(m_input->start_time, AV_TIME_BASE_Q, (AVRational){1, 90000});
+	
+	return true;
+}
+
+bool TSPassthrough::findInputPCRPID()
+{
+	int pmt_pid = -1;
+	
+	for(int64_t pos = 0; pos < PSI_SEARCH_SIZE; pos += CHUNK_PACKETS * TS_PACKET_SIZE)
+	{
+		int n = pread(m_fd, m_buf, CHUNK_PACKETS * TS_PACKET_SIZE, pos);
+		if(n <= 0)
+			break;
+		
+		for(int off = 0; off + TS_PACKET_SIZE <= n; )
+		{
+			const uint8_t* pkt = m_buf + off;
+			
+			if(*pkt != TS_SYNC_BYTE)
+			{
+				off++;
+				continue;
+			}
+			
+			int pid = ts_pid(pkt);
+			
+			if(pid == 0 && pmt_pid < 0)
+				pmt_pid = ts_pat_pmt_pid(pkt, m_program);
+			else if(pid == pmt_pid && ts_parse_pmt(pkt, &m_pcrPID, 0))
+				return true;
+			
+			off += TS_PACKET_SIZE;
+		}
+	}
+	
+	return false;
+}
+
+void TSPassthrough::packetDelivered(const AVPacket& packet)
+{
+	std::map<int, int>::const_iterator it = m_streamPIDs.find(packet.stream_index);
+	if(it == m_streamPIDs.end())
+		return;
+	
+	PIDState& st = m_pids[it->second];
+	
+	if(packet.pos > st.lastPos)
+		st.lastPos = packet.pos;
+	
+	st.lastPTS = packet.pts;
+}
+
+bool TSPassthrough::checkOutput()
+{
+	if(!m_output->pat() || !m_output->pmt())
+	{
+		log_warning("Muxer did not write PAT/PMT yet");
+		return false;
+	}
+	
+	if(m_output->pcrPID() != m_pcrPID)
+	{
+		log_warning("Muxer uses a different PCR PID (%d, input %d)",
+			m_output->pcrPID(), m_pcrPID);
+		return false;
+	}
+	
+	for(PIDMap::const_iterator it = m_pids.begin(); it != m_pids.end(); ++it)
+	{
+		if(!m_output->hasPID(it->first))
+		{
+			log_warning("PID %d is not mapped 1:1 by the muxer", it->first);
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+bool TSPassthrough::learnOffsets()
+{
+	for(PIDMap::iterator it = m_pids.begin(); it != m_pids.end(); ++it)
+	{
+		PIDState& st = it->second;
+		int64_t out = m_output->lastPTS(it->first);
+		
+		if(st.lastPTS == AV_NOPTS_VALUE || out == AV_NOPTS_VALUE)
+			return false;
+		
+		st.offset = (st.lastPTS - out) & TS_TIMESTAMP_MASK;
+	}
+	
+	// All streams went through the same cut list, so the offsets
+	// have to agree. Otherwise the last packet we saw was not the
+	// last one the muxer wrote.
+	int64_t ref = m_pids[m_pcrPID].offset;
+	for(PIDMap::const_iterator it = m_pids.begin(); it != m_pids.end(); ++it)
+	{
+		int64_t diff = (it->second.offset - ref) & TS_TIMESTAMP_MASK;
+		if(diff > TS_TIMESTAMP_MASK / 2)
+			diff = TS_TIMESTAMP_MASK + 1 - diff;
+		
+		if(diff > MAX_OFFSET_DIFF)
+		{
+			log_debug("Offset of PID %d differs by %lld ticks", it->first, diff);
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+bool TSPassthrough::rewritePacket(uint8_t* pkt, PIDState* st, int64_t end, bool* ending)
+{
+	if(ts_pusi(pkt))
+	{
+		uint8_t* pts;
+		uint8_t* dts;
+		
+		if(ts_pes_timestamps(pkt, &pts, &dts) && pts)
+		{
+			int64_t ts = ts_read_timestamp(pts);
+			int64_t rel = av_rescale((ts - m_startPTS) & TS_TIMESTAMP_MASK, AV_TIME_BASE, 90000);
+			
+			// Leave this and everything after it to the stream handlers
+			if(rel >= end)
+			{
+				*ending = true;
+				return false;
+			}
+			
+			ts_write_timestamp(pts, (ts - st->offset) & TS_TIMESTAMP_MASK);
+			
+			if(dts)
+			{
+				ts = ts_read_timestamp(dts);
+				ts_write_timestamp(dts, (ts - st->offset) & TS_TIMESTAMP_MASK);
+			}
+		}
+	}
+	
+	uint8_t* pcr = ts_pcr(pkt);
+	if(pcr)
+	{
+		int64_t base = ts_read_pcr_base(pcr);
+		ts_write_pcr_base(pcr, (base - st->offset) & TS_TIMESTAMP_MASK);
+	}
+	
+	return true;
+}
+
+int TSPassthrough::appendPacket(const uint8_t* pkt)
+{
+	memcpy(m_out + m_outCount * TS_PACKET_SIZE, pkt, TS_PACKET_SIZE);
+	
+	if(++m_outCount == OUT_PACKETS)
+		return flushOutput();
+	
+	return 0;
+}
+
+int TSPassthrough::flushOutput()
+{
+	int ret = m_output->writePackets(m_out, m_outCount);
+	
+	m_bytesCopied += m_outCount * TS_PACKET_SIZE;
+	m_outCount = 0;
+	
+	return ret;
+}
+
+int64_t TSPassthrough::copySpan(int64_t end, bool* eof)
+{
+	*eof = false;
+	
+	if(m_disabled)
+		return -1;
+	
+	if(!m_outputChecked)
+	{
+		if(!checkOutput())
+		{
+			log_warning("Disabling raw TS copying");
+			m_disabled = true;
+			return -1;
+		}
+		
+		m_outputChecked = true;
+	}
+	
+	if(!learnOffsets())
+		return -1;
+	
+	// Everything after the last delivered PES of each PID is ours
+	int64_t pos = -1;
+	for(PIDMap::iterator it = m_pids.begin(); it != m_pids.end(); ++it)
+	{
+		PIDState& st = it->second;
+		
+		if(st.lastPos < 0)
+			return -1;
+		
+		if(pos < 0 || st.lastPos < pos)
+			pos = st.lastPos;
+		
+		st.started = false;
+		st.closed = false;
+	}
+	
+	log_debug("Copying from byte pos %'10lld, offset %lld", pos, m_pids[m_pcrPID].offset);
+	
+	bool ending = false;
+	bool done = false;
+	int64_t endPos = -1;
+	int sincePSI = 0;
+	
+	while(!done)
+	{
+		int n = pread(m_fd, m_buf, CHUNK_PACKETS * TS_PACKET_SIZE, pos);
+		if(n < 0)
+		{
+			error("Could not read input: %s", strerror(errno));
+			break;
+		}
+		
+		int count = n / TS_PACKET_SIZE;
+		if(count == 0)
+		{
+			*eof = true;
+			break;
+		}
+		
+		for(int i = 0; i < count; ++i)
+		{
+			uint8_t* pkt = m_buf + i * TS_PACKET_SIZE;
+			int64_t ppos = pos + i * TS_PACKET_SIZE;
+			
+			if(*pkt != TS_SYNC_BYTE)
+			{
+				log_warning("Lost TS sync at byte pos %lld, stopping raw copy", ppos);
+				if(!ending)
+					endPos = ppos;
+				done = true;
+				break;
+			}
+			
+			if(ending && ppos - endPos > MAX_TAIL)
+			{
+				log_warning("Could not finish all PES packets after raw copy");
+				done = true;
+				break;
+			}
+			
+			PIDMap::iterator it = m_pids.find(ts_pid(pkt));
+			if(it == m_pids.end())
+				continue;
+			
+			PIDState& st = it->second;
+			bool pusi = ts_pusi(pkt);
+			
+			if(st.closed)
+				continue;
+			
+			if(!st.started)
+			{
+				// Skip the rest of the PES libavformat already delivered
+				if(!pusi || ppos <= st.lastPos)
+					continue;
+				st.started = true;
+			}
+			
+			if(ending && pusi)
+			{
+				st.closed = true;
+				continue;
+			}
+			
+			if(!rewritePacket(pkt, &st, end, &ending))
+			{
+				endPos = ppos;
+				st.closed = true;
+				
+				// PIDs without a PES in progress are done now
+				for(PIDMap::iterator pit = m_pids.begin(); pit != m_pids.end(); ++pit)
+				{
+					if(!pit->second.started)
+						pit->second.closed = true;
+				}
+				
+				continue;
+			}
+			
+			if(appendPacket(pkt) != 0)
+			{
+				error("Could not write output packet");
+				done = true;
+				break;
+			}
+			
+			if(++sincePSI == PSI_PERIOD)
+			{
+				appendPacket(m_output->pat());
+				appendPacket(m_output->pmt());
+				sincePSI = 0;
+			}
+		}
+		
+		pos += count * TS_PACKET_SIZE;
+		
+		if(ending)
+		{
+			done = true;
+			for(PIDMap::const_iterator it = m_pids.begin(); it != m_pids.end(); ++it)
+			{
+				if(!it->second.closed)
+					done = false;
+			}
+		}
+		
+		if(n < CHUNK_PACKETS * TS_PACKET_SIZE && !done)
+		{
+			*eof = !ending;
+			break;
+		}
+	}
+	
+	flushOutput();
+	
+	if(endPos < 0)
+		endPos = pos;
+	
+	// Everything before endPos has been written now. The offsets need
+	// to be learned again from the next delivered packets.
+	for(PIDMap::iterator it = m_pids.begin(); it != m_pids.end(); ++it)
+	{
+		it->second.lastPos = endPos - 1;
+		it->second.lastPTS = AV_NOPTS_VALUE;
+	}
+	
+	log_debug("Raw copy finished at byte pos %'10lld", endPos);
+	
+	return endPos;
+}
@@ -0,0 +1,99 @@
+// Raw TS packet copying for unchanged regions
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#ifndef TSPASSTHROUGH_H
+#define TSPASSTHROUGH_H
+
+#include <stdint.h>
+#include <map>
+#include <vector>
+
+#include "mpegts.h"
+
+class AVFormatContext;
+class AVPacket;
+class TSOutput;
+
+/**
+ * @brief Copies TS packets from input to output without demuxing
+ *
+ * While all stream handlers just pass their input through, the input
+ * file is read directly and the TS packets of the handled PIDs are
+ * written to the output. Only PTS/DTS/PCR values are shifted; the
+ * continuity counters are fixed up by TSOutput.
+ *
+ * The timestamp offset of each PID is learned from the last packet
+ * that went through libavformat, so it accounts for the cut out time
+ * as well as for any delay the muxer adds.
+ * */
+class TSPassthrough
+{
+	public:
+		TSPassthrough(AVFormatContext* input, TSOutput* output);
+		~TSPassthrough();
+		
+		/**
+		 * @param streams Input stream indices to copy. All other PIDs
+		 *   are dropped.
+		 * @return false if the input is not suitable for raw copying
+		 * */
+		bool init(const std::vector<int>& streams);
+		
+		/**
+		 * Needs to be called with each unmodified input packet before it
+		 * is passed to the stream handler.
+		 * */
+		void packetDelivered(const AVPacket& packet);
+		
+		/**
+		 * Copy everything not yet delivered by the demuxer up to time
+		 * @c end. The muxer must have been flushed before.
+		 *
+		 * @param end End time (AV_TIME_BASE units, relative to start)
+		 * @param eof Set to true if the end of the input was reached
+		 * @return Byte position where demuxing should continue, -1 if
+		 *   nothing was copied
+		 * */
+		int64_t copySpan(int64_t end, bool* eof);
+		
+		//! Total number of copied bytes
+		inline uint64_t bytesCopied() const
+		{ return m_bytesCopied; }
+	private:
+		struct PIDState
+		{
+			int64_t lastPos;    //!< Position of the last delivered PES
+			int64_t lastPTS;    //!< PTS of the last delivered packet
+			int64_t offset;     //!< input - output timestamp offset
+			bool started;
+			bool closed;
+		};
+		typedef std::map<int, PIDState> PIDMap;
+		
+		AVFormatContext* m_input;
+		TSOutput* m_output;
+		int m_fd;
+		
+		PIDMap m_pids;
+		std::map<int, int> m_streamPIDs; //!< stream index -> PID
+		int m_pcrPID;
+		int m_program;
+		bool m_outputChecked;
+		bool m_disabled;
+		
+		int64_t m_startPTS;
+		
+		uint8_t* m_buf;
+		uint8_t* m_out;
+		int m_outCount;
+		uint64_t m_bytesCopied;
+		
+		bool findInputPCRPID();
+		bool checkOutput();
+		bool learnOffsets();
+		bool rewritePacket(uint8_t* pkt, PIDState* st, int64_t end, bool* ending);
+		int appendPacket(const uint8_t* pkt);
+		int flushOutput();
+};
+
+#endif // TSPASSTHROUGH_H
@@ -2,6 +2,7 @@
 // Author: Max Schwarz <Max@x-quadraht.de>
 
 #include "h264.h"
+#include "../decoder.h"
 
 #define DEBUG 1
 #define LOG_PREFIX "[H264]"
@@ -11,42 +12,26 @@ extern "C"
 {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
-
-// ffmpeg h264 decoder internals
-#include <libavutil/imgutils.h>
-#include <libavcodec/internal.h>
-
-#define restrict __restrict
-#include <libavcodec/dsputil.h>
-#undef restrict
-
-#define class class_
-#include <libavutil/log.h>
-#include <libavcodec/h264.h>
-#include <libavcodec/get_bits.h>
-#include <libavcodec/golomb.h>
-#include <unistd.h>
-#undef class
 }
 
-const int ENCODE_BUFSIZE = 10 * 1024 * 1024;
+/**
+ * Frames x264 may look ahead for rate control. Together with frame
+ * threading, this is the encoder delay, which only costs memory here since
+ * the encoder is flushed at the sync point anyway. The slower presets ask
+ * for up to 60 frames, which is more than a whole boundary span.
+ * */
+static const int ENCODER_LOOKAHEAD = 10;
 
-static AVPacket copyPacket(const AVPacket& input)
-{
-	AVPacket ret;
-	av_init_packet(&ret);
-	ret.data = (uint8_t*)av_malloc(input.size);
-	ret.size = input.size;
-	
-	memcpy(ret.data, input.data, input.size);
-	
-	ret.flags = input.flags;
-	ret.pts = input.pts;
-	ret.dts = input.dts;
-	ret.stream_index = input.stream_index;
-	
-	return ret;
-}
+/**
+ * Key frame intervals after a cut in to wait for a clean random access
+ * point. Some streams have no IDR pictures and only recovery points with
+ * recovery_frame_cnt > 0 (or none at all), behind that we sync at the
+ * next key frame as without parsed headers.
+ * */
+static const int SYNC_FALLBACK_INTERVALS = 2;
+
+//! Frames to encode at least before syncing at a plain key frame
+static const int SYNC_FALLBACK_FRAMES = 20;
 
 static const char* tstoa(int64_t ts)
 {
@@ -61,122 +46,49 @@ static const char* tstoa(int64_t ts)
 	return buf;
 }
 
-static const char* dump_picture(Picture* p)
-{
-	const int BUFSIZE = 200;
-	static char buf[BUFSIZE+1];
-	
-	int b = 0;
-	
-	b = snprintf(buf, BUFSIZE,
-		"%c f.pts=%5s, frame_num=%3d, key=%d, ref=%c%c, poc=%4hd, ref0 = [",
-		av_get_picture_type_char(p->f.pict_type),
-		tstoa(p->f.pts), p->frame_num, p->f.key_frame,
-		(p->f.reference & PICT_FRAME) ? 'F' : '_',
-		(p->f.reference & DELAYED_PIC_REF) ? 'D' : '_',
-		p->field_poc[0]
-	);
-	
-	for(int i = 0; i < p->ref_count[0][0]; ++i)
-	{
-		b += snprintf(buf + b, BUFSIZE - b,
-			"%2hd ", p->ref_poc[0][0][i] / 4
-		);
-	}
-	
-	b += snprintf(buf + b, BUFSIZE - b, "] ref1 = [");
-	
-	for(int i = 0; i < p->ref_count[0][1]; ++i)
-	{
-		b += snprintf(buf + b, BUFSIZE - b,
-			"%2hd ", p->ref_poc[0][1][i] / 4
-		);
-	}
-	
-	strncpy(buf + b, "]", BUFSIZE - b);
-	
-	return buf;
-}
-
-static void dump_state(H264Context* h)
-{
-	log_debug("h264 internals:");
-	log_debug(" - long_ref:");
-	for(int i = 0; i < h->long_ref_count; ++i)
-		log_debug("    %2d: %10s", i, dump_picture(h->long_ref[i]));
-	
-	log_debug(" - ref_list 0:");
-	for(int i = 0; i < h->ref_count[0]; ++i)
-		log_debug("    %2d: %10s", i, dump_picture(&h->ref_list[0][i]));
-	log_debug(" - ref_list 1:");
-	for(int i = 0; i < h->ref_count[1]; ++i)
-		log_debug("    %2d: %10s", i, dump_picture(&h->ref_list[1][i]));
-	
-	log_debug(" - s.current_picture: %s", dump_picture(h->s.current_picture_ptr));
-	
-	log_debug(" - s.picture[]:");
-	for(int i = 0; i < h->s.picture_count; ++i)
-	{
-		const int BUFSIZE = 100;
-		char qualifiers[BUFSIZE+1];
-		Picture* p = h->s.picture + i;
-		
-		qualifiers[0] = 0;
-		
-		if(h->s.current_picture_ptr == p)
-			strncat(qualifiers, "(current) ", BUFSIZE);
-		if(h->s.next_picture_ptr == p)
-			strncat(qualifiers, "(next) ", BUFSIZE);
-		if(h->s.last_picture_ptr == p)
-			strncat(qualifiers, "(last) ", BUFSIZE);
-		
-		for(int j = 0; j < 2; ++j)
-		{
-			for(int k = 0; k < h->ref_count[k]; ++k)
-			{
-				if(h->ref_list[j][k].poc == p->poc
-					&& h->ref_list[j][k].frame_num == p->frame_num
-					&& p->f.pict_type != AV_PICTURE_TYPE_NONE)
-				{
-					const int R_BUFSIZE = 15;
-					char buf[R_BUFSIZE+1];
-					snprintf(buf, R_BUFSIZE, "(ref_%d_%02d) ", j, k);
-					strncat(qualifiers, buf, BUFSIZE);
-				}
-			}
-		}
-		
-		log_debug("    %2d: %s %s",
-			i, dump_picture(p),
-			qualifiers
- 		);
-	}
-}
-
 H264::H264(AVStream* stream)
  : StreamHandler(stream)
+ , m_keyFrames(stream->time_base, av_rescale_q(7, (AVRational){1,1}, stream->time_base))
+ , m_encoders(0)
+ , m_encoderCtx(0)
+ , m_outputPool(0)
 {
 	avcodec_get_frame_defaults(&m_frame);
 	
-	m_pps.data = 0;
-	m_sps.data = 0;
+	memset(m_spsCache, 0, sizeof(m_spsCache));
+	memset(m_ppsCache, 0, sizeof(m_ppsCache));
 }
 
 H264::~H264()
 {
+	accountFree(packetBufferBytes(m_syncBuffer));
+	freePacketBuffer(&m_syncBuffer);
+	
+	if(m_encoderCtx)
+		m_encoders->release(m_encoderCtx);
+	delete m_encoders;
+	
+	for(int i = 0; i < H264_MAX_SPS_COUNT; ++i)
+		free(m_spsCache[i].data);
+	for(int i = 0; i < H264_MAX_PPS_COUNT; ++i)
+		free(m_ppsCache[i].data);
+	
+	if(m_outputPool)
+	{
+		av_free_packet(&m_outputPacket);
+		m_outputPool->release();
+	}
 }
 
 int H264::init()
 {
-	AVCodec* decoder = avcodec_find_decoder(stream()->codec->codec_id);
-	if(!decoder)
+	AVCodec* codec = avcodec_find_decoder(stream()->codec->codec_id);
+	if(!codec)
 		return error("Could not find decoder");
 	
-	if(avcodec_open2(stream()->codec, decoder, NULL) != 0)
+	if(decoder()->open(codec) != 0)
 		return error("Could not open decoder");
 	
-	m_h = (H264Context*)stream()->codec->priv_data;
-	
 	m_codec = avcodec_find_encoder(stream()->codec->codec_id);
 	if(!m_codec)
 		return error("Could not find encoder");
@@ -185,8 +97,13 @@ int H264::init()
 	avcodec_copy_context(outputStream()->codec, stream()->codec);
 	
 	outputStream()->sample_aspect_ratio = outputStream()->codec->sample_aspect_ratio;
-	outputStream()->codec->thread_type = 0;
-	outputStream()->codec->thread_count = 1;
+	outputStream()->codec->thread_type = (options().codecThreads > 1) ? FF_THREAD_FRAME : 0;
+	outputStream()->codec->thread_count = options().codecThreads;
+	
+	// Copied and encoded packets may both use B-frames. The encoders
+	// have their own contexts (see EncoderPool), so this is set once
+	// before the header is written and the muxer never sees a change.
+	outputStream()->codec->has_b_frames = 6;
 	
 	AVCodecContext* ctx = outputStream()->codec;
 // 	ctx->bit_rate = 3 * 500 * 1024;
@@ -199,49 +116,102 @@ int H264::init()
 	ctx->colorspace = AVCOL_SPC_BT709;
 // 	ctx->flags2 |= CODEC_FLAG2_8X8DCT;
 	
+	char x264opts[64];
+	snprintf(x264opts, sizeof(x264opts), "rc-lookahead=%d:sync-lookahead=0",
+		ENCODER_LOOKAHEAD);
+	
+	AVDictionary* opts = 0;
+	av_dict_set(&opts, "profile", "main", 0);
+	av_dict_set(&opts, "preset", options().h264Preset, 0);
+	av_dict_set(&opts, "x264opts", x264opts, 0);
+	
+	// Every cut in needs a new encoder
+	m_encoders = new EncoderPool(m_codec, ctx, opts, 1, options().preopenEncoders);
+	av_dict_free(&opts);
+	
 	m_nc = cutList().nextCutPoint(0);
 	m_isCutout = m_nc->direction == CutPoint::IN;
+	setCutout(m_isCutout);
 	
-	m_startDecodeOffset = av_rescale_q(7, (AVRational){1,1}, stream()->time_base);
-	
-	m_encodeBuffer = (uint8_t*)av_malloc(ENCODE_BUFSIZE);
+	m_outputPool = new BufferPool(
+		avpicture_get_size(stream()->codec->pix_fmt,
+			stream()->codec->width, stream()->codec->height
+		) + FF_MIN_BUFFER_SIZE
+	);
+	m_outputPool->setMemStats(memStats());
+	av_init_packet(&m_outputPacket);
 	
 	m_encoding = false;
 	m_decoding = false;
 	m_syncing = false;
 	m_syncPoint = -1;
+	m_encFrameCount = 0;
+	m_encodeStart = AV_NOPTS_VALUE;
+	m_forceKeyFrame = true;
+	m_syncNeedsInsert = false;
+	m_lastCopyPTS = -1;
 	
 	return 0;
 }
 
 int H264::handlePacket(AVPacket* packet)
 {
-	int gotFrame;
+	int gotFrame = 0;
 	int bytes;
-	H264Context* h = (H264Context*)stream()->codec->priv_data;
 	
 	// Transform timestamps to relative timestamps
 	packet->dts = pts_rel(packet->dts);
 	packet->pts = pts_rel(packet->pts);
 	
-	if(m_decoding && !m_syncing)
-		parseNAL(packet->data, packet->size);
+	// Only the headers, this is cheap compared to decoding. If the
+	// parameter sets are still unknown, trust the demuxer.
+	bool parsed = m_parser.parsePacket(packet->data, packet->size) == 0;
+	bool key = parsed ? m_parser.randomAccess() : (packet->flags & AV_PKT_FLAG_KEY);
+	
+	cacheParameterSets(packet->data);
+	
+	if(key)
+		m_keyFrames.addKeyFrame(packet->pts);
 	
 	if(!m_decoding)
 	{
-		if(m_nc && m_nc->time - packet->pts < m_startDecodeOffset)
+		// Start decoding at the last random access point before the next
+		// cut in. A cut out does not need any decoding.
+		if(m_nc && m_nc->direction == CutPoint::IN && key)
 		{
-			log_debug("Switching decoder on at PTS %'10lld (m_nc: %'10lld)",
-				packet->pts, m_nc->time);
-			m_decoding = true;
+			bool start = m_keyFrames.decodeStart(packet->pts, m_nc->time);
 			
-			avcodec_flush_buffers(stream()->codec);
+			// No key frame in front of the cut point (e.g. right at the
+			// start of the input), the cut in is going to be late
+			if(!start && packet->pts > m_nc->time)
+			{
+				log_warning("No key frame before cut in at PTS %'10lld, decoding from PTS %'10lld",
+					m_nc->time, packet->pts);
+				start = true;
+			}
+			
+			if(start)
+			{
+				log_debug("Switching decoder on at PTS %'10lld (m_nc: %'10lld)",
+					packet->pts, m_nc->time);
+				m_decoding = true;
+				
+				decoder()->start(this);
+			}
 		}
 	}
 	
 	if(m_decoding)
 	{
-		if(avcodec_decode_video2(stream()->codec, &m_frame, &gotFrame, packet) < 0)
+		// Pictures in front of the cut that are never referenced are not
+		// needed at all. A shared decoder has to see the same pictures
+		// for everyone.
+		if(!m_encoding && parsed && m_parser.picture().nal_ref_idc == 0
+			&& m_nc && packet->pts < m_nc->time && !decoder()->shared())
+		{
+			log_debug("Not decoding non-reference picture at PTS %'10lld", packet->pts);
+		}
+		else if(decoder()->decodeVideo(&m_frame, &gotFrame, packet) < 0)
 			return error("Could not decode packet");
 	}
 	
@@ -249,8 +219,11 @@ int H264::handlePacket(AVPacket* packet)
 	{
 		if(m_nc->direction == CutPoint::OUT && m_nc->time < packet->dts)
 		{
+			if(m_decoding)
+				decoder()->stop(this);
 			m_decoding = false;
 			m_isCutout = true;
+			setCutout(true);
 			
 			int64_t current_time = m_nc->time;
 			m_nc = cutList().nextCutPoint(packet->dts);
@@ -264,27 +237,54 @@ int H264::handlePacket(AVPacket* packet)
 		{
 			m_encoding = true;
 			m_encFrameCount = 0;
+			m_encodeStart = packet->dts;
+			m_forceKeyFrame = true;
 			
-			log_debug("Opening encoder for frame with PTS %'10lld", packet->dts);
-
-			AVDictionary* opts = 0;
-			av_dict_set(&opts, "profile", "main", 0);
-			av_dict_set(&opts, "preset", "ultrafast", 0);
+			log_debug("Starting encoder for frame with PTS %'10lld (preset %s, %d threads)",
+				packet->dts, options().h264Preset, options().codecThreads);
 			
-			if(avcodec_open2(outputStream()->codec, m_codec, &opts) != 0)
-				return error("Could not open encoder");
+			m_encoderCtx = m_encoders->acquire();
+			if(!m_encoderCtx)
+				return error("Could not open encoder (preset '%s')", options().h264Preset);
 		}
 	}
 	
-	if(m_encoding && m_encFrameCount > 20 && packet->flags & AV_PKT_FLAG_KEY && h->s.current_picture_ptr)
+	// Go back to copying at the first picture that does not depend on
+	// anything before it. Its leading pictures come out of the decoder
+	// earlier and are still re-encoded. Without parsed headers, or if
+	// there is no such picture for too long, fall back to a keyframe some
+	// distance behind the cut.
+	bool fallback = m_encoding && (key || (packet->flags & AV_PKT_FLAG_KEY))
+		&& m_encFrameCount > SYNC_FALLBACK_FRAMES;
+	bool canSync;
+	
+	if(!parsed)
+		canSync = fallback;
+	else
+	{
+		canSync = m_parser.cleanRandomAccess();
+		
+		if(!canSync && fallback && m_encoding && !m_syncing
+			&& packet->pts - m_encodeStart > SYNC_FALLBACK_INTERVALS * m_keyFrames.interval())
+		{
+			log_warning("No clean random access point since cut in at PTS %'10lld, "
+				"syncing at key frame PTS %'10lld", m_encodeStart, packet->pts);
+			canSync = true;
+		}
+	}
+	
+	if(m_encoding && !m_syncing && canSync)
 	{
 		m_syncing = true;
 		m_syncPoint = packet->pts;
 		
-		log_debug("SYNC: start with keyframe packet PTS %'10lld", m_syncPoint);
-// 		log_debug("SYNC: frame_num of first original frame is %d",
-// 				h->s.current_picture_ptr->frame_num
-// 		);
+		// The encoder wrote its own parameter sets, probably with the
+		// same ids. The sync packet has to bring back the original ones.
+		m_syncNeedsInsert = missingParameterSets(&m_syncInsert);
+		
+		log_debug("SYNC: start with keyframe packet PTS %'10lld, frame_num %d",
+			m_syncPoint, m_parser.picture().frame_num
+		);
 	}
 
 	if(m_syncing)
@@ -292,24 +292,32 @@ int H264::handlePacket(AVPacket* packet)
 		log_debug("decode=%d, gotFrame=%d, keyframe=%d, t=%d", m_decoding, gotFrame, m_frame.key_frame, m_frame.pict_type);
 	}
 	
-	if(m_syncing && gotFrame && m_frame.pict_type == 1)
+	// All pictures in front of the sync point (in output order) are
+	// encoded once the decoder returns the sync picture itself
+	bool synced = false;
+	if(m_syncing && gotFrame)
+	{
+		if(m_frame.pkt_pts != AV_NOPTS_VALUE)
+			synced = m_frame.pkt_pts >= m_syncPoint;
+		else
+			synced = m_frame.pict_type == AV_PICTURE_TYPE_I;
+	}
+	
+	if(synced)
 	{
 		// Flush out encoder
 		while(1)
 		{
 			log_debug("SYNC: Flushing out encoder");
-			bytes = avcodec_encode_video(
-				outputStream()->codec,
-				m_encodeBuffer, ENCODE_BUFSIZE,
-				NULL
-			);
-			outputStream()->codec->has_b_frames = 6;
+			bytes = encodeFrame(NULL);
+			if(bytes < 0)
+				return error("SYNC: Could not flush encoder");
 			
 			if(!bytes)
 				break;
 			
-			int64_t pts = av_rescale_q(outputStream()->codec->coded_frame->pts,
-					outputStream()->codec->time_base, outputStream()->time_base
+			int64_t pts = av_rescale_q(m_encoderCtx->coded_frame->pts,
+					m_encoderCtx->time_base, outputStream()->time_base
 				);
 			
 			if(pts + totalCutout() >= m_syncPoint)
@@ -320,13 +328,16 @@ int H264::handlePacket(AVPacket* packet)
 				continue;
 			}
 			
-			if(writeOutputPacket(m_encodeBuffer, bytes, pts) != 0)
+			if(writeOutputPacket(&m_outputPacket, pts,
+					m_encoderCtx->coded_frame->key_frame) != 0)
 				return error("SYNC: (encoder) Could not write packet");
 		}
 		log_debug("SYNC: closing encoder");
-		avcodec_close(outputStream()->codec);
+		m_encoders->release(m_encoderCtx);
+		m_encoderCtx = 0;
 		
 		// Flush out sync buffer
+		accountFree(packetBufferBytes(m_syncBuffer));
 		for(int i = 0; i < m_syncBuffer.size(); ++i)
 		{
 			log_debug("SYNC: writing packet from buffer");
@@ -340,15 +351,23 @@ int H264::handlePacket(AVPacket* packet)
 				continue;
 			}
 			
-			if(writeInputPacket(packet) != 0)
+			const ParameterSetInsert* insert = 0;
+			if(m_syncNeedsInsert && packet->pts == m_syncPoint)
+				insert = &m_syncInsert;
+			
+			// Only the sync packet is copied (see copyPacket()), all
+			// others are passed on as they are
+			if(copyPacket(packet, insert) != 0)
 				return error("SYNC: (buffer) Could not write packet");
 		}
-		m_syncBuffer.clear();
+		freePacketBuffer(&m_syncBuffer);
 		
 		m_encoding = false;
 		m_isCutout = false;
+		setCutout(false);
 		m_decoding = false;
 		m_syncing = false;
+		decoder()->stop(this);
 		
 		log_debug("SYNC: finished, got keyframe from decoder with PTS %'10lld", packet->dts);
 		
@@ -357,29 +376,35 @@ int H264::handlePacket(AVPacket* packet)
 	
 	if(m_syncing)
 	{
-		m_syncBuffer.push_back(copyPacket(*packet));
+		// The buffer takes over the payload, packet stays readable
+		AVPacket buffered;
+		if(movePacket(&buffered, packet) != 0)
+			return -1;
+		
+		m_syncBuffer.push_back(buffered);
+		accountAlloc(buffered.size);
 	}
 	
 	if(m_encoding && gotFrame)
 	{
 		setFrameFields(&m_frame, packet->dts - totalCutout());
 		
-		bytes = avcodec_encode_video(
-			outputStream()->codec,
-			m_encodeBuffer, ENCODE_BUFSIZE,
-			&m_frame
-		);
-		outputStream()->codec->has_b_frames = 6;
+		bytes = encodeFrame(&m_frame);
+		if(bytes < 0)
+			return error("Could not encode frame");
+		
+		// Count input frames, a threaded encoder returns its output late
+		m_encFrameCount++;
 		
 		if(bytes)
 		{
 			writeOutputPacket(
-				m_encodeBuffer, bytes,
-				av_rescale_q(outputStream()->codec->coded_frame->pts,
-					outputStream()->codec->time_base, outputStream()->time_base
-				)
+				&m_outputPacket,
+				av_rescale_q(m_encoderCtx->coded_frame->pts,
+					m_encoderCtx->time_base, outputStream()->time_base
+				),
+				m_encoderCtx->coded_frame->key_frame
 			);
-			m_encFrameCount++;
 		}
 	}
 	
@@ -391,30 +416,18 @@ int H264::handlePacket(AVPacket* packet)
 			return 0;
 		}
 		
-		if(m_sps.data || m_pps.data)
-		{
-			int size = packet->size + m_sps.size + m_pps.size;
-			uint8_t* buf = (uint8_t*)malloc(size);
-			int off = 0;
-			
-			memcpy(buf + off, m_sps.data, m_sps.size);
-			off += m_sps.size;
-			memcpy(buf + off, m_pps.data, m_pps.size);
-			off += m_pps.size;
-			
-			memcpy(buf + off, packet->data, packet->size);
-			
-			writeOutputPacket(buf, size, packet->pts - totalCutout());
-			
-			free(m_sps.data); m_sps.data = 0;
-			free(m_pps.data); m_pps.data = 0;
-			free(buf);
-			return 0;
-		}
+		m_lastCopyPTS = packet->pts;
+		
+		// Make each random access point decodable on its own. The muxer
+		// needs the parameter sets and the slices in one contiguous
+		// buffer, so this copies the payload of each such key frame once
+		// (see copyPacket()). All other packets are passed on as they are.
+		ParameterSetInsert insert;
+		bool needInsert = options().repeatParameterSets && key
+			&& missingParameterSets(&insert);
 		
 // 		log_debug("COPY: packet with PTS %'10lld", packet->pts);
-		outputStream()->codec->has_b_frames = 6;
-		if(writeInputPacket(packet) != 0)
+		if(copyPacket(packet, needInsert ? &insert : 0) != 0)
 		{
 			log_debug("PTS buffer:");
 			
@@ -430,92 +443,217 @@ int H264::handlePacket(AVPacket* packet)
 	return 0;
 }
 
+void H264::seeked()
+{
+	m_decoding = false;
+	m_keyFrames.seeked();
+	m_parser.reset();
+	decoder()->seeked();
+}
+
+bool H264::copying() const
+{
+	// Leading frames of the sync GOP are still being dropped until we
+	// have seen a frame after the sync point.
+	if(m_syncPoint > 0 && m_lastCopyPTS <= m_syncPoint)
+		return false;
+	
+	// Raw TS copying would bypass the parameter set insertion
+	if(options().repeatParameterSets)
+		return false;
+	
+	return !m_decoding && !m_encoding && !m_isCutout;
+}
+
+int64_t H264::prerollTime() const
+{
+	return av_rescale_q(m_keyFrames.interval(), stream()->time_base, AV_TIME_BASE_Q);
+}
+
 void H264::setFrameFields(AVFrame* frame, int64_t pts)
 {
-	frame->pict_type = AV_PICTURE_TYPE_I;
+	// Only the first frame of each encoded run needs to be an I-Frame
+	// (see MP2V), x264 picks the frame types after that.
+	frame->pict_type = m_forceKeyFrame ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
 	frame->key_frame = 0;
+	m_forceKeyFrame = false;
 	frame->pkt_pts = AV_NOPTS_VALUE;
 	frame->pkt_dts = AV_NOPTS_VALUE;
 	frame->pts = av_rescale_q(
 		pts,
-		stream()->time_base, outputStream()->codec->time_base
+		stream()->time_base, m_encoderCtx->time_base
 	);
 }
 
-int H264::writeOutputPacket(uint8_t* buf, int size, int64_t pts)
+/**
+ * Encode @c frame (NULL to flush the encoder) into m_outputPacket.
+ *
+ * @return encoded size, negative on error
+ * */
+int H264::encodeFrame(AVFrame* frame)
 {
-	AVPacket packet;
-	av_init_packet(&packet);
+	// The last packet was taken over by the muxer, get a new buffer
+	if(!m_outputPacket.destruct && m_outputPool->alloc(&m_outputPacket) != 0)
+		return -1;
+	
+	int bytes = avcodec_encode_video(
+		m_encoderCtx,
+		m_outputPacket.data, m_outputPool->bufferSize(),
+		frame
+	);
 	
-	packet.data = buf;
-	packet.size = size;
-	packet.pts = pts;
-	packet.dts = AV_NOPTS_VALUE;
-	packet.flags = AV_PKT_FLAG_KEY;
+	if(bytes > 0)
+		m_outputPacket.size = bytes;
 	
-	return av_interleaved_write_frame(outputContext(), &packet);
+	return bytes;
 }
 
-static const int find_startCode(uint8_t* buf, int off, int size)
+/**
+ * Mux @c packet. The muxer takes over the payload if @c packet owns it.
+ * */
+int H264::writeOutputPacket(AVPacket* packet, int64_t pts, bool key)
 {
-	// Search for start code
-	for(; off < size - 4; ++off)
-	{
-		if(buf[off] == 0 && buf[off+1] == 0 && buf[off+2] == 0 && buf[off+3] == 1)
-			return off;
-	}
+	packet->stream_index = outputStream()->index;
+	packet->pts = pts;
+	packet->dts = AV_NOPTS_VALUE;
+	packet->flags = key ? AV_PKT_FLAG_KEY : 0;
 	
-	return -1;
+	return muxPacket(packet);
 }
 
-void H264::parseNAL(uint8_t* buf, int size)
+/**
+ * Remember the parameter sets in the packet just parsed by m_parser by id,
+ * so they can be repeated later. Streams usually repeat them unchanged, in
+ * which case nothing is copied.
+ * */
+void H264::cacheParameterSets(const uint8_t* buf)
 {
-	int off = find_startCode(buf, 0, size) + 4;
-	int next_start = off;
+	const std::vector<H264NALRef>& nals = m_parser.nalUnits();
 	
-	for(; next_start > 0; off = next_start + 4)
+	for(int i = 0; i < (int)nals.size(); ++i)
 	{
-		next_start = find_startCode(buf, off, size);
+		const H264NALRef& nal = nals[i];
+		DataBuffer* dest;
 		
-		int type = buf[off] & 0x1F;
-		int id_off = (type == NAL_PPS) ? 1 : 4;
+		// id is only set if the parameter set could be parsed
+		if(nal.id < 0)
+			continue;
 		
-		if(type != NAL_SPS && type != NAL_PPS)
+		if(nal.type == H264_NAL_SPS)
+			dest = &m_spsCache[nal.id];
+		else if(nal.type == H264_NAL_PPS)
+			dest = &m_ppsCache[nal.id];
+		else
 			continue;
 		
-		GetBitContext gb;
-		init_get_bits(&gb, buf + off + id_off, 8*(size - off - id_off));
+		const uint8_t* data = buf + nal.start;
+		int size = nal.end - nal.start;
 		
-		int id = get_ue_golomb(&gb);
-		int nal_size = (next_start < 0) ? (size - off) : (next_start - off);
+		if(dest->data && dest->size == size && memcmp(dest->data, data, size) == 0)
+			continue;
 		
-		switch(type)
+		if(dest->size != size || !dest->data)
 		{
-			case NAL_SPS:
-				if(id >= MAX_SPS_COUNT)
-					continue;
-				
-				free(m_sps.data);
-				m_sps.data = (uint8_t*)av_malloc(nal_size+4);
-				memcpy(m_sps.data, buf + off - 4, nal_size+4);
-				m_sps.size = nal_size+4;
-				
-				log_debug("NAL_SPS (id=%d)", id);
-				break;
-			case NAL_PPS:
-				if(id >= MAX_PPS_COUNT)
-					continue;
-				
-				free(m_pps.data);
-				m_pps.data = (uint8_t*)av_malloc(nal_size+4);
-				memcpy(m_pps.data, buf + off - 4, nal_size+4);
-				m_pps.size = nal_size+4;
-				
-				log_debug("NAL_PPS (id=%d)", id);
-				break;
+			free(dest->data);
+			dest->data = (uint8_t*)malloc(size);
+			if(!dest->data)
+			{
+				dest->size = 0;
+				continue;
+			}
+			dest->size = size;
 		}
+		memcpy(dest->data, data, size);
+		
+		log_debug("New %s (id=%d)", (nal.type == H264_NAL_SPS) ? "SPS" : "PPS", nal.id);
+	}
+}
+
+/**
+ * Find the cached parameter sets the picture in the packet just parsed by
+ * m_parser refers to, but does not carry itself.
+ *
+ * @return true if something has to be inserted
+ * */
+bool H264::missingParameterSets(ParameterSetInsert* insert) const
+{
+	const H264Picture& pic = m_parser.picture();
+	const std::vector<H264NALRef>& nals = m_parser.nalUnits();
+	
+	if(!pic.valid)
+		return false;
+	
+	insert->sps_id = m_spsCache[pic.sps_id].data ? pic.sps_id : -1;
+	insert->pps_id = m_ppsCache[pic.pps_id].data ? pic.pps_id : -1;
+	insert->offset = 0;
+	
+	for(int i = 0; i < (int)nals.size(); ++i)
+	{
+		const H264NALRef& nal = nals[i];
+		
+		if(nal.type == H264_NAL_AUD && i == 0)
+			insert->offset = nal.end;
+		else if(nal.type == H264_NAL_SPS && nal.id == pic.sps_id)
+			insert->sps_id = -1;
+		else if(nal.type == H264_NAL_PPS && nal.id == pic.pps_id)
+			insert->pps_id = -1;
 	}
+	
+	return insert->sps_id >= 0 || insert->pps_id >= 0;
 }
 
+/**
+ * Copy an input packet, with the parameter sets from @c insert (may be NULL)
+ * in front of its first slice.
+ *
+ * The muxer only takes contiguous payloads and the input packet has no room
+ * in front of its slices, so the packet is assembled in a single pass in a
+ * new buffer of the exact size, which the muxer then takes over.
+ * */
+int H264::copyPacket(AVPacket* packet, const ParameterSetInsert* insert)
+{
+	if(!insert)
+		return writeInputPacket(packet);
+	
+	const DataBuffer* sps = (insert->sps_id >= 0) ? &m_spsCache[insert->sps_id] : 0;
+	const DataBuffer* pps = (insert->pps_id >= 0) ? &m_ppsCache[insert->pps_id] : 0;
+	int size = packet->size + (sps ? sps->size : 0) + (pps ? pps->size : 0);
+	
+	AVPacket out;
+	if(av_new_packet(&out, size) != 0)
+		return error("Could not allocate packet");
+	
+	uint8_t* buf = out.data;
+	
+	memcpy(buf, packet->data, insert->offset);
+	buf += insert->offset;
+	
+	if(sps)
+	{
+		memcpy(buf, sps->data, sps->size);
+		buf += sps->size;
+	}
+	if(pps)
+	{
+		memcpy(buf, pps->data, pps->size);
+		buf += pps->size;
+	}
+	
+	memcpy(buf, packet->data + insert->offset, packet->size - insert->offset);
+	
+	log_debug("COPY: Inserting%s%s at PTS %'10lld",
+		sps ? " SPS" : "", pps ? " PPS" : "", packet->pts
+	);
+	
+	out.pts = packet->pts;
+	out.dts = packet->dts;
+	out.flags = packet->flags;
+	
+	// The muxer takes over the buffer, anything left is ours
+	int ret = writeInputPacket(&out);
+	av_free_packet(&out);
+	
+	return ret;
+}
 
 REGISTER_STREAM_HANDLER(CODEC_ID_H264, H264)
@@ -5,6 +5,11 @@
 #define H264_H
 
 #include "../streamhandler.h"
+#include "../packetbuffer.h"
+#include "../keyframetracker.h"
+#include "../encoderpool.h"
+
+#include <common/h264parser.h>
 
 #include <stdint.h>
 
@@ -19,7 +24,13 @@ struct DataBuffer
 	int size;
 };
 
-struct H264Context;
+//! Parameter sets to put in front of a copied packet
+struct ParameterSetInsert
+{
+	int sps_id;  //!< -1 if the packet carries it already
+	int pps_id;  //!< -1 if the packet carries it already
+	int offset;  //!< Insert position (behind an access unit delimiter)
+};
 
 class H264 : public StreamHandler
 {
@@ -29,14 +40,22 @@ class H264 : public StreamHandler
 		
 		virtual int init();
 		virtual int handlePacket(AVPacket* packet);
+		virtual int64_t prerollTime() const;
+		virtual void seeked();
+		virtual bool copying() const;
 	private:
-		typedef std::vector<AVPacket> PacketBuffer;
-		
-		H264Context* m_h;
-		int64_t m_startDecodeOffset;
+		H264Parser m_parser;
+		KeyFrameTracker m_keyFrames;
 		AVFrame m_frame;
 		AVCodec* m_codec;
-		uint8_t* m_encodeBuffer;
+		
+		// Encoder, only set while encoding
+		EncoderPool* m_encoders;
+		AVCodecContext* m_encoderCtx;
+		
+		// Encoder output (see MP2V)
+		BufferPool* m_outputPool;
+		AVPacket m_outputPacket;
 		
 		// State
 		bool m_decoding;
@@ -44,21 +63,31 @@ class H264 : public StreamHandler
 		bool m_isCutout;
 		bool m_syncing;
 		int m_encFrameCount;
+		int64_t m_encodeStart;
+		bool m_forceKeyFrame;
 		
 		const CutPoint* m_nc;
 		
 		PacketBuffer m_syncBuffer;
 		
 		int64_t m_syncPoint;
+		int64_t m_lastCopyPTS;
+		
+		// Last seen input parameter sets by id
+		DataBuffer m_spsCache[H264_MAX_SPS_COUNT];
+		DataBuffer m_ppsCache[H264_MAX_PPS_COUNT];
 		
-		// Input bitstream fragments to copy
-		DataBuffer m_sps;
-		DataBuffer m_pps;
+		// Parameter sets needed by the first packet after the sync point
+		ParameterSetInsert m_syncInsert;
+		bool m_syncNeedsInsert;
 		
 		void setFrameFields(AVFrame* frame, int64_t pts);
-		int writeOutputPacket(uint8_t* buf, int size, int64_t pts);
+		int encodeFrame(AVFrame* frame);
+		int writeOutputPacket(AVPacket* packet, int64_t pts, bool key);
 		
-		void parseNAL(uint8_t* buf, int size);
+		void cacheParameterSets(const uint8_t* buf);
+		bool missingParameterSets(ParameterSetInsert* insert) const;
+		int copyPacket(AVPacket* packet, const ParameterSetInsert* insert);
 };
 
 #endif // H264_H
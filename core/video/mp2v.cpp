@@ -2,6 +2,11 @@
 // Author: Max Schwarz <Max@x-quadraht.de>
 
 #include "mp2v.h"
+#include "../decoder.h"
+
+#include <common/startcode.h>
+
+#include <algorithm>
 
 #include <stdarg.h>
 #include <unistd.h>
@@ -22,8 +27,6 @@ extern "C"
 #define LOG_PREFIX "[MP2V]"
 #include <common/log.h>
 
-const int OUTPUT_BUFFER_SIZE = 10 * 1024 * 1024;
-
 #if DUMP_CUTIN_PACKETS
 static void dump_cutin_packet(const char* ext, int64_t pts, AVPacket* packet)
 {
@@ -40,34 +43,74 @@ inline void dump_cutin_packet(const char* ext, int64_t pts, AVPacket* packet)
 }
 #endif
 
-static AVPacket copyPacket(const AVPacket& input)
+// MPEG-2 start codes
+const uint8_t PICTURE_START_CODE = 0x00;
+const uint8_t GOP_START_CODE = 0xB8;
+
+// picture_coding_type
+enum PictureType
 {
-	AVPacket ret;
-	av_init_packet(&ret);
-	ret.data = (uint8_t*)av_malloc(input.size);
-	ret.size = input.size;
-	
-	memcpy(ret.data, input.data, input.size);
+	PICTURE_UNKNOWN = 0,
+	PICTURE_I = 1,
+	PICTURE_P = 2,
+	PICTURE_B = 3
+};
+
+/**
+ * Find the first start code with value @c code in packet
+ *
+ * @return pointer to the start code prefix (00 00 01) or NULL
+ * */
+static uint8_t* findStartCode(const AVPacket* packet, uint8_t code, int min_size)
+{
+	uint8_t* buf = packet->data;
+	int off = 0;
 	
-	ret.flags = input.flags;
-	ret.pts = input.pts;
-	ret.dts = input.dts;
-	ret.stream_index = input.stream_index;
+	while(1)
+	{
+		int pos = startcode_find(buf + off, packet->size - off);
+		if(pos < 0)
+			return 0;
+		
+		off += pos;
+		if(off + 4 + min_size > packet->size)
+			return 0;
+		
+		if(buf[off+3] == code)
+			return buf + off;
+		
+		off += 3;
+	}
+}
+
+static PictureType pictureType(const AVPacket* packet)
+{
+	uint8_t* p = findStartCode(packet, PICTURE_START_CODE, 2);
+	if(!p)
+		return PICTURE_UNKNOWN;
 	
-	return ret;
+	// temporal_reference (10 bits), picture_coding_type (3 bits)
+	return (PictureType)((p[5] >> 3) & 0x07);
 }
 
-static bool bufferContainsPTS(const MP2V::PacketBuffer& buffer, int64_t pts)
+/**
+ * Parse the GOP header in packet.
+ *
+ * @return GOP header (NULL if there is none)
+ * */
+static uint8_t* gopHeader(const AVPacket* packet, bool* closed, bool* broken)
 {
-	for(MP2V::PacketBuffer::const_iterator it = buffer.begin();
-		it != buffer.end(); ++it)
-	{
-		if(it->pts == pts)
-			return true;
-	}
+	uint8_t* p = findStartCode(packet, GOP_START_CODE, 4);
+	if(!p)
+		return 0;
+	
+	// time_code (25 bits), closed_gop, broken_link
+	*closed = p[7] & 0x40;
+	*broken = p[7] & 0x20;
 	
-	return false;
+	return p;
 }
+
 /*
 static void writePPM(const char* filename, AVPicture* src, PixelFormat src_fmt, int w, int h)
 {
@@ -108,16 +151,38 @@ static void writePPM(const char* filename, AVPicture* src, PixelFormat src_fmt,
 
 MP2V::MP2V(AVStream* stream)
  : StreamHandler(stream)
+ , m_frame(0)
+ , m_keyFrames(stream->time_base, av_rescale(2, stream->time_base.den, stream->time_base.num))
  , m_lastDirectPTS(0)
  , m_encoding(false)
  , m_decoding(false)
+ , m_forceKeyFrame(true)
+ , m_closedGOP(false)
+ , m_lastCopyPTS(0)
+ , m_encoders(0)
+ , m_encoderCtx(0)
+ , m_outputPool(0)
  , m_outputErrorCount(0)
 {
-	m_startDecodeOffset = av_rescale(2, stream->time_base.den, stream->time_base.num);
 }
 
 MP2V::~MP2V()
 {
+	accountFree(packetBufferBytes(m_copyPacketBuffer));
+	freePacketBuffer(&m_copyPacketBuffer);
+	freePacketBuffer(&m_encodedPacketBuffer);
+	
+	if(m_encoderCtx)
+		m_encoders->release(m_encoderCtx);
+	delete m_encoders;
+	
+	if(m_outputPool)
+	{
+		av_free_packet(&m_outputPacket);
+		m_outputPool->release();
+	}
+	
+	av_free(m_frame);
 }
 
 int MP2V::handlePacket(AVPacket* packet)
@@ -127,12 +192,29 @@ int MP2V::handlePacket(AVPacket* packet)
 	packet->dts = pts_rel(packet->dts);
 	packet->pts = pts_rel(packet->pts);
 	
+	if(packet->flags & AV_PKT_FLAG_KEY)
+		m_keyFrames.addKeyFrame(packet->pts);
+	
 	if(!m_encoding)
 	{
 		// Normal passthrough operation
 		int64_t time = packet->pts;
 		
-		if(m_nc && m_nc->time - m_startDecodeOffset < time && packet->flags & AV_PKT_FLAG_KEY)
+		// Start decoding at the last GOP before the cut point
+		bool start = m_nc && (packet->flags & AV_PKT_FLAG_KEY)
+			&& m_keyFrames.decodeStart(time, m_nc->time);
+		
+		// No key frame in front of the cut point (e.g. right at the start
+		// of the input), the cut is going to be late
+		if(m_nc && (packet->flags & AV_PKT_FLAG_KEY) && !start && !m_decoding
+			&& time > m_nc->time)
+		{
+			log_warning("No key frame before cut point at PTS %'10lld, decoding from PTS %'10lld",
+				m_nc->time, time);
+			start = true;
+		}
+		
+		if(start)
 		{
 			log_debug("NOTE:  %'10lld, switching to decoder for %s",
 				packet->dts - totalCutout(),
@@ -140,13 +222,20 @@ int MP2V::handlePacket(AVPacket* packet)
 			);
 			
 			m_decoding = true;
-			m_waitKeyFrames = 2;
+			decoder()->start(this);
+			
+			// Without knowing the GOP structure, we have to assume that
+			// the first GOP after a cut in still references frames
+			// before it. Minimal mode looks at the GOP header instead.
+			m_waitKeyFrames = options().minimalReencode ? 1 : 2;
+			m_closedGOP = false;
+			m_forceKeyFrame = true;
 		}
 	}
 	
 	if(m_decoding)
 	{
-		if(avcodec_decode_video2(stream()->codec, m_frame, &gotFrame, packet) < 0)
+		if(decoder()->decodeVideo(m_frame, &gotFrame, packet) < 0)
 			return error("Could not decode packet");
 		
 		if(gotFrame && m_frame->interlaced_frame)
@@ -154,7 +243,10 @@ int MP2V::handlePacket(AVPacket* packet)
 			if(!(outputStream()->codec->flags & CODEC_FLAG_INTERLACED_DCT))
 			{
 				log_debug("Got interlaced frame, enabling interlaced output");
+				lockOutputCodec();
 				outputStream()->codec->flags |= CODEC_FLAG_INTERLACED_DCT;
+				m_encoders->update(outputStream()->codec);
+				unlockOutputCodec();
 			}
 		}
 		
@@ -165,7 +257,20 @@ int MP2V::handlePacket(AVPacket* packet)
 		
 		if(!m_currentIsCutout)
 		{
-			if(gotFrame && packet->flags & AV_PKT_FLAG_KEY)
+			if(options().minimalReencode)
+			{
+				// Frames before the cut can be copied as long as they
+				// do not reference anything behind it. That ends with
+				// the first anchor frame behind the cut, only B-Frames
+				// in front of it need to be re-encoded.
+				if(!m_encoding && packet->pts >= m_nc->time && pictureType(packet) != PICTURE_B)
+				{
+					log_debug("NOTE:  %'10lld, anchor frame behind cut out, re-encoding",
+						packet->pts - totalCutout());
+					m_encoding = true;
+				}
+			}
+			else if(gotFrame && packet->flags & AV_PKT_FLAG_KEY)
 				m_encoding = true;
 			
 			if(gotFrame && m_nc && packet->dts >= m_nc->time)
@@ -174,6 +279,7 @@ int MP2V::handlePacket(AVPacket* packet)
 				m_decoding = false;
 				
 				m_currentIsCutout = true;
+				setCutout(true);
 				
 				int64_t current_time = m_nc->time;
 				m_nc = cutList().nextCutPoint(packet->dts);
@@ -183,7 +289,7 @@ int MP2V::handlePacket(AVPacket* packet)
 				else
 					setActive(false); // last cutpoint reached
 				
-				avcodec_flush_buffers(stream()->codec);
+				decoder()->stop(this);
 				
 				return 0;
 			}
@@ -193,22 +299,36 @@ int MP2V::handlePacket(AVPacket* packet)
 		
 		if(m_encoding)
 		{
-			if(!outputStream()->codec->codec)
+			if(!m_encoderCtx)
 			{
-				if(avcodec_open2(outputStream()->codec, m_encoder, 0) != 0)
+				m_encoderCtx = m_encoders->acquire();
+				if(!m_encoderCtx)
 					return error("Could not open encoder");
 				log_debug("NOTE:  %'10lld, encoder opened", packet->dts);
 			}
 			
-			// Reset some frame settings
-			m_frame->pict_type = AV_PICTURE_TYPE_I;
+			// Reset some frame settings. Only the first frame of each
+			// encoded run needs to be an I-Frame, the encoder is free to
+			// use P-Frames after that.
+			m_frame->pict_type = m_forceKeyFrame ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
 			m_frame->key_frame = 0;
 			m_frame->pkt_pts = AV_NOPTS_VALUE;
 			m_frame->pkt_dts = AV_NOPTS_VALUE;
-			m_frame->pts = av_rescale_q(packet->dts - totalCutout(), stream()->time_base, outputStream()->codec->time_base);
+			m_frame->pts = av_rescale_q(packet->dts - totalCutout(), stream()->time_base, m_encoderCtx->time_base);
 			
-			if(gotFrame)
-				bytes = avcodec_encode_video(outputStream()->codec, m_outputPacket.data, OUTPUT_BUFFER_SIZE, m_frame);
+			// Frames that are copied are not encoded at all. Otherwise a
+			// dropped encoded frame could be referenced by the next one.
+			if(gotFrame && frameCopied(packet->dts, packet))
+				log_debug("NOTE:  %'10lld, frame is copied, not encoding", packet->dts);
+			else if(gotFrame)
+			{
+				if(!m_outputPacket.destruct && m_outputPool->alloc(&m_outputPacket) != 0)
+					return -1;
+				
+				bytes = avcodec_encode_video(m_encoderCtx, m_outputPacket.data, m_outputPool->bufferSize(), m_frame);
+				if(bytes > 0)
+					m_forceKeyFrame = false;
+			}
 			else
 				log_debug("NOTE:  %'10lld, decoder not running yet", packet->dts);
 			
@@ -220,17 +340,19 @@ int MP2V::handlePacket(AVPacket* packet)
 				m_outputPacket.size = bytes;
 				m_outputPacket.pts = packet->dts - totalCutout();
 				m_outputPacket.dts = AV_NOPTS_VALUE;
-				m_outputPacket.flags = outputStream()->codec->coded_frame->key_frame ? AV_PKT_FLAG_KEY : 0;
+				m_outputPacket.flags = m_encoderCtx->coded_frame->key_frame ? AV_PKT_FLAG_KEY : 0;
 			}
 		}
 		
 		if(m_nc->direction == CutPoint::OUT)
 		{
-			if(!m_currentIsCutout && bytes && m_outputPacket.pts > m_lastDirectPTS)
+			int64_t last = options().minimalReencode ? m_lastCopyPTS : m_lastDirectPTS;
+			
+			if(!m_currentIsCutout && bytes && m_outputPacket.pts > last)
 			{
 				log_debug("WRITE: %'10lld, from encoder (cutout)", m_outputPacket.pts);
 				
-				if(av_interleaved_write_frame(outputContext(), &m_outputPacket) != 0)
+				if(muxPacket(&m_outputPacket) != 0)
 					return error("Could not write from cutout encoder (values after write: PTS = %'10lld, DTS = %'10lld\n",
 						m_outputPacket.pts, m_outputPacket.dts);
 			}
@@ -253,6 +375,19 @@ int MP2V::handlePacket(AVPacket* packet)
 					if(--m_waitKeyFrames == 0)
 					{
 						m_gopMinPTS = packet->pts;
+						
+						bool closed;
+						bool broken;
+						if(options().minimalReencode && gopHeader(packet, &closed, &broken))
+						{
+							// B-Frames in front of the I-Frame of a closed GOP
+							// only reference the I-Frame. After a broken link
+							// they cannot be decoded anyway.
+							m_closedGOP = closed && !broken;
+							
+							log_debug("NOTE:  %'10lld, first GOP after cut in is %s",
+								packet->pts - totalCutout(), m_closedGOP ? "closed" : "open");
+						}
 					}
 				}
 				
@@ -260,7 +395,7 @@ int MP2V::handlePacket(AVPacket* packet)
 				{
 					log_debug("WRITE: %'10lld, key=%d, Waiting for key frames",
 							m_outputPacket.pts, m_outputPacket.flags);
-					av_interleaved_write_frame(outputContext(), &m_outputPacket);
+					muxPacket(&m_outputPacket);
 				}
 				
 				if(!bytes)
@@ -272,10 +407,29 @@ int MP2V::handlePacket(AVPacket* packet)
 			
 			// Input packets need also to be cached to replay them later on
 			packet->stream_index = outputStream()->index;
-			AVPacket copy = copyPacket(*packet);
-			copy.dts = AV_NOPTS_VALUE;
-			if(copy.pts >= m_gopMinPTS)
+			if(packet->pts >= m_gopMinPTS || m_closedGOP)
+			{
+				// The buffer takes over the payload, packet stays readable
+				AVPacket copy;
+				if(movePacket(&copy, packet) != 0)
+					return -1;
+				copy.dts = AV_NOPTS_VALUE;
+				
+				// We replace the leading B-Frames of an open GOP, so it
+				// is closed now.
+				bool closed;
+				bool broken;
+				uint8_t* gop = gopHeader(&copy, &closed, &broken);
+				if(options().minimalReencode && m_copyPacketBuffer.empty() && gop && !closed)
+					gop[7] |= 0x40;
+				
 				m_copyPacketBuffer.push_back(copy);
+				m_copyPTS.insert(
+					std::lower_bound(m_copyPTS.begin(), m_copyPTS.end(), copy.pts),
+					copy.pts
+				);
+				accountAlloc(copy.size);
+			}
 			else
 			{
 				dump_cutin_packet("drop_input", packet->pts - totalCutout(), packet);
@@ -287,8 +441,11 @@ int MP2V::handlePacket(AVPacket* packet)
 			// input packets.
 			if(bytes)
 			{
-				if(!bufferContainsPTS(m_copyPacketBuffer, m_outputPacket.pts + totalCutout()))
-					m_encodedPacketBuffer.push_back(copyPacket(m_outputPacket));
+				if(!copiedPTS(m_outputPacket.pts + totalCutout()))
+				{
+					m_encodedPacketBuffer.push_back(m_outputPacket);
+					m_outputPacket.destruct = NULL;
+				}
 				else
 				{
 					dump_cutin_packet("drop_enc", m_outputPacket.pts, &m_outputPacket);
@@ -296,27 +453,27 @@ int MP2V::handlePacket(AVPacket* packet)
 				}
 			}
 			
-			if(m_copyPacketBuffer.size() > 1 && packet->flags & AV_PKT_FLAG_KEY)
+			// In minimal mode, we are done as soon as the decoder reaches
+			// the first copied frame. Everything in front of it is encoded
+			// by now.
+			bool done = options().minimalReencode && gotFrame && packet->dts >= m_gopMinPTS;
+			
+			if(done || (m_copyPacketBuffer.size() > 1 && packet->flags & AV_PKT_FLAG_KEY))
 			{
 				// End of GOP. Now we need to output all encoded packets before the
 				// first packet of the passthrough GOP
 				
-				int lastPTS = 0;
-				
 				for(PacketBuffer::iterator it = m_encodedPacketBuffer.begin();
 					it != m_encodedPacketBuffer.end(); ++it)
 				{
 					AVPacket& p = *it;
 					
-					if(p.pts > lastPTS)
-						lastPTS = p.pts;
-					
-					if(!bufferContainsPTS(m_copyPacketBuffer, p.pts + totalCutout()))
+					if(!copiedPTS(p.pts + totalCutout()))
 					{
 						log_debug("WRITE: %'10lld, from encoder buffer", p.pts);
 						dump_cutin_packet("enc", p.pts, &p);
 						
-						if(av_interleaved_write_frame(outputContext(), &p) != 0)
+						if(muxPacket(&p) != 0)
 							return error("Could not write packet from encoder buffer\n");
 					}
 					
@@ -325,6 +482,7 @@ int MP2V::handlePacket(AVPacket* packet)
 				m_encodedPacketBuffer.clear();
 				
 				// Now replay the buffered GOP
+				accountFree(packetBufferBytes(m_copyPacketBuffer));
 				for(PacketBuffer::iterator it = m_copyPacketBuffer.begin();
 					it != m_copyPacketBuffer.end(); ++it)
 				{
@@ -340,18 +498,20 @@ int MP2V::handlePacket(AVPacket* packet)
 					av_free_packet(&p);
 				}
 				m_copyPacketBuffer.clear();
+				m_copyPTS.clear();
 				
 				m_encoding = false;
 				m_decoding = false;
 				
-				avcodec_flush_buffers(outputStream()->codec);
-				avcodec_flush_buffers(stream()->codec);
+				decoder()->stop(this);
 				
-				avcodec_close(outputStream()->codec);
+				m_encoders->release(m_encoderCtx);
+				m_encoderCtx = 0;
 				
 				log_debug("Everything flushed.");
 				
 				m_currentIsCutout = false;
+				setCutout(false);
 				
 				m_nc = cutList().nextCutPoint(packet->dts);
 				
@@ -381,6 +541,9 @@ int MP2V::handlePacket(AVPacket* packet)
 
 				if(real_pts > m_lastDirectPTS)
 					m_lastDirectPTS = real_pts;
+				
+				if(packet->pts - totalCutout() > m_lastCopyPTS)
+					m_lastCopyPTS = packet->pts - totalCutout();
 			}
 		}
 	}
@@ -388,16 +551,63 @@ int MP2V::handlePacket(AVPacket* packet)
 	return 0;
 }
 
+/**
+ * Is the decoded frame with timestamp @c time (same time base as the
+ * cut list) going to be copied from the input anyway?
+ *
+ * @param packet The packet currently being decoded
+ * */
+bool MP2V::frameCopied(int64_t time, const AVPacket* packet) const
+{
+	// Before a cut out: everything up to the last copied frame
+	if(!m_currentIsCutout)
+	{
+		int64_t last = options().minimalReencode ? m_lastCopyPTS : m_lastDirectPTS;
+		return time - totalCutout() <= last;
+	}
+	
+	// After a cut in: the GOP we are going to copy. Without minimal mode
+	// the encoded frames are still needed to fill in dropped B-Frames.
+	if(m_waitKeyFrames != 0 || !options().minimalReencode)
+		return false;
+	
+	if(time >= m_gopMinPTS)
+		return true;
+	
+	return m_closedGOP
+		&& (time == packet->pts || copiedPTS(time));
+}
+
+/**
+ * Is a packet with this PTS in the GOP buffer?
+ *
+ * m_copyPTS is a sorted vector: O(log n) lookup, O(n) insert. It never
+ * holds more than one GOP.
+ * */
+bool MP2V::copiedPTS(int64_t pts) const
+{
+	return std::binary_search(m_copyPTS.begin(), m_copyPTS.end(), pts);
+}
+
 int MP2V::init()
 {
 	AVStream* ostream = outputStream();
 	
 	// Decoder init
-	AVCodec* decoder = avcodec_find_decoder(stream()->codec->codec_id);
-	if(!decoder)
+	AVCodec* codec = avcodec_find_decoder(stream()->codec->codec_id);
+	if(!codec)
 		return error("Could not find decoder, MPEG-2 support in ffmpeg disabled?");
 	
-	if(avcodec_open2(stream()->codec, decoder, 0) != 0)
+	// Slice threading does not add any decoder delay, so the frame
+	// timing below stays the same. A shared decoder is opened by the
+	// first handler.
+	if(!decoder()->isOpen())
+	{
+		decoder()->context()->thread_count = options().codecThreads;
+		decoder()->context()->thread_type = FF_THREAD_SLICE;
+	}
+	
+	if(decoder()->open(codec) != 0)
 		return error("Could not open decoder");
 	
 	// Output stream settings
@@ -420,6 +630,9 @@ int MP2V::init()
 	// Disable b-frames (this makes encoding more predictable)
 	ostream->codec->max_b_frames = 0;
 	
+	ostream->codec->thread_count = options().codecThreads;
+	ostream->codec->thread_type = FF_THREAD_SLICE;
+	
 	// MPEG-2 has time_base=1/50 and ticks_per_frame=1
 	//  but the encoder expects 1/fps
 	ostream->codec->time_base = av_mul_q(
@@ -427,31 +640,51 @@ int MP2V::init()
 	);
 	ostream->codec->ticks_per_frame = 1;
 	
+	m_encoders = new EncoderPool(m_encoder, ostream->codec, 0, 1, options().preopenEncoders);
+	
 	// Cut state
 	m_nc = cutList().nextCutPoint(0);
 	m_currentIsCutout = m_nc->direction == CutPoint::IN;
+	setCutout(m_currentIsCutout);
 	
-	// Decode buffer
-	int w = stream()->codec->width;
-	int h = stream()->codec->height;
-	PixelFormat f = stream()->codec->pix_fmt;
-	
+	// Decoded frames live in buffers of the decoder
 	m_frame = avcodec_alloc_frame();
-	avpicture_fill(
-		(AVPicture*)m_frame,
-		(uint8_t*)av_malloc(avpicture_get_size(f, w, h)),
-		f, w, h
+	if(!m_frame)
+		return error("Could not allocate frame");
+	
+	// Encoder buffers. An encoded frame is never larger than the raw
+	// picture. Written packets are taken over by the muxer and return
+	// their buffer once they are out. Nothing is allocated before the
+	// first frame is encoded.
+	m_outputPool = new BufferPool(
+		avpicture_get_size(stream()->codec->pix_fmt,
+			stream()->codec->width, stream()->codec->height
+		) + FF_MIN_BUFFER_SIZE
 	);
+	m_outputPool->setMemStats(memStats());
 	
-	// Encoder buffer
 	av_init_packet(&m_outputPacket);
 	m_outputPacket.stream_index = ostream->index;
 	m_outputPacket.dts = AV_NOPTS_VALUE;
-	m_outputPacket.data = (uint8_t*)av_malloc(OUTPUT_BUFFER_SIZE);
-	if(!m_outputPacket.data)
-		return error("Could not allocate output buffer");
 	
 	return 0;
 }
 
+void MP2V::seeked()
+{
+	m_decoding = false;
+	m_keyFrames.seeked();
+	decoder()->seeked();
+}
+
+bool MP2V::copying() const
+{
+	return !m_decoding && !m_encoding && !m_currentIsCutout;
+}
+
+int64_t MP2V::prerollTime() const
+{
+	return av_rescale_q(m_keyFrames.interval(), stream()->time_base, AV_TIME_BASE_Q);
+}
+
 REGISTER_STREAM_HANDLER(CODEC_ID_MPEG2VIDEO, MP2V)
@@ -5,29 +5,37 @@
 #define MP2V_H
 
 #include "../streamhandler.h"
+#include "../packetbuffer.h"
+#include "../keyframetracker.h"
+#include "../encoderpool.h"
 
 extern "C"
 {
 #include <libavcodec/avcodec.h>
 }
 
-#include <map>
+#include <vector>
 
 class MP2V : public StreamHandler
 {
 	public:
-		typedef std::vector<AVPacket> PacketBuffer;
-		
 		MP2V(AVStream* stream);
 		virtual ~MP2V();
 		
 		virtual int handlePacket(AVPacket* packet);
 		virtual int init();
+		virtual int64_t prerollTime() const;
+		virtual void seeked();
+		virtual bool copying() const;
 	private:
 		AVCodec* m_encoder;
 		AVFrame* m_frame;
 		
-		int64_t m_startDecodeOffset;
+		// Opened on the first encoded frame, closed after each cut in
+		EncoderPool* m_encoders;
+		AVCodecContext* m_encoderCtx;
+		
+		KeyFrameTracker m_keyFrames;
 		
 		bool m_decoding;
 		bool m_encoding;
@@ -37,6 +45,19 @@ class MP2V : public StreamHandler
 		
 		int m_waitKeyFrames;
 		
+		// The next encoded frame needs to be an I-Frame
+		bool m_forceKeyFrame;
+		
+		// Minimal re-encoding (see HandlerOptions::minimalReencode)
+		bool m_closedGOP;
+		int64_t m_lastCopyPTS;
+		
+		bool frameCopied(int64_t time, const AVPacket* packet) const;
+		bool copiedPTS(int64_t pts) const;
+		
+		// Encoder output, m_outputPacket.destruct is NULL if it has
+		// been written or buffered and a new buffer is needed.
+		BufferPool* m_outputPool;
 		AVPacket m_outputPacket;
 		
 		// Timestamp handling
@@ -45,6 +66,7 @@ class MP2V : public StreamHandler
 		
 		// Buffering
 		PacketBuffer m_copyPacketBuffer;
+		std::vector<int64_t> m_copyPTS; //!< PTS of m_copyPacketBuffer, sorted
 		PacketBuffer m_encodedPacketBuffer;
 
 		int m_outputErrorCount;
@@ -16,6 +16,8 @@
 #include "gldisplay.h"
 #include "io_http.h"
 
+#include <common/io_file.h>
+
 #define DEBUG 0
 #define PACKET_DEBUG 0
 #define LOG_PREFIX "[editor]"
@@ -126,7 +128,7 @@ int Editor::loadFile(const QString& filename)
 	for(tries = 5; tries > 0; --tries)
 	{
 		m_stream = 0;
-		if(avformat_open_input(&m_stream, m_filename.toAscii().constData(), NULL, NULL) != 0)
+		if(io_file_open_input(&m_stream, m_filename.toAscii().constData(), 0) != 0)
 			return error("Could not open input stream '%s'",
 				m_filename.toAscii().constData());
 		
@@ -142,7 +144,7 @@ int Editor::loadFile(const QString& filename)
 				m_stream->duration / AV_TIME_BASE,
 				m_stream->nb_streams
 			);
-			avformat_free_context(m_stream);
+			io_file_close_input(&m_stream);
 			continue;
 		}
 		
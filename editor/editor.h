@@ -10,7 +10,7 @@
 #include "cutpointlist.h"
 #include "cutpointmodel.h"
 
-#include "indexfile.h"
+#include <common/indexfile.h>
 
 extern "C"
 {
@@ -7,7 +7,7 @@
 #include <getopt.h>
 
 #include "editor.h"
-#include "indexfile.h"
+#include <common/indexfile.h>
 
 void dump_indexFormats()
 {
@@ -3,24 +3,14 @@
 
 extern "C"
 {
-#define class class_
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
-
-// ffmpeg h264 decoder internals
-#include <libavutil/imgutils.h>
-#include <libavcodec/internal.h>
-
-#define restrict __restrict
-#include <libavcodec/dsputil.h>
-#undef restrict
-
-#include <libavcodec/h264.h>
-#undef class
 }
 
 #include <stdarg.h>
 
+#include <common/h264parser.h>
+
 #define DEBUG 1
 #define LOG_PREFIX "[H264]"
 #include <common/log.h>
@@ -38,141 +28,68 @@ static const char* tstoa(int64_t ts)
 	return buf;
 }
 
-static const char* dump_picture(Picture* p)
+static char slice_type_char(int type)
 {
-	const int BUFSIZE = 200;
-	static char buf[BUFSIZE+1];
-	
-	int b = 0;
-	
-	b = snprintf(buf, BUFSIZE,
-		"%c f.pts=%5s, frame_num=%3d, key=%d, ref=%c%c, poc=%4hd, ref0 = [",
-		av_get_picture_type_char(p->f.pict_type),
-		tstoa(p->f.pts), p->frame_num, p->f.key_frame,
-		(p->f.reference & PICT_FRAME) ? 'F' : '_',
-		(p->f.reference & DELAYED_PIC_REF) ? 'D' : '_',
-		p->field_poc[0]
-	);
-	
-	for(int i = 0; i < p->ref_count[0][0]; ++i)
-	{
-		b += snprintf(buf + b, BUFSIZE - b,
-			"%2hd ", p->ref_poc[0][0][i] / 4
-		);
-	}
-	
-	b += snprintf(buf + b, BUFSIZE - b, "] ref1 = [");
-	
-	for(int i = 0; i < p->ref_count[0][1]; ++i)
+	switch(type)
 	{
-		b += snprintf(buf + b, BUFSIZE - b,
-			"%2hd ", p->ref_poc[0][1][i] / 4
-		);
+		case H264_SLICE_P:  return 'P';
+		case H264_SLICE_B:  return 'B';
+		case H264_SLICE_I:  return 'I';
+		case H264_SLICE_SP: return 'p';
+		case H264_SLICE_SI: return 'i';
 	}
 	
-	strncpy(buf + b, "]", BUFSIZE - b);
-	
-	return buf;
+	return '?';
 }
 
-static void dump_state(H264Context* h)
+static void dump_packet(const H264Parser& parser, const AVPacket& packet)
 {
-	log_debug("h264 internals:");
-	log_debug(" - long_ref:");
-	for(int i = 0; i < h->long_ref_count; ++i)
-		log_debug("    %2d: %10s", i, dump_picture(h->long_ref[i]));
-	
-	log_debug(" - ref_list 0:");
-	for(int i = 0; i < h->ref_count[0]; ++i)
-		log_debug("    %2d: %10s", i, dump_picture(&h->ref_list[0][i]));
-	log_debug(" - ref_list 1:");
-	for(int i = 0; i < h->ref_count[1]; ++i)
-		log_debug("    %2d: %10s", i, dump_picture(&h->ref_list[1][i]));
-	
-	log_debug(" - s.current_picture: %s", dump_picture(h->s.current_picture_ptr));
-	
-	log_debug(" - s.picture[]:");
-	for(int i = 0; i < 8; ++i)
+	const std::vector<H264NALRef>& nals = parser.nalUnits();
+	const H264Picture& pic = parser.picture();
+	
+	for(int i = 0; i < (int)nals.size(); ++i)
 	{
-		const int BUFSIZE = 100;
-		char qualifiers[BUFSIZE+1];
-		Picture* p = h->s.picture + i;
-		
-		qualifiers[0] = 0;
-		
-		if(h->s.current_picture_ptr == p)
-			strncat(qualifiers, "(current) ", BUFSIZE);
-		if(h->s.next_picture_ptr == p)
-			strncat(qualifiers, "(next) ", BUFSIZE);
-		if(h->s.last_picture_ptr == p)
-			strncat(qualifiers, "(last) ", BUFSIZE);
-		if(h->s.current_picture_ptr->mmco_reset)
-			strncat(qualifiers, "(MMCO_RESET) ", BUFSIZE);
-		
-		for(int j = 0; j < 2; ++j)
+		if(nals[i].type == H264_NAL_SPS || nals[i].type == H264_NAL_PPS)
 		{
-			for(int k = 0; k < h->ref_count[k]; ++k)
-			{
-				if(h->ref_list[j][k].poc == p->poc
-					&& h->ref_list[j][k].frame_num == p->frame_num
-					&& p->f.pict_type != AV_PICTURE_TYPE_NONE)
-				{
-					const int R_BUFSIZE = 15;
-					char buf[R_BUFSIZE+1];
-					snprintf(buf, R_BUFSIZE, "(ref_%d_%02d) ", j, k);
-					strncat(qualifiers, buf, BUFSIZE);
-				}
-			}
+			log_debug("  %s id=%d, %d bytes",
+				(nals[i].type == H264_NAL_SPS) ? "SPS" : "PPS",
+				nals[i].id, nals[i].end - nals[i].start
+			);
 		}
-		
-		log_debug("    %2d: %s %s",
-			i, dump_picture(p),
-			qualifiers
- 		);
 	}
 	
-	log_debug(" - pps_buffer[]:");
-	for(int i = 0; i < MAX_PPS_COUNT; ++i)
+	if(!pic.valid)
 	{
-		PPS* p = h->pps_buffers[i];
-		
-		if(!p)
-			continue;
-		
-		log_debug("    %2d: %s",
-			i,
-			(p->sps_id == h->pps.sps_id) ? "(current)" : ""
-		);
+		log_debug("pts=%s: no decodable slice", tstoa(packet.pts));
+		return;
 	}
 	
-	log_debug(" - sps_buffer[]:");
-	for(int i = 0; i < MAX_SPS_COUNT; ++i)
-	{
-		SPS* s = h->sps_buffers[i];
-		
-		if(!s)
-			continue;
-		
-		if(i != 0)
-			getc(stdin);
-		
-		log_debug("    %2d: poc_type=%d, ref_count=%d, colorspace=%d, mb_width=%d, mb_height=%d %s",
-			i,
-			s->poc_type, s->ref_frame_count, s->colorspace,
-			s->mb_width, s->mb_height,
-			(i == h->pps.sps_id) ? "(current)" : ""
-		);
-	}
+	log_debug("pts=%s dts=%s: %c%s frame_num=%3d, poc=%4d, ref=%d%s%s",
+		tstoa(packet.pts), tstoa(packet.dts),
+		slice_type_char(pic.slice_type),
+		pic.field ? (pic.bottom_field ? " (bottom)" : " (top)") : "",
+		pic.frame_num, pic.poc, pic.nal_ref_idc,
+		pic.idr ? ", IDR" : "",
+		parser.randomAccess() ? ", random access" : ""
+	);
+	
+	if(pic.recovery_frame_cnt >= 0)
+		log_debug("  %d frames to recovery point", pic.recovery_frame_cnt);
 }
 
 int main(int argc, char** argv)
 {
 	AVFormatContext* ctx = 0;
-	AVCodec* decoder;
 	AVStream* stream = 0;
 	
 	av_register_all();
 	
+	if(argc < 2)
+	{
+		fprintf(stderr, "Usage: h264dumper <file>\n");
+		return 1;
+	}
+	
 	if(avformat_open_input(&ctx, argv[1], NULL, NULL) != 0)
 		return error("Could not open input file");
 	
@@ -197,42 +114,21 @@ int main(int argc, char** argv)
 	if(!stream)
 		return error("No H.264 stream found");
 	
-	decoder = avcodec_find_decoder(stream->codec->codec_id);
-	if(!decoder)
-		return error("No H.264 support in ffmpeg");
-	
-	if(avcodec_open2(stream->codec, decoder, NULL) != 0)
-		return error("Could not open decoder");
-	
 	AVPacket packet;
-	AVFrame frame;
-	int gotFrame;
-	avcodec_get_frame_defaults(&frame);
-	
-	H264Context* h264 = (H264Context*)stream->codec->priv_data;
+	H264Parser parser;
 	
 	while(av_read_frame(ctx, &packet) == 0)
 	{
-		if(packet.stream_index != stream->index)
-			continue;
-		
-		FILE* f = fopen("packet.264", "wb");
-		fwrite(packet.data, sizeof(uint8_t), packet.size, f);
-		fclose(f);
-		
-		if(avcodec_decode_video2(stream->codec, &frame, &gotFrame, &packet) < 0)
-			return error("Could not decode video packet");
-		
-		log_debug("%d frames to recovery point", h264->sei_recovery_frame_cnt);
-		dump_state(h264);
-		
-		getc(stdin);
+		if(packet.stream_index == stream->index)
+		{
+			parser.parsePacket(packet.data, packet.size);
+			dump_packet(parser, packet);
+		}
 		
-// 		if(h264->mmco[h264->mmco_index].opcode == MMCO_RESET
-// 			|| h264->sei_recovery_frame_cnt != -1
-// 		)
-// 		{
-// 			getc(stdin);
-// 		}
+		av_free_packet(&packet);
 	}
+	
+	avformat_close_input(&ctx);
+	
+	return 0;
 }
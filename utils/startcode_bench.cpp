@@ -0,0 +1,144 @@
+// Start code scanner benchmark
+// Author: Max Schwarz <Max@x-quadraht.de>
+
+#include <common/startcode.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define DEBUG 0
+#define LOG_PREFIX "[startcode_bench]"
+#include <common/log.h>
+
+const int BUFSIZE = 64 * 1024 * 1024;
+const int ROUNDS = 10;
+
+// Average distance between two start codes, roughly one slice
+const int NAL_SIZE = 8 * 1024;
+
+// The byte loop formerly used by the H.264 handler (4 byte codes only)
+static int find_startCode(const uint8_t* buf, int off, int size)
+{
+	for(; off < size - 4; ++off)
+	{
+		if(buf[off] == 0 && buf[off+1] == 0 && buf[off+2] == 0 && buf[off+3] == 1)
+			return off;
+	}
+	
+	return -1;
+}
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/**
+ * Something that looks like coded video: random data with emulation
+ * prevention applied and a start code every NAL_SIZE bytes on average.
+ * */
+static void fill(uint8_t* buf, int size)
+{
+	int zeros = 0;
+	
+	for(int i = 0; i < size; ++i)
+	{
+		if(i + 4 < size && rand() % NAL_SIZE == 0)
+		{
+			buf[i++] = 0;
+			buf[i++] = 0;
+			buf[i++] = 0;
+			buf[i] = 1;
+			zeros = 0;
+			continue;
+		}
+		
+		uint8_t b = rand() & 0xFF;
+		
+		// Make zero bytes more common than in random data
+		if(rand() % 8 == 0)
+			b = 0;
+		
+		if(zeros >= 2 && b <= 3)
+		{
+			buf[i] = 3;
+			zeros = 0;
+			continue;
+		}
+		
+		buf[i] = b;
+		zeros = (b == 0) ? zeros + 1 : 0;
+	}
+}
+
+static int count_old(const uint8_t* buf, int size)
+{
+	int count = 0;
+	
+	for(int off = find_startCode(buf, 0, size); off >= 0; off = find_startCode(buf, off + 4, size))
+		count++;
+	
+	return count;
+}
+
+static int count_new(const uint8_t* buf, int size)
+{
+	int count = 0;
+	int off = 0;
+	
+	while(1)
+	{
+		int pos = startcode_find(buf + off, size - off);
+		if(pos < 0)
+			break;
+		
+		count++;
+		off += pos + 3;
+	}
+	
+	return count;
+}
+
+static void run(const char* name, int (*func)(const uint8_t*, int), const uint8_t* buf, int size)
+{
+	int count = 0;
+	double start = now();
+	
+	for(int i = 0; i < ROUNDS; ++i)
+		count = func(buf, size);
+	
+	double secs = now() - start;
+	
+	printf("%-8s %8.1f MiB/s (%d start codes)\n",
+		name, (double)size * ROUNDS / secs / 1024.0 / 1024.0, count
+	);
+}
+
+int main(int argc, char** argv)
+{
+	uint8_t* buf = (uint8_t*)malloc(BUFSIZE);
+	if(!buf)
+		return error("Could not allocate buffer");
+	
+	srand(42);
+	fill(buf, BUFSIZE);
+	
+	run("loop", &count_old, buf, BUFSIZE);
+	
+	const StartCodeImpl impls[] = {STARTCODE_SCALAR, STARTCODE_SSE2, STARTCODE_AVX2};
+	for(unsigned int i = 0; i < sizeof(impls) / sizeof(impls[0]); ++i)
+	{
+		if(!startcode_select(impls[i]))
+			continue;
+		
+		run(startcode_impl_name(), &count_new, buf, BUFSIZE);
+	}
+	
+	free(buf);
+	return 0;
+}